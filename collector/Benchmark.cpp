@@ -0,0 +1,450 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Microbenchmarks of the receive path: splitting streams into frames and
+ * validating and decoding the frames, per frame, and replaying the streams
+ * through IoHandler into a database that throws the samples away, per
+ * stored sample. The replay goes through the same readComplete() as live
+ * data, so it covers everything done per chunk and sample. Run "make
+ * bench", or "wmrbench journal..." to also measure streams recorded with
+ * --record. Every benchmark runs a pass over its data until minDuration
+ * is reached, and reports the time and the heap allocations per item. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/bind.hpp>
+#include <boost/function.hpp>
+#include "Database.h"
+#include "FrameParser.h"
+#include "IoHandler.h"
+#include "Journal.h"
+#include "NullDatabase.h"
+#include "Options.h"
+#include "RecordParser.h"
+#include "SampleBatch.h"
+#include "WmrMessage.h"
+
+static unsigned long g_allocations = 0;
+
+void *
+operator new(size_t size)
+{
+    void *p;
+
+    g_allocations++;
+    p = malloc(size ? size : 1);
+    if (!p) {
+	throw std::bad_alloc();
+    }
+    return p;
+}
+
+void
+operator delete(void *p) throw()
+{
+    free(p);
+}
+
+/* swallows the summary the handler prints after every replay */
+class DiscardBuffer : public std::streambuf
+{
+    protected:
+	virtual int overflow(int c) {
+	    return c;
+	}
+};
+
+typedef std::vector<std::vector<uint8_t> > ChunkList;
+typedef boost::function<unsigned long ()> Pass;
+
+/* time each benchmark runs for, in ns */
+static const uint64_t minDuration = 500000000;
+/* what IoHandler reads at once */
+static const size_t chunkSize = 512;
+/* frames in the synthetic streams */
+static const unsigned int streamFrames = 4096;
+
+static uint64_t
+monotonicNanoseconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void
+run(const std::string& name, const Pass& pass)
+{
+    unsigned long frames = 0, allocations;
+    uint64_t start, elapsed;
+
+    /* first pass outside the measurement, to let buffers reach their size */
+    pass();
+
+    allocations = g_allocations;
+    start = monotonicNanoseconds();
+    do {
+	frames += pass();
+	elapsed = monotonicNanoseconds() - start;
+    } while (elapsed < minDuration);
+    allocations = g_allocations - allocations;
+
+    std::cout << std::left << std::setw(36) << name << std::right << std::fixed;
+    if (frames == 0) {
+	std::cout << "  nothing processed" << std::endl;
+	return;
+    }
+    std::cout << std::setprecision(1) << std::setw(10) << (double) elapsed / frames
+	      << std::setprecision(0) << std::setw(14) << frames * 1e9 / elapsed
+	      << std::setprecision(2) << std::setw(14) << (double) allocations / frames
+	      << std::endl;
+}
+
+/* a valid frame (flags to checksum) of each type, with plausible values */
+static std::vector<uint8_t>
+makeFrame(uint8_t type, unsigned int variant)
+{
+    std::vector<uint8_t> frame;
+    uint16_t checksum = 0;
+
+    frame.push_back(0x00);
+    frame.push_back(type);
+    switch (type) {
+	case 0x42: {
+	    /* sensor, temperature, humidity, dew point, heat index */
+	    uint8_t data[] = { (uint8_t) (variant % 3), 0xe7, 0x00, 0x3c, 0x8b, 0x00, 0x00, 0x20 };
+	    frame.insert(frame.end(), data, data + sizeof(data));
+	    break;
+	}
+	case 0x41: {
+	    uint8_t data[] = { 0x00, 0x00, 0x02, 0x00, 0x10, 0x00, 0x4a, 0x03,
+			       0x00, 0x0c, 0x01, 0x01, 0x0c };
+	    frame.insert(frame.end(), data, data + sizeof(data));
+	    break;
+	}
+	case 0x46: {
+	    uint8_t data[] = { 0xf5, 0x33, 0xfc, 0x33 };
+	    frame.insert(frame.end(), data, data + sizeof(data));
+	    break;
+	}
+	case 0x48: {
+	    uint8_t data[] = { (uint8_t) (variant % 16), 0x0c, 0x12, 0x30, 0x01, 0x00, 0x20 };
+	    frame.insert(frame.end(), data, data + sizeof(data));
+	    break;
+	}
+	case 0x47: {
+	    uint8_t data[] = { 0x00, 0x05 };
+	    frame.insert(frame.end(), data, data + sizeof(data));
+	    break;
+	}
+	case 0x60: {
+	    uint8_t data[] = { 0x00, 0x00, 0x1e, 0x0c, 0x12, 0x0a, 0x0c, 0x01 };
+	    frame.insert(frame.end(), data, data + sizeof(data));
+	    break;
+	}
+    }
+
+    for (size_t i = 0; i < frame.size(); i++) {
+	checksum += frame[i];
+    }
+    frame.push_back(checksum & 0xff);
+    frame.push_back(checksum >> 8);
+
+    return frame;
+}
+
+/* the mix the station sends: mostly temperature and wind */
+static uint8_t
+frameType(unsigned int i)
+{
+    static const uint8_t types[] = { 0x42, 0x48, 0x42, 0x46, 0x42, 0x48, 0x41, 0x47, 0x60 };
+    return types[i % sizeof(types)];
+}
+
+static ChunkList
+splitChunks(const std::vector<uint8_t>& stream)
+{
+    ChunkList chunks;
+
+    for (size_t pos = 0; pos < stream.size(); pos += chunkSize) {
+	size_t end = std::min(pos + chunkSize, stream.size());
+	chunks.push_back(std::vector<uint8_t>(stream.begin() + pos, stream.begin() + end));
+    }
+    return chunks;
+}
+
+/* raw station stream; every corruptEvery'th frame loses a byte */
+static ChunkList
+makeRawStream(unsigned int corruptEvery)
+{
+    std::vector<uint8_t> stream;
+
+    for (unsigned int i = 0; i < streamFrames; i++) {
+	std::vector<uint8_t> frame = makeFrame(frameType(i), i);
+
+	if (corruptEvery && i % corruptEvery == 0) {
+	    frame.erase(frame.begin() + 3);
+	}
+	stream.push_back(0xff);
+	stream.push_back(0xff);
+	stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    return splitChunks(stream);
+}
+
+static ChunkList
+makeFramedStream()
+{
+    std::vector<uint8_t> stream;
+
+    for (unsigned int i = 0; i < streamFrames; i++) {
+	std::vector<uint8_t> frame = makeFrame(frameType(i), i);
+	uint16_t length = 16 + frame.size();
+	uint64_t timestamp = 1350000000000000ULL + i * 1000000ULL;
+	uint8_t header[16] = {
+	    (uint8_t) (length >> 8), (uint8_t) length, RecordParser::TypeFrame, 0,
+	    (uint8_t) (i >> 24), (uint8_t) (i >> 16), (uint8_t) (i >> 8), (uint8_t) i
+	};
+
+	for (int b = 0; b < 8; b++) {
+	    header[8 + b] = timestamp >> (56 - 8 * b);
+	}
+	stream.insert(stream.end(), header, header + sizeof(header));
+	stream.insert(stream.end(), frame.begin(), frame.end());
+    }
+    return splitChunks(stream);
+}
+
+/* An empty chunk stands for a reconnect. Returns false if the journal
+ * can't be read. */
+static bool
+loadJournal(const std::string& path, ChunkList& chunks, bool& framed)
+{
+    JournalReader reader;
+    uint8_t buffer[4096];
+    uint64_t timestamp;
+    size_t length;
+
+    if (!reader.open(path)) {
+	return false;
+    }
+    while (reader.next(timestamp, buffer, sizeof(buffer), length)) {
+	chunks.push_back(std::vector<uint8_t>(buffer, buffer + length));
+    }
+    framed = reader.framed();
+
+    return !reader.error();
+}
+
+static void
+ignoreFrame(const std::vector<uint8_t>& frame)
+{
+}
+
+static void
+ignoreRecord(const RecordParser::Record& record, unsigned long *frames)
+{
+    (*frames)++;
+}
+
+static unsigned long
+parseRaw(const ChunkList *chunks, FrameParser *parser)
+{
+    unsigned long frames = 0;
+
+    for (ChunkList::const_iterator iter = chunks->begin(); iter != chunks->end(); ++iter) {
+	if (iter->empty()) {
+	    parser->reset();
+	    continue;
+	}
+	frames += parser->feed(&(*iter)[0], iter->size(), ignoreFrame);
+    }
+    return frames;
+}
+
+static unsigned long
+parseFramed(const ChunkList *chunks, RecordParser *parser)
+{
+    unsigned long frames = 0;
+
+    for (ChunkList::const_iterator iter = chunks->begin(); iter != chunks->end(); ++iter) {
+	if (iter->empty()) {
+	    parser->reset();
+	    continue;
+	}
+	parser->feed(&(*iter)[0], iter->size(), boost::bind(ignoreRecord, _1, &frames));
+    }
+    return frames;
+}
+
+static unsigned long
+checkFrames(const std::vector<uint8_t> *frame, unsigned int count)
+{
+    unsigned long valid = 0;
+
+    for (unsigned int i = 0; i < count; i++) {
+	valid += WmrMessage::checksumValid(*frame);
+    }
+    return valid;
+}
+
+static unsigned long
+decodeFrames(const std::vector<uint8_t> *frame, unsigned int count, SampleBatch *batch)
+{
+    for (unsigned int i = 0; i < count; i++) {
+	batch->clear();
+	WmrMessage::decodeFrame(*frame, batch, 1350000000, 0);
+    }
+    return count;
+}
+
+/* A journal of the stream for the handler to replay; an empty chunk
+ * stands for a reconnect. */
+static bool
+writeJournal(const ChunkList& chunks, bool framed, const std::string& path)
+{
+    JournalWriter writer;
+    uint64_t timestamp = 1350000000000000ULL;
+    bool ok;
+
+    unlink(path.c_str());
+    ok = writer.open(path, framed) && writer.addConnect(timestamp);
+    for (ChunkList::const_iterator iter = chunks.begin(); ok && iter != chunks.end(); ++iter) {
+	/* the pace of a single station */
+	timestamp += 100000;
+	if (iter->empty()) {
+	    ok = writer.addConnect(timestamp);
+	} else {
+	    ok = writer.addData(timestamp, &(*iter)[0], iter->size());
+	}
+    }
+    return ok;
+}
+
+static unsigned long
+replayJournal(const std::string *path, boost::shared_ptr<Database> *db, NullDatabase *sink)
+{
+    static DiscardBuffer discard;
+    unsigned long samples = sink->samples();
+    std::streambuf *out = std::cout.rdbuf(&discard);
+
+    {
+	IoHandler handler(*path, 0, *db);
+	handler.run();
+    }
+    std::cout.rdbuf(out);
+
+    return sink->samples() - samples;
+}
+
+static void
+runStream(const std::string& name, const ChunkList& chunks, bool framed,
+	  const std::string& journalPath)
+{
+    FrameParser frameParser;
+    RecordParser recordParser;
+    NullDatabase *sink = new NullDatabase();
+    boost::shared_ptr<Database> db(sink);
+
+    if (framed) {
+	run("records, " + name, boost::bind(parseFramed, &chunks, &recordParser));
+    } else {
+	run("frames, " + name, boost::bind(parseRaw, &chunks, &frameParser));
+    }
+    run("replay samples, " + name, boost::bind(replayJournal, &journalPath, &db, sink));
+}
+
+/* runs a stream made up here from a journal written for it */
+static bool
+runSyntheticStream(const std::string& name, const ChunkList& chunks, bool framed)
+{
+    char path[] = "/tmp/wmrbench.XXXXXX";
+    int fd = mkstemp(path);
+
+    if (fd < 0) {
+	return false;
+    }
+    close(fd);
+
+    if (!writeJournal(chunks, framed, path)) {
+	unlink(path);
+	return false;
+    }
+    runStream(name, chunks, framed, path);
+    unlink(path);
+
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    static const uint8_t types[] = { 0x42, 0x41, 0x46, 0x48, 0x47, 0x60 };
+    ChunkList clean = makeRawStream(0), corrupt = makeRawStream(10);
+    ChunkList framed = makeFramedStream();
+    SampleBatch batch;
+    /* the settings the handler takes, as the collector has them by default */
+    char *defaults[] = { argv[0], (char *) "benchmark", NULL };
+
+    if (Options::parse(2, defaults) != Options::ParseSuccess) {
+	return 1;
+    }
+
+    std::cout << std::left << std::setw(36) << "benchmark" << std::right
+	      << std::setw(10) << "ns/item" << std::setw(14) << "items/s"
+	      << std::setw(14) << "allocs/item" << std::endl;
+
+    if (!runSyntheticStream("synthetic", clean, false) ||
+	!runSyntheticStream("every 10th corrupt", corrupt, false) ||
+	!runSyntheticStream("synthetic", framed, true)) {
+	std::cerr << "Could not write a journal to replay" << std::endl;
+	return 1;
+    }
+
+    for (size_t i = 0; i < sizeof(types); i++) {
+	std::vector<uint8_t> frame = makeFrame(types[i], 1);
+	std::ostringstream name;
+
+	name << std::hex << "0x" << (unsigned int) types[i];
+	run("checksum " + name.str(), boost::bind(checkFrames, &frame, 1000));
+	run("decode " + name.str(), boost::bind(decodeFrames, &frame, 1000, &batch));
+    }
+
+    for (int i = 1; i < argc; i++) {
+	ChunkList chunks;
+	bool isFramed;
+
+	if (!loadJournal(argv[i], chunks, isFramed)) {
+	    std::cerr << "Could not read journal " << argv[i] << std::endl;
+	    return 1;
+	}
+	runStream(argv[i], chunks, isFramed, argv[i]);
+    }
+
+    return 0;
+}
@@ -0,0 +1,90 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __CLOCK_H__
+#define __CLOCK_H__
+
+#include <stdint.h>
+#include <time.h>
+
+/* Source of the event timestamps attached to received data, and of the
+ * time the timeouts are measured in. Data is stamped from a single
+ * reading, so the journal and the samples agree on the second even at its
+ * boundary. */
+class Clock
+{
+    public:
+	virtual ~Clock() { }
+	/* since the epoch */
+	virtual uint64_t nowMicroseconds() = 0;
+	time_t now() {
+	    return nowMicroseconds() / 1000000;
+	}
+	/* since an arbitrary point, not moved when the wall clock is set */
+	virtual time_t monotonicSeconds() = 0;
+};
+
+/* Wall clock time, read from the vDSO without a syscall. */
+class SystemClock : public Clock
+{
+    public:
+	virtual uint64_t nowMicroseconds() {
+	    struct timespec ts;
+	    clock_gettime(CLOCK_REALTIME, &ts);
+	    return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+	}
+	virtual time_t monotonicSeconds() {
+	    struct timespec ts;
+	    clock_gettime(CLOCK_MONOTONIC, &ts);
+	    return ts.tv_sec;
+	}
+};
+
+/* Clock driven by the caller, e.g. to re-stamp replayed or backfilled data
+ * with its original time while processing it as fast as possible, or to
+ * let timeouts pass in a test. */
+class ManualClock : public Clock
+{
+    public:
+	ManualClock(time_t start = 0) :
+	    m_now((uint64_t) start * 1000000)
+	{ }
+
+	virtual uint64_t nowMicroseconds() {
+	    return m_now;
+	}
+	/* there is only the one time */
+	virtual time_t monotonicSeconds() {
+	    return now();
+	}
+	void set(time_t now) {
+	    m_now = (uint64_t) now * 1000000;
+	}
+	void setMicroseconds(uint64_t now) {
+	    m_now = now;
+	}
+	void advance(time_t seconds) {
+	    m_now += (uint64_t) seconds * 1000000;
+	}
+
+    private:
+	uint64_t m_now;
+};
+
+#endif /* __CLOCK_H__ */
@@ -18,28 +18,42 @@
  */
 
 #include "Database.h"
+#include "SampleBatch.h"
 
-Database::Database() :
-    m_lastRainAmount(-1),
-    m_lastRainDelta(0),
-    m_lastRainAmountUpdateTime(0)
+Database::Database()
 {
+    m_rain.lastAmount = -1;
+    m_rain.lastDelta = 0;
+    m_rain.lastUpdateTime = 0;
 }
 
 float
-Database::convertRainAmountValue(float value)
+Database::convertRainAmountValue(float value, time_t now)
 {
-    time_t now = time(NULL);
+    if (m_rain.lastAmount < 0) {
+	m_rain.lastAmount = value;
+	m_rain.lastDelta = 0;
+	m_rain.lastUpdateTime = now;
+    } else if ((now - m_rain.lastUpdateTime) >= rainAmountCollectionTime) {
+	m_rain.lastDelta = std::max(0.0f, value - m_rain.lastAmount);
+	m_rain.lastUpdateTime += rainAmountCollectionTime;
+	m_rain.lastAmount = value;
+    }
+
+    return m_rain.lastDelta;
+}
+
+bool
+Database::addSensorValues(const SampleBatch& batch)
+{
+    const std::vector<NumericSensors>& sensors = batch.sensors();
+    const std::vector<float>& values = batch.values();
+    const std::vector<time_t>& intervals = batch.intervals();
+    const std::vector<time_t>& timestamps = batch.timestamps();
 
-    if (m_lastRainAmount < 0) {
-	m_lastRainAmount = value;
-	m_lastRainDelta = 0;
-	m_lastRainAmountUpdateTime = now;
-    } else if ((now - m_lastRainAmountUpdateTime) >= rainAmountCollectionTime) {
-	m_lastRainDelta = std::max(0.0f, value - m_lastRainAmount);
-	m_lastRainAmountUpdateTime += rainAmountCollectionTime;
-	m_lastRainAmount = value;
+    for (size_t i = 0; i < batch.size(); i++) {
+	addSensorValue(sensors[i], values[i], intervals[i], timestamps[i]);
     }
 
-    return m_lastRainDelta;
+    return true;
 }
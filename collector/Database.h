@@ -23,6 +23,8 @@
 #include <time.h>
 #include <string>
 
+class SampleBatch;
+
 class Database {
     protected:
 	Database();
@@ -55,15 +57,34 @@ class Database {
 	    NumericSensorLast = 512
 	} NumericSensors;
 
-	virtual void addSensorValue(NumericSensors sensor, float value, time_t normalInterval) {}
+	/* timestamp is the time the sample was received from the station */
+	virtual void addSensorValue(NumericSensors sensor, float value,
+				    time_t normalInterval, time_t timestamp) {}
+	/* stores a whole batch at once, returning false if it couldn't be
+	 * stored; the default implementation falls back to one
+	 * addSensorValue() call per sample */
+	virtual bool addSensorValues(const SampleBatch& batch);
+	/* the sensor missed several samples; its next one starts a new run */
+	virtual void markStale(NumericSensors sensor) {}
 
     protected:
-	float convertRainAmountValue(float value);
+	typedef struct {
+	    float lastAmount;
+	    float lastDelta;
+	    time_t lastUpdateTime;
+	} RainState;
+
+	float convertRainAmountValue(float value, time_t timestamp);
+	/* lets conversions of samples which couldn't be stored be undone */
+	const RainState& rainState() const {
+	    return m_rain;
+	}
+	void setRainState(const RainState& state) {
+	    m_rain = state;
+	}
 
     private:
-	float m_lastRainAmount;
-	float m_lastRainDelta;
-	time_t m_lastRainAmountUpdateTime;
+	RainState m_rain;
 
 	static const long rainAmountCollectionTime = 15 * 60; /* collect for 15 minutes */
 
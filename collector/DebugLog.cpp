@@ -0,0 +1,419 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cmath>
+#include <cstring>
+#include <iomanip>
+#include "DebugLog.h"
+#include "Options.h"
+
+#define HEX(value) \
+    "0x" << std::setbase(16) << std::setw(2) << \
+    std::setfill('0') << (unsigned int) (value) << std::dec
+#define DEC(value) \
+    std::dec << (unsigned int) (value)
+
+DebugLog::Slot DebugLog::m_ring[ringSize];
+std::atomic<size_t> DebugLog::m_enqueuePos(0);
+std::atomic<size_t> DebugLog::m_dequeuePos(0);
+std::atomic<unsigned long> DebugLog::m_dropped(0);
+std::atomic<bool> DebugLog::m_running(false);
+std::atomic<bool> DebugLog::m_waiting(false);
+boost::mutex DebugLog::m_mutex;
+boost::condition_variable DebugLog::m_wakeup;
+boost::thread DebugLog::m_thread;
+
+/*
+ * The ring is a bounded multi-producer queue: each slot carries a sequence
+ * number telling whether it is free for the producer at a given position
+ * (sequence == pos) or filled for the consumer (sequence == pos + 1).
+ * Sequence numbers are stored relative to the slot index, so the
+ * zero-initialized ring is valid before start() was called.
+ */
+
+bool
+DebugLog::push(const Record& record)
+{
+    size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+    Slot *slot;
+
+    while (true) {
+	size_t index = pos & (ringSize - 1);
+	slot = &m_ring[index];
+	size_t sequence = slot->sequence.load(std::memory_order_acquire) + index;
+	ssize_t diff = (ssize_t) sequence - (ssize_t) pos;
+
+	if (diff == 0) {
+	    if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+		break;
+	    }
+	} else if (diff < 0) {
+	    /* full */
+	    return false;
+	} else {
+	    pos = m_enqueuePos.load(std::memory_order_relaxed);
+	}
+    }
+
+    slot->record = record;
+    slot->sequence.store(pos + 1 - (pos & (ringSize - 1)), std::memory_order_release);
+    return true;
+}
+
+bool
+DebugLog::pop(Record& record)
+{
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    size_t index = pos & (ringSize - 1);
+    Slot *slot = &m_ring[index];
+    size_t sequence = slot->sequence.load(std::memory_order_acquire) + index;
+
+    /* only the writer thread dequeues */
+    if (sequence != pos + 1) {
+	return false;
+    }
+
+    record = slot->record;
+    m_dequeuePos.store(pos + 1, std::memory_order_relaxed);
+    slot->sequence.store(pos + ringSize - index, std::memory_order_release);
+    return true;
+}
+
+bool
+DebugLog::empty()
+{
+    size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+    size_t index = pos & (ringSize - 1);
+
+    return m_ring[index].sequence.load(std::memory_order_acquire) + index != pos + 1;
+}
+
+/*
+ * The writer announces it is about to sleep before checking the ring a last
+ * time, and producers check for that after publishing their records. The
+ * fences order both, so either the writer sees the record or the producer
+ * sees it waiting; notifying under the mutex makes sure it already waits.
+ */
+
+void
+DebugLog::wakeWriter()
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (m_waiting.load(std::memory_order_relaxed)) {
+	boost::lock_guard<boost::mutex> lock(m_mutex);
+	m_wakeup.notify_one();
+    }
+}
+
+void
+DebugLog::post(Event event, const Arg *args, size_t argCount,
+	       const uint8_t *data, size_t length)
+{
+    Record record;
+    size_t offset = 0;
+
+    record.event = event;
+    record.argCount = argCount;
+    memcpy(record.args, args, argCount * sizeof(Arg));
+
+    do {
+	size_t chunk = length - offset;
+
+	if (chunk > maxData) {
+	    chunk = maxData;
+	}
+
+	record.dataLength = chunk;
+	record.continued = offset != 0;
+	record.last = offset + chunk == length;
+	if (chunk > 0) {
+	    memcpy(record.data, data + offset, chunk);
+	}
+	if (!push(record)) {
+	    /* the rest would continue a line without its start; the writer
+	     * terminates the line once the next event arrives */
+	    m_dropped.fetch_add(1, std::memory_order_relaxed);
+	    break;
+	}
+	offset += chunk;
+    } while (offset < length);
+
+    wakeWriter();
+}
+
+void
+DebugLog::start()
+{
+    if (!m_running.exchange(true)) {
+	m_thread = boost::thread(&DebugLog::run);
+    }
+}
+
+void
+DebugLog::stop()
+{
+    if (m_running.exchange(false)) {
+	{
+	    boost::lock_guard<boost::mutex> lock(m_mutex);
+	    m_wakeup.notify_one();
+	}
+	m_thread.join();
+    }
+}
+
+static DebugStream&
+streamForEvent(DebugLog::Event event)
+{
+    if (event < DebugLog::MessageTooSmall) {
+	return Options::ioDebug();
+    } else if (event < DebugLog::DataUnhandled) {
+	return Options::messageDebug();
+    }
+    return Options::dataDebug();
+}
+
+void
+DebugLog::run()
+{
+    Record record;
+    unsigned long reportedDrops = 0;
+    /* the event of a line whose last chunk didn't arrive yet */
+    int openEvent = -1;
+
+    while (true) {
+	bool running = m_running.load();
+
+	while (pop(record)) {
+	    if (record.continued && record.event != openEvent) {
+		/* its start was dropped */
+		continue;
+	    }
+	    if (!record.continued && openEvent >= 0) {
+		/* the end of the open line was dropped */
+		streamForEvent((Event) openEvent) << "\n";
+	    }
+	    format(record);
+	    openEvent = record.last ? -1 : record.event;
+	}
+
+	unsigned long drops = dropped();
+	if (drops != reportedDrops) {
+	    std::cerr << "Debug log overrun, " << (drops - reportedDrops);
+	    std::cerr << " events dropped" << std::endl;
+	    reportedDrops = drops;
+	}
+
+	Options::ioDebug().flush();
+	Options::messageDebug().flush();
+	Options::dataDebug().flush();
+
+	if (!running) {
+	    break;
+	}
+
+	boost::unique_lock<boost::mutex> lock(m_mutex);
+	m_waiting.store(true, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	while (empty() && m_running.load()) {
+	    m_wakeup.wait(lock);
+	}
+	m_waiting.store(false, std::memory_order_relaxed);
+    }
+
+    if (openEvent >= 0) {
+	streamForEvent((Event) openEvent) << std::endl;
+    }
+}
+
+void
+DebugLog::format(const Record& record)
+{
+    static const char *trendStrings[] = {
+	"steady", "rising", "falling", "???"
+    };
+    static const char *smileyStrings[] = {
+	"   ", ":-)", ":-(", ":-|"
+    };
+    static const char *forecastStrings[] = {
+	"partly cloudy", /* day */	"rainy",
+	"cloudy",			"sunny", /* day */
+	"clear", /* night */		"snowy",
+	"partly cloudy", /* night */	"???",
+	"???",				"???",
+	"???",				"???",
+	"???",				"???",
+	"???",				"???"
+    };
+    static const char *directionStrings[] = {
+	"N", "NNE", "NE", "ENE", "E", "ESE", "SE", "SSE",
+	"S", "SSW", "SW", "WSW", "W", "WNW", "NW", "NNW"
+    };
+    static const uint8_t msgTypeDateTime = 0x60;
+
+    const Arg *args = record.args;
+    const uint8_t *data = record.data;
+
+    switch (record.event) {
+	case IoBytes: {
+	    DebugStream& debug = Options::ioDebug();
+	    if (!record.continued) {
+		debug << "IO: Got bytes ";
+	    }
+	    for (size_t i = 0; i < record.dataLength; i++) {
+		debug << std::setfill('0') << std::setw(2)
+		      << std::showbase << std::hex
+		      << (unsigned int) data[i] << " ";
+	    }
+	    if (record.last) {
+		debug << std::noshowbase << std::dec << "\n";
+	    }
+	    break;
+	}
+	case IoResync:
+	    Options::ioDebug() << "IO: Resynchronizing on " << args[0].i
+			       << " discarded bytes\n";
+	    break;
+	case MessageTooSmall:
+	    Options::messageDebug() << "Packet too small (" << args[0].i
+				    << " bytes, minimum: 4 bytes)\n";
+	    break;
+	case MessageChecksum:
+	    Options::messageDebug() << "Checksum mismatch: " << args[0].i
+				    << " vs. " << args[1].i << "\n";
+	    break;
+	case MessageUnknownType:
+	    Options::messageDebug() << "Unexpected type " << HEX(args[0].i) << "\n";
+	    break;
+	case MessageBadSize:
+	    Options::messageDebug() << "Unexpected packet size for type " << HEX(args[0].i)
+				    << " (" << args[1].i << " vs. " << args[2].i << ")\n";
+	    break;
+	case MessageHeader: {
+	    DebugStream& debug = Options::messageDebug();
+	    if (!record.continued) {
+		time_t timestamp = args[0].i;
+		struct tm time;
+
+		localtime_r(&timestamp, &time);
+		debug << "MESSAGE[";
+		debug << std::setw(2) << std::setfill('0') << time.tm_mday;
+		debug << "." << std::setw(2) << std::setfill('0') << (time.tm_mon + 1);
+		debug << "." << (time.tm_year + 1900) << " ";
+		debug << std::setw(2) << std::setfill('0') << time.tm_hour;
+		debug << ":" << std::setw(2) << std::setfill('0') << time.tm_min;
+		debug << ":" << std::setw(2) << std::setfill('0') << time.tm_sec;
+		debug << "]: type " << HEX(args[1].i);
+		debug << ", flags " << HEX(args[2].i);
+		debug << ", data ";
+	    }
+	    for (size_t i = 0; i < record.dataLength; i++) {
+		debug << " " << HEX(data[i]);
+	    }
+	    if (record.last) {
+		debug << "\n";
+	    }
+	    break;
+	}
+	case MessageFlags: {
+	    DebugStream& debug = Options::messageDebug();
+	    uint8_t type = args[0].i, flags = args[1].i;
+
+	    debug << "Battery " << ((flags & 0x40) ? "low" : "ok");
+	    if (type == msgTypeDateTime) {
+		bool externalPowerMissing = flags & 0x80;
+		bool dcfSync = flags & 0x20;
+		bool dcfSignalOk = flags & 0x10;
+		if (!externalPowerMissing) {
+		    debug << ", externally powered";
+		}
+		debug << ", DCF " << (dcfSync ? "" : "not ") << "synchronized";
+		debug << ", DCF signal " << (dcfSignalOk ? "ok" : "weak");
+	    }
+	    debug << "\n";
+	    break;
+	}
+	case MessageTemperature: {
+	    DebugStream& debug = Options::messageDebug();
+	    debug << "Sensor " << args[0].i << ": temperature " << (float) args[1].f;
+	    debug << "°C (trend: " << trendStrings[args[2].i];
+	    debug << "), dew point " << (float) args[3].f << "°C, humidity ";
+	    debug << args[4].i << "% (trend: " << trendStrings[args[5].i];
+	    debug << "), smiley " << smileyStrings[args[6].i] << "\n";
+	    break;
+	}
+	case MessageRain: {
+	    /* data: minute, hour, day, month, year of the total's start */
+	    DebugStream& debug = Options::messageDebug();
+	    debug << "Rain: rate " << (float) args[0].f << ", this hour " << (float) args[1].f;
+	    debug << ", thisDay " << (float) args[2].f << ", total " << (float) args[3].f;
+	    debug << " since " << std::setw(2) << std::setfill('0') << DEC(data[2]);
+	    debug << "." << std::setw(2) << std::setfill('0') << DEC(data[3]);
+	    debug << "." << DEC(2000 + data[4]) << " ";
+	    debug << std::setw(2) << std::setfill('0') << DEC(data[1]);
+	    debug << ":" << std::setw(2) << std::setfill('0') << DEC(data[0]);
+	    debug << "\n";
+	    break;
+	}
+	case MessagePressure: {
+	    DebugStream& debug = Options::messageDebug();
+	    debug << std::dec;
+	    debug << "Absolute pressure: " << args[0].i << " mbar (forecast: ";
+	    debug << forecastStrings[args[1].i] << ")\n";
+	    debug << "Relative pressure: " << args[2].i << " mbar (forecast: ";
+	    debug << forecastStrings[args[3].i] << ")\n";
+	    break;
+	}
+	case MessageWind: {
+	    DebugStream& debug = Options::messageDebug();
+	    double windChill = args[4].f;
+
+	    debug << "Wind direction " << directionStrings[args[0].i];
+	    debug << " -> " << (float) args[1].f << "°, speed avg. ";
+	    debug << (float) args[2].f << " m/s, gust " << (float) args[3].f << " m/s\n";
+	    debug << "Wind chill temperature ";
+	    if (std::isnan(windChill)) {
+		debug << "n/a";
+	    } else {
+		debug << (float) windChill << " °C";
+	    }
+	    debug << "\n";
+	    break;
+	}
+	case DataUnhandled:
+	    Options::dataDebug() << "DATA: Unhandled message received"
+				 << "(type " << HEX(args[0].i) << ").\n";
+	    break;
+	case DataUV:
+	    Options::dataDebug() << "UV level: " << args[0].i << "\n";
+	    break;
+	case DataDateTime: {
+	    /* data: minute, hour, day, month, year, timezone */
+	    DebugStream& debug = Options::dataDebug();
+	    int timezone = (data[5] >= 128) ? 128 - data[5] : data[5];
+	    debug << "Date = " << std::setw(2) << std::setfill('0') << DEC(data[2]);
+	    debug << "." << std::setw(2) << std::setfill('0') << DEC(data[3]);
+	    debug << "." << DEC(2000 + data[4]) << "\n";
+	    debug << "Time = " << std::setw(2) << std::setfill('0') << DEC(data[1]);
+	    debug << ":" << std::setw(2) << std::setfill('0') << DEC(data[0]);
+	    debug << " (GMT" << (timezone >= 0 ? "+" : "") << timezone << ")";
+	    debug << "\n";
+	    break;
+	}
+    }
+}
@@ -0,0 +1,131 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __DEBUGLOG_H__
+#define __DEBUGLOG_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <boost/thread.hpp>
+
+/* Debug output is recorded as binary events (event id and raw arguments)
+ * into a lock-free ring, and formatted and written to the debug streams by
+ * a background thread, which sleeps while the ring is empty. Callers check
+ * the category's DebugStream before logging, so disabled categories cost a
+ * single branch. */
+class DebugLog
+{
+    public:
+	typedef enum {
+	    IoBytes,
+	    IoResync,
+	    MessageTooSmall,
+	    MessageChecksum,
+	    MessageUnknownType,
+	    MessageBadSize,
+	    MessageHeader,
+	    MessageFlags,
+	    MessageTemperature,
+	    MessageRain,
+	    MessagePressure,
+	    MessageWind,
+	    DataUnhandled,
+	    DataUV,
+	    DataDateTime,
+	    EventCount
+	} Event;
+
+	union Arg {
+	    Arg() : i(0) { }
+	    Arg(int value) : i(value) { }
+	    Arg(unsigned int value) : i(value) { }
+	    Arg(long value) : i(value) { }
+	    Arg(unsigned long value) : i(value) { }
+	    Arg(double value) : f(value) { }
+
+	    long long i;
+	    double f;
+	};
+
+	static const size_t maxArgs = 8;
+	static const size_t maxData = 48;
+
+	template<typename... Args>
+	static void log(Event event, Args... args) {
+	    static_assert(sizeof...(Args) <= maxArgs, "too many debug log arguments");
+	    Arg values[sizeof...(Args) + 1] = { Arg(args)... };
+	    post(event, values, sizeof...(Args), NULL, 0);
+	}
+
+	/* data longer than maxData is split over several records */
+	template<typename... Args>
+	static void logData(Event event, const uint8_t *data, size_t length, Args... args) {
+	    static_assert(sizeof...(Args) <= maxArgs, "too many debug log arguments");
+	    Arg values[sizeof...(Args) + 1] = { Arg(args)... };
+	    post(event, values, sizeof...(Args), data, length);
+	}
+
+	static void start();
+	static void stop();
+
+	static unsigned long dropped() {
+	    return m_dropped.load(std::memory_order_relaxed);
+	}
+
+    private:
+	typedef struct {
+	    uint16_t event;
+	    uint8_t argCount;
+	    uint8_t dataLength;
+	    bool continued;
+	    bool last;
+	    Arg args[maxArgs];
+	    uint8_t data[maxData];
+	} Record;
+
+	typedef struct {
+	    std::atomic<size_t> sequence;
+	    Record record;
+	} Slot;
+
+	static void post(Event event, const Arg *args, size_t argCount,
+			 const uint8_t *data, size_t length);
+	static bool push(const Record& record);
+	static bool pop(Record& record);
+	static bool empty();
+	static void wakeWriter();
+	static void run();
+	static void format(const Record& record);
+
+    private:
+	static const size_t ringSize = 4096; /* must be a power of 2 */
+
+	static Slot m_ring[ringSize];
+	static std::atomic<size_t> m_enqueuePos;
+	static std::atomic<size_t> m_dequeuePos;
+	static std::atomic<unsigned long> m_dropped;
+	static std::atomic<bool> m_running;
+	static std::atomic<bool> m_waiting;
+	static boost::mutex m_mutex;
+	static boost::condition_variable m_wakeup;
+	static boost::thread m_thread;
+};
+
+#endif /* __DEBUGLOG_H__ */
@@ -0,0 +1,226 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include "FlightRecorder.h"
+#include "StalenessTracker.h"
+
+FlightRecorder::Entry FlightRecorder::m_ring[ringSize];
+std::atomic<uint64_t> FlightRecorder::m_position(0);
+char FlightRecorder::m_path[maxPathLength];
+
+void
+FlightRecorder::install(const std::string& path)
+{
+    static const int crashSignals[] = { SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT };
+    struct sigaction action;
+
+    strncpy(m_path, path.c_str(), maxPathLength - 1);
+
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = crashHandler;
+    /* the default action takes over again, so re-raising ends the process */
+    action.sa_flags = SA_RESETHAND;
+    sigemptyset(&action.sa_mask);
+    for (size_t i = 0; i < sizeof(crashSignals) / sizeof(crashSignals[0]); i++) {
+	sigaction(crashSignals[i], &action, NULL);
+    }
+}
+
+void
+FlightRecorder::crashHandler(int signal)
+{
+    int savedErrno = errno;
+
+    dump();
+    errno = savedErrno;
+    raise(signal);
+}
+
+static bool
+writeAll(int fd, const void *data, size_t length)
+{
+    const char *pos = (const char *) data;
+
+    while (length > 0) {
+	ssize_t written = write(fd, pos, length);
+	if (written < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return false;
+	}
+	pos += written;
+	length -= written;
+    }
+
+    return true;
+}
+
+bool
+FlightRecorder::dump()
+{
+    DumpHeader header;
+    uint64_t start;
+    bool success;
+    int fd;
+
+    if (!m_path[0]) {
+	return false;
+    }
+    fd = open(m_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0) {
+	return false;
+    }
+
+    /* The ring is written as it is, while the IO thread may go on
+     * recording. Everything before start is complete; of that, entries
+     * up to ringSize before the position after writing still are what
+     * they were, the ones after may have been overwritten. */
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "WMRT", sizeof(header.magic));
+    header.version = version;
+    header.entrySize = sizeof(Entry);
+    header.ringSize = ringSize;
+    start = m_position.load(std::memory_order_acquire);
+
+    success = writeAll(fd, &header, sizeof(header)) &&
+	      writeAll(fd, m_ring, sizeof(m_ring));
+    if (success) {
+	uint64_t end = m_position.load(std::memory_order_acquire);
+
+	header.end = start;
+	header.first = end >= ringSize ? end - ringSize + 1 : 0;
+	if (header.first > header.end) {
+	    header.first = header.end;
+	}
+	success = pwrite(fd, &header, sizeof(header), 0) == sizeof(header);
+    }
+
+    close(fd);
+    return success;
+}
+
+bool
+FlightRecorder::print(const std::string& path, std::ostream& out)
+{
+    std::ifstream file(path.c_str(), std::ios::in | std::ios::binary);
+    DumpHeader header;
+
+    if (!file.read((char *) &header, sizeof(header)) ||
+	memcmp(header.magic, "WMRT", sizeof(header.magic)) != 0 ||
+	header.version != version || header.entrySize != sizeof(Entry) ||
+	header.ringSize != ringSize || header.end - header.first > ringSize) {
+	return false;
+    }
+
+    Entry *ring = new Entry[ringSize];
+    bool success = (bool) file.read((char *) ring, ringSize * sizeof(Entry));
+
+    if (success) {
+	for (uint64_t i = header.first; i < header.end; i++) {
+	    format(out, ring[i & (ringSize - 1)]);
+	}
+    }
+
+    delete[] ring;
+    return success;
+}
+
+void
+FlightRecorder::format(std::ostream& out, const Entry& entry)
+{
+    time_t seconds = entry.timestamp / 1000000;
+    char when[32];
+    struct tm tm;
+    float value;
+
+    localtime_r(&seconds, &tm);
+    strftime(when, sizeof(when), "%d.%m.%Y %H:%M:%S", &tm);
+    out << when << "." << std::setw(6) << std::setfill('0')
+	<< entry.timestamp % 1000000 << std::setfill(' ') << " ";
+
+    switch (entry.event) {
+	case Connected:
+	    out << "connected";
+	    break;
+	case Disconnected:
+	    out << "disconnected, error " << entry.arg1;
+	    break;
+	case Reconnect:
+	    out << "reconnecting in " << entry.arg1 << " ms";
+	    break;
+	case WatchdogTimeout:
+	    out << "no data received, watchdog expired";
+	    break;
+	case Read:
+	    out << "read " << entry.arg1 << " bytes";
+	    break;
+	case Frame:
+	    out << "frame type 0x" << std::hex << entry.arg0 << std::dec
+		<< (entry.arg1 ? ", valid" : ", invalid");
+	    break;
+	case ChecksumFailure:
+	    out << "checksum failure, frame type 0x" << std::hex << entry.arg0 << std::dec
+		<< ", " << entry.arg1 << " bytes";
+	    break;
+	case LengthError:
+	    out << "unknown frame type 0x" << std::hex << entry.arg0 << std::dec;
+	    break;
+	case Record:
+	    out << "record " << entry.arg2 << ", channel " << entry.arg0;
+	    break;
+	case StationStatus:
+	    out << (entry.arg0 ? "station attached" : "station detached");
+	    break;
+	case MissedFrames:
+	    out << "missed " << entry.arg1 << " frames before record " << entry.arg2;
+	    break;
+	case InvalidRecordStream:
+	    out << "invalid record stream";
+	    break;
+	case Sample:
+	    memcpy(&value, &entry.arg1, sizeof(value));
+	    out << "sample sensor " << entry.arg0 << ", value " << value
+		<< ", time " << entry.arg2;
+	    break;
+	case Query:
+	    out << (entry.arg0 ? "query took " : "query failed after ")
+		<< entry.arg2 << " us";
+	    break;
+	case SourceStale:
+	    out << StalenessTracker::sourceName((StalenessTracker::Source) entry.arg0)
+		<< " of station " << entry.arg1 << " stale, silent for " << entry.arg2 << " s";
+	    break;
+	case SourceRecovered:
+	    out << StalenessTracker::sourceName((StalenessTracker::Source) entry.arg0)
+		<< " of station " << entry.arg1 << " reporting again";
+	    break;
+	default:
+	    out << "unknown event " << entry.event;
+	    break;
+    }
+    out << std::endl;
+}
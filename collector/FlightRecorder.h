@@ -0,0 +1,114 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FLIGHTRECORDER_H__
+#define __FLIGHTRECORDER_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <atomic>
+#include <ostream>
+#include <string>
+
+/* Always-on record of the most recent events of the collector in a fixed
+ * ring of binary entries, to have the context of a problem after the fact
+ * even with debug output off. Recording an event is a coarse clock read
+ * and a few stores; only the IO thread records, so no locking is needed.
+ *
+ * The ring is dumped to a file on SIGUSR1 or when the collector crashes,
+ * using nothing but async-signal-safe calls, and print() formats a dump.
+ * Dumps are in host byte order, so read them on the same kind of machine. */
+class FlightRecorder
+{
+    public:
+	typedef enum {
+	    Connected,
+	    Disconnected,       /* arg1: error code */
+	    Reconnect,          /* arg1: delay in ms */
+	    WatchdogTimeout,
+	    Read,               /* arg1: bytes */
+	    Frame,              /* arg0: type, arg1: valid */
+	    ChecksumFailure,    /* arg0: type, arg1: length */
+	    LengthError,        /* arg0: type */
+	    Record,             /* arg0: channel, arg2: sequence */
+	    StationStatus,      /* arg0: attached */
+	    MissedFrames,       /* arg1: count, arg2: sequence */
+	    InvalidRecordStream,
+	    Sample,             /* arg0: sensor, arg1: value as float bits, arg2: timestamp */
+	    Query,              /* arg0: succeeded, arg2: duration in us */
+	    SourceStale,        /* arg0: source, arg1: station, arg2: seconds silent */
+	    SourceRecovered,    /* arg0: source, arg1: station */
+	    EventCount
+	} Event;
+
+	static void record(Event event, uint16_t arg0 = 0, uint32_t arg1 = 0, uint64_t arg2 = 0) {
+	    uint64_t pos = m_position.load(std::memory_order_relaxed);
+	    Entry& entry = m_ring[pos & (ringSize - 1)];
+	    struct timespec now;
+
+	    clock_gettime(CLOCK_REALTIME_COARSE, &now);
+	    entry.timestamp = (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+	    entry.event = event;
+	    entry.arg0 = arg0;
+	    entry.arg1 = arg1;
+	    entry.arg2 = arg2;
+	    m_position.store(pos + 1, std::memory_order_release);
+	}
+
+	/* sets the file to dump to, and dumps there on a crash */
+	static void install(const std::string& path);
+	/* async-signal-safe */
+	static bool dump();
+	static bool print(const std::string& path, std::ostream& out);
+
+    private:
+	typedef struct {
+	    uint64_t timestamp;     /* us since the epoch */
+	    uint16_t event;
+	    uint16_t arg0;
+	    uint32_t arg1;
+	    uint64_t arg2;
+	} Entry;
+
+	/* the dumped entries are valid from first up to before end; the
+	 * others were overwritten while dumping, or never written */
+	typedef struct {
+	    char magic[4];
+	    uint32_t version;
+	    uint32_t entrySize;
+	    uint32_t ringSize;
+	    uint64_t first;
+	    uint64_t end;
+	} DumpHeader;
+
+	static void crashHandler(int signal);
+	static void format(std::ostream& out, const Entry& entry);
+
+    private:
+	static const size_t ringSize = 16384; /* must be a power of 2 */
+	static const uint32_t version = 1;
+	static const size_t maxPathLength = 4096;
+
+	static Entry m_ring[ringSize];
+	static std::atomic<uint64_t> m_position;
+	/* a plain buffer, as the crash handler can't touch a std::string */
+	static char m_path[maxPathLength];
+};
+
+#endif /* __FLIGHTRECORDER_H__ */
@@ -0,0 +1,139 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include "DebugLog.h"
+#include "FlightRecorder.h"
+#include "FrameParser.h"
+#include "Options.h"
+#include "WmrMessage.h"
+
+FrameParser::FrameParser(bool resync) :
+    m_state(StartMarker),
+    m_pos(0),
+    m_resync(resync),
+    m_rescanDepth(0),
+    m_recovering(false)
+{
+    memset(&m_stats, 0, sizeof(m_stats));
+    /* pre-alloc buffer to avoid reallocations */
+    m_data.reserve(64);
+}
+
+void
+FrameParser::reset()
+{
+    m_data.clear();
+    m_state = StartMarker;
+    m_pos = 0;
+    m_recovering = false;
+}
+
+size_t
+FrameParser::feed(const uint8_t *data, size_t length, const FrameHandler& handler)
+{
+    unsigned long frames = m_stats.frames;
+
+    process(data, length, handler);
+    return m_stats.frames - frames;
+}
+
+void
+FrameParser::process(const uint8_t *data, size_t length, const FrameHandler& handler)
+{
+    size_t pos = 0;
+
+    while (pos < length) {
+	uint8_t dataByte = data[pos++];
+	ssize_t len;
+
+	switch (m_state) {
+	    case StartMarker:
+		if (m_pos == 0 && dataByte == 0xff) {
+		    m_pos++;
+		} else if (m_pos == 1 && dataByte == 0xff) {
+		    m_state = Flags;
+		    m_recovering = m_rescanDepth > 0;
+		} else {
+		    m_pos = 0;
+		}
+		break;
+	    case Flags:
+		m_data.push_back(dataByte);
+		m_state = Type;
+		break;
+	    case Type:
+		m_data.push_back(dataByte);
+		len = WmrMessage::packetLengthForType(dataByte);
+		if (len > 0) {
+		    m_pos = len - 2; /* we already read flags + type */
+		    m_state = Data;
+		} else if (m_resync) {
+		    m_stats.lengthErrors++;
+		    FlightRecorder::record(FlightRecorder::LengthError, dataByte);
+		    resync(handler);
+		} else {
+		    reset();
+		}
+		break;
+	    case Data:
+		m_data.push_back(dataByte);
+		m_pos--;
+		if (m_pos == 0) {
+		    if (m_resync && !WmrMessage::checksumValid(m_data)) {
+			m_stats.checksumFailures++;
+			FlightRecorder::record(FlightRecorder::ChecksumFailure, m_data[1], m_data.size());
+			resync(handler);
+			break;
+		    }
+		    if (m_recovering) {
+			m_stats.recoveredFrames++;
+		    }
+		    m_stats.frames++;
+		    handler(m_data);
+		    reset();
+		}
+		break;
+	}
+    }
+}
+
+void
+FrameParser::resync(const FrameHandler& handler)
+{
+    DebugStream& debug = Options::ioDebug();
+    std::vector<uint8_t> discarded;
+
+    /* Rescan everything after the first byte of the rejected frame's start
+     * marker; the second marker byte may be the first one of the next frame.
+     * Each rescan is one byte shorter than its input, so this terminates. */
+    discarded.reserve(m_data.size() + 1);
+    discarded.push_back(0xff);
+    discarded.insert(discarded.end(), m_data.begin(), m_data.end());
+    reset();
+
+    m_stats.resyncs++;
+    if (debug) {
+	DebugLog::log(DebugLog::IoResync, discarded.size());
+    }
+
+    m_rescanDepth++;
+    process(&discarded[0], discarded.size(), handler);
+    m_rescanDepth--;
+}
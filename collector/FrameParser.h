@@ -0,0 +1,79 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAMEPARSER_H__
+#define __FRAMEPARSER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+#include <boost/function.hpp>
+
+/* Splits the raw station byte stream into frames (flags, type, payload,
+ * checksum) delimited by 0xff 0xff start markers. Partial frames are kept
+ * across calls to feed(), so data can be passed in as it arrives.
+ *
+ * In resync mode, frames are checksummed before being handed out, and the
+ * bytes of a rejected frame are scanned again for the next start marker,
+ * as a corrupted or truncated frame may well contain the start of the
+ * next good one. */
+class FrameParser
+{
+    public:
+	typedef boost::function<void (const std::vector<uint8_t>& frame)> FrameHandler;
+
+	typedef struct {
+	    unsigned long frames;
+	    unsigned long resyncs;
+	    unsigned long checksumFailures;
+	    unsigned long lengthErrors;
+	    unsigned long recoveredFrames;
+	} Statistics;
+
+	FrameParser(bool resync = true);
+
+	/* returns the number of frames passed to the handler */
+	size_t feed(const uint8_t *data, size_t length, const FrameHandler& handler);
+	void reset();
+
+	const Statistics& statistics() const {
+	    return m_stats;
+	}
+
+    private:
+	void process(const uint8_t *data, size_t length, const FrameHandler& handler);
+	void resync(const FrameHandler& handler);
+
+    private:
+	enum {
+	    StartMarker,
+	    Flags,
+	    Type,
+	    Data
+	} m_state;
+
+	size_t m_pos;
+	std::vector<uint8_t> m_data;
+	bool m_resync;
+	unsigned int m_rescanDepth;
+	bool m_recovering;
+	Statistics m_stats;
+};
+
+#endif /* __FRAMEPARSER_H__ */
@@ -17,69 +17,334 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <iomanip>
+#include <sstream>
+#include <stdexcept>
+#include <time.h>
+#include <unistd.h>
+#include "DebugLog.h"
+#include "FlightRecorder.h"
 #include "IoHandler.h"
+#include "Metrics.h"
 #include "Options.h"
 #include "WmrMessage.h"
 
-IoHandler::IoHandler(const std::string& host, const std::string& port, boost::shared_ptr<Database>& db) :
+IoHandler::IoHandler(const std::string& host, const std::string& port,
+		     boost::shared_ptr<Database>& db, boost::shared_ptr<Clock>& clock) :
     boost::asio::io_service(),
-    m_state(StartMarker),
-    m_pos(0),
+    m_host(host),
+    m_port(port),
+    m_resolver(*this),
     m_socket(*this),
     m_watchdog(*this),
+    m_reconnectTimer(*this),
     m_db(db),
-    m_active(true)
+    m_clock(clock),
+    m_state(Resolving),
+    m_reconnects(0),
+    m_reconnectDelay(minReconnectDelay),
+    m_random(getpid()),
+    m_parser(Options::resync()),
+    m_framed(Options::framed()),
+    m_haveSequence(false),
+    m_lastSequence(0),
+    m_haveStoredSequence(false),
+    m_sequenceChanged(false),
+    m_storedSequence(0),
+    m_staleness(Options::staleIntervals()),
+    m_linkTimeout(maxWatchdogTimeout),
+    m_lastReceived(0),
+    m_replayTimer(*this),
+    m_replaySpeed(0),
+    m_replayStart(0),
+    m_replayTimestamp(0),
+    m_replayLength(0),
+    m_replayEntries(0)
 {
-    boost::system::error_code error;
-    boost::asio::ip::tcp::resolver resolver(*this);
-    boost::asio::ip::tcp::resolver::query query(host, port);
-    boost::asio::ip::tcp::resolver::iterator endpoint = resolver.resolve(query, error);
+    const std::string& journalPath = Options::recordPath();
 
-    if (error) {
-	doClose(error);
-    } else {
-	m_socket.async_connect(*endpoint,
-			       boost::bind(&IoHandler::handleConnect, this,
-					   boost::asio::placeholders::error));
+    if (!journalPath.empty()) {
+	m_journal.reset(new JournalWriter());
+	if (!m_journal->open(journalPath, m_framed)) {
+	    throw std::runtime_error("Could not open journal " + journalPath);
+	}
     }
 
-    /* pre-alloc buffer to avoid reallocations */
-    m_data.reserve(64);
+    loadSequence();
+    startWatchdog();
+    startResolve();
+}
+
+IoHandler::IoHandler(const std::string& journalPath, double speed,
+		     boost::shared_ptr<Database>& db) :
+    boost::asio::io_service(),
+    m_resolver(*this),
+    m_socket(*this),
+    m_watchdog(*this),
+    m_reconnectTimer(*this),
+    m_db(db),
+    m_state(Connected),
+    m_reconnects(0),
+    m_reconnectDelay(minReconnectDelay),
+    m_random(getpid()),
+    m_parser(Options::resync()),
+    m_framed(false),
+    m_haveSequence(false),
+    m_lastSequence(0),
+    m_haveStoredSequence(false),
+    m_sequenceChanged(false),
+    m_storedSequence(0),
+    m_staleness(Options::staleIntervals()),
+    m_linkTimeout(maxWatchdogTimeout),
+    m_lastReceived(0),
+    m_replay(new JournalReader()),
+    m_replayClock(new ManualClock()),
+    m_replayTimer(*this),
+    m_replaySpeed(speed),
+    m_replayStart(0),
+    m_replayTimestamp(0),
+    m_replayLength(0),
+    m_replayEntries(0)
+{
+    if (!m_replay->open(journalPath)) {
+	throw std::runtime_error("Could not open journal " + journalPath);
+    }
+    /* the journal tells what it holds; the sequence file isn't touched,
+     * as it belongs to the live collector */
+    m_framed = m_replay->framed();
+    m_clock = m_replayClock;
+
+    readStart();
 }
 
 IoHandler::~IoHandler()
 {
-    if (m_active) {
+    if (m_state != Closed) {
 	m_socket.close();
     }
 }
 
+void
+IoHandler::startResolve()
+{
+    boost::asio::ip::tcp::resolver::query query(m_host, m_port);
+
+    m_state = Resolving;
+    m_resolver.async_resolve(query,
+			     boost::bind(&IoHandler::handleResolve, this,
+					 boost::asio::placeholders::error,
+					 boost::asio::placeholders::iterator));
+}
+
+void
+IoHandler::handleResolve(const boost::system::error_code& error,
+			 boost::asio::ip::tcp::resolver::iterator endpoint)
+{
+    if (m_state != Resolving) {
+	return;
+    }
+
+    if (error) {
+	scheduleReconnect(error);
+    } else {
+	m_state = Connecting;
+	boost::asio::async_connect(m_socket, endpoint,
+				   boost::bind(&IoHandler::handleConnect, this,
+					       boost::asio::placeholders::error));
+    }
+}
+
 void
 IoHandler::handleConnect(const boost::system::error_code& error)
 {
+    if (m_state != Connecting) {
+	return;
+    }
+
     if (error) {
-	doClose(error);
+	scheduleReconnect(error);
     } else {
-	resetWatchdog();
+	m_state = Connected;
+	Metrics::set(Metrics::connected, 1);
+	FlightRecorder::record(FlightRecorder::Connected);
+	if (m_journal && !m_journal->addConnect(m_clock->nowMicroseconds())) {
+	    stopRecording();
+	}
+	resetWatchdog(m_clock->monotonicSeconds());
+	if (m_framed) {
+	    sendRequest();
+	}
 	readStart();
     }
 }
 
 void
-IoHandler::resetWatchdog()
+IoHandler::sendRequest()
 {
-    m_watchdog.expires_from_now(boost::posix_time::minutes(5));
-    m_watchdog.async_wait(boost::bind(&IoHandler::watchdogTimeout, this,
+    std::ostringstream request;
+
+    request << "STREAM";
+    if (m_haveSequence) {
+	request << " after=" << m_lastSequence;
+    }
+    request << "\n";
+    m_request = request.str();
+
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_request),
+			     boost::bind(&IoHandler::requestComplete, this,
+					 boost::asio::placeholders::error));
+}
+
+void
+IoHandler::requestComplete(const boost::system::error_code& error)
+{
+    if (error && error != boost::asio::error::operation_aborted && m_state == Connected) {
+	scheduleReconnect(error);
+    }
+}
+
+void
+IoHandler::scheduleReconnect(const boost::system::error_code& error)
+{
+    long delay;
+
+    if (error && error != boost::asio::error::operation_aborted) {
+	std::cerr << "Error: " << error.message() << std::endl;
+    }
+
+    if (m_replay) {
+	/* there is nothing to reconnect to; the journal goes on with
+	 * what came after the reconnect */
+	m_parser.reset();
+	m_records.reset();
+	readStart();
+	return;
+    }
+
+    m_socket.close();
+    Metrics::set(Metrics::connected, 0);
+    /* a partial frame can't be continued on the new connection */
+    m_parser.reset();
+    m_records.reset();
+
+    /* wait between half and the full current delay, so multiple
+     * collectors don't hit a restarted forwarder at the same time */
+    delay = std::uniform_int_distribution<long>(m_reconnectDelay / 2, m_reconnectDelay)(m_random);
+    m_reconnectDelay *= 2;
+    if (m_reconnectDelay > maxReconnectDelay) {
+	m_reconnectDelay = maxReconnectDelay;
+    }
+
+    m_state = WaitingForReconnect;
+    m_reconnects++;
+    Metrics::add(Metrics::reconnects);
+    FlightRecorder::record(FlightRecorder::Disconnected, 0, error.value());
+    FlightRecorder::record(FlightRecorder::Reconnect, 0, delay);
+    m_reconnectTimer.expires_from_now(boost::posix_time::milliseconds(delay));
+    m_reconnectTimer.async_wait(boost::bind(&IoHandler::reconnectTimeout, this,
+					    boost::asio::placeholders::error));
+}
+
+void
+IoHandler::reconnectTimeout(const boost::system::error_code& error)
+{
+    if (error != boost::asio::error::operation_aborted && m_state == WaitingForReconnect) {
+	startResolve();
+    }
+}
+
+/* The watchdog ticks once a second for as long as the handler lives,
+ * also while disconnected, so sources go stale during outages as well. */
+void
+IoHandler::startWatchdog()
+{
+    m_watchdog.expires_from_now(boost::posix_time::seconds(1));
+    m_watchdog.async_wait(boost::bind(&IoHandler::watchdogTick, this,
 				      boost::asio::placeholders::error));
 }
 
+/* anything valid from the forwarder shows the link is alive, whether it
+ * carries samples or not */
+void
+IoHandler::resetWatchdog(time_t now)
+{
+    m_lastReceived = now;
+}
+
+void
+IoHandler::watchdogTick(const boost::system::error_code& error)
+{
+    time_t now;
+
+    if (error == boost::asio::error::operation_aborted || m_state == Closed) {
+	return;
+    }
+
+    now = m_clock->monotonicSeconds();
+    m_staleness.advance(now, boost::bind(&IoHandler::sourceStale, this, _1, _2, _3, _4));
+    /* once a second at most, as it is rewritten with every frame */
+    saveSequence();
+
+    if (m_state == Connected && now - m_lastReceived >= m_linkTimeout) {
+	std::cerr << "Error: No data received for " << m_linkTimeout
+		  << " seconds, reconnecting" << std::endl;
+	Metrics::add(Metrics::watchdogTimeouts);
+	FlightRecorder::record(FlightRecorder::WatchdogTimeout);
+	scheduleReconnect(boost::system::error_code());
+    }
+
+    /* relative to the last expiry, so the ticks don't drift */
+    m_watchdog.expires_at(m_watchdog.expires_at() + boost::posix_time::seconds(1));
+    m_watchdog.async_wait(boost::bind(&IoHandler::watchdogTick, this,
+				      boost::asio::placeholders::error));
+}
+
+void
+IoHandler::trackSamples()
+{
+    const std::vector<Database::NumericSensors>& sensors = m_batch.sensors();
+    const std::vector<time_t>& intervals = m_batch.intervals();
+    const std::vector<unsigned int>& stations = m_batch.stations();
+    /* replays go by the journal's time, whatever their speed */
+    time_t now = m_clock->monotonicSeconds(), timeout;
+
+    for (size_t i = 0; i < sensors.size(); i++) {
+	if (m_staleness.update(stations[i], sensors[i], intervals[i], now)) {
+	    StalenessTracker::Source source = StalenessTracker::sourceForSensor(sensors[i]);
+
+	    std::cerr << "Receiving " << StalenessTracker::sourceName(source)
+		      << " data of station " << stations[i] << " again" << std::endl;
+	    FlightRecorder::record(FlightRecorder::SourceRecovered, source, stations[i]);
+	}
+    }
+    Metrics::set(Metrics::staleSources, m_staleness.staleCount());
+
+    /* taken while the sources are fresh, so it still holds when they go
+     * stale during a silence of the link */
+    timeout = m_staleness.linkTimeout();
+    if (timeout) {
+	m_linkTimeout = std::min(timeout, maxWatchdogTimeout);
+    }
+}
+
 void
-IoHandler::watchdogTimeout(const boost::system::error_code& error)
+IoHandler::sourceStale(unsigned int station, StalenessTracker::Source source,
+		       const std::vector<Database::NumericSensors>& sensors, time_t silence)
 {
-    if (error != boost::asio::error::operation_aborted) {
-	doClose(error);
+    std::cerr << "Error: No " << StalenessTracker::sourceName(source) << " data of station "
+	      << station << " for " << silence << " seconds" << std::endl;
+    FlightRecorder::record(FlightRecorder::SourceStale, source, station, silence);
+    Metrics::set(Metrics::staleSources, m_staleness.staleCount());
+
+    /* end the runs at their last sample, rather than extending them over
+     * the gap once the source is back */
+    if (m_db) {
+	for (size_t i = 0; i < sensors.size(); i++) {
+	    m_db->markStale(sensors[i]);
+	}
     }
 }
 
@@ -87,74 +352,252 @@ void
 IoHandler::readComplete(const boost::system::error_code& error,
 			size_t bytesTransferred)
 {
-    size_t pos = 0;
     DebugStream& debug = Options::ioDebug();
+    bool valid = true, stored = true;
+    uint64_t received;
 
+    if (m_state != Connected) {
+	/* stale completion of a connection we already gave up on */
+	return;
+    }
     if (error) {
-	doClose(error);
+	scheduleReconnect(error);
 	return;
     }
+    if (Metrics::timing) {
+	Metrics::readTime = Metrics::now();
+    }
+    /* one reading for the journal and the samples of this chunk */
+    received = m_clock->nowMicroseconds();
 
-    resetWatchdog();
+    Metrics::add(Metrics::bytesRead, bytesTransferred);
+    FlightRecorder::record(FlightRecorder::Read, 0, bytesTransferred);
 
+    if (m_journal && !m_journal->addData(received, m_recvBuffer, bytesTransferred)) {
+	stopRecording();
+    }
     if (debug) {
-	debug << "IO: Got bytes ";
-	for (size_t i = 0; i < bytesTransferred; i++) {
-	    debug << std::setfill('0') << std::setw(2)
-		  << std::showbase << std::hex
-		  << (unsigned int) m_recvBuffer[i] << " ";
+	DebugLog::logData(DebugLog::IoBytes, m_recvBuffer, bytesTransferred);
+    }
+
+    m_batch.clear();
+    if (m_framed) {
+	/* records carry the time the forwarder received them */
+	valid = m_records.feed(m_recvBuffer, bytesTransferred,
+			       boost::bind(&IoHandler::handleRecord, this, _1));
+    } else {
+	/* stamp all frames of this chunk with the time their bytes arrived */
+	if (WmrMessage::decodeBuffer(m_parser, m_recvBuffer, bytesTransferred,
+				     received / 1000000, 0, m_batch) > 0) {
+	    resetWatchdog(m_clock->monotonicSeconds());
 	}
-	debug << std::endl;
-    }
-
-    while (pos < bytesTransferred) {
-	uint8_t dataByte = m_recvBuffer[pos++];
-	ssize_t len;
-
-	switch (m_state) {
-	    case StartMarker:
-		if (m_pos == 0 && dataByte == 0xff) {
-		    m_pos++;
-		} else if (m_pos == 1 && dataByte == 0xff) {
-		    m_state = Flags;
-		} else {
-		    m_pos = 0;
-		}
-		break;
-	    case Flags:
-		m_data.push_back(dataByte);
-		m_state = Type;
-		break;
-	    case Type:
-		len = WmrMessage::packetLengthForType(dataByte);
-		if (len > 0) {
-		    m_pos = len - 2; /* we already read flags + type */
-		    m_state = Data;
-		    m_data.push_back(dataByte);
-		} else {
-		    m_data.clear();
-		    m_state = StartMarker;
-		    m_pos = 0;
-		}
-		break;
-	    case Data:
-		m_data.push_back(dataByte);
-		m_pos--;
-		if (m_pos == 0) {
-		    WmrMessage message(m_data, m_db);
-		    if (message.isValid()) {
-			message.parse();
-		    }
-		    m_data.clear();
-		    m_state = StartMarker;
-		}
-		break;
+	Metrics::updateParser(m_parser.statistics());
+    }
+    if (!m_batch.empty()) {
+	trackSamples();
+    }
+    if (m_db && !m_batch.empty()) {
+	const std::vector<Database::NumericSensors>& sensors = m_batch.sensors();
+	const std::vector<float>& values = m_batch.values();
+	const std::vector<time_t>& timestamps = m_batch.timestamps();
+
+	for (size_t i = 0; i < sensors.size(); i++) {
+	    uint32_t value;
+
+	    memcpy(&value, &values[i], sizeof(value));
+	    Metrics::add(Metrics::samples[sensors[i]]);
+	    FlightRecorder::record(FlightRecorder::Sample, sensors[i], value, timestamps[i]);
 	}
+	Metrics::recordSince(Metrics::enqueueLatency, Metrics::readTime);
+	stored = m_db->addSensorValues(m_batch);
+	Metrics::recordSince(Metrics::commitLatency, Metrics::readTime);
+    }
+
+    if (!stored && m_framed && !m_replay) {
+	/* resume after the frames stored last, so the forwarder sends the
+	 * lost ones again */
+	std::cerr << "Error: Could not store samples, requesting them again" << std::endl;
+	m_haveSequence = m_haveStoredSequence;
+	m_lastSequence = m_storedSequence;
+	scheduleReconnect(boost::system::error_code());
+	return;
+    }
+    /* data is flowing again, so start over with short delays next time */
+    m_reconnectDelay = minReconnectDelay;
+    /* it is persisted by the watchdog, only after storing, so a crash in
+     * between can't skip frames */
+    if (m_haveSequence && (!m_haveStoredSequence || m_storedSequence != m_lastSequence)) {
+	m_haveStoredSequence = true;
+	m_storedSequence = m_lastSequence;
+	m_sequenceChanged = true;
+    }
+
+    if (!valid) {
+	std::cerr << "Error: Invalid record stream, reconnecting" << std::endl;
+	Metrics::add(Metrics::invalidRecordStreams);
+	FlightRecorder::record(FlightRecorder::InvalidRecordStream);
+	scheduleReconnect(boost::system::error_code());
+	return;
     }
 
     readStart();
 }
 
+void
+IoHandler::handleRecord(const RecordParser::Record& record)
+{
+    /* status records count as well, the station may be detached */
+    resetWatchdog(m_clock->monotonicSeconds());
+    if (record.type == RecordParser::TypeStatus) {
+	FlightRecorder::record(FlightRecorder::StationStatus,
+			       record.data[0] != RecordParser::StatusDetached);
+	if (record.data[0] == RecordParser::StatusDetached) {
+	    std::cerr << "Error: Station detached from forwarder" << std::endl;
+	} else {
+	    std::cerr << "Station attached to forwarder" << std::endl;
+	}
+	return;
+    }
+    if (record.type != RecordParser::TypeFrame) {
+	return;
+    }
+    FlightRecorder::record(FlightRecorder::Record, record.channel, 0, record.sequence);
+    /* the forwarder's clock is only comparable to ours while live */
+    if (Metrics::timing && !m_replay) {
+	uint64_t now = m_clock->nowMicroseconds();
+	Metrics::forwarderLatency.record(now > record.timestamp ? now - record.timestamp : 0);
+    }
+
+    if (m_haveSequence && record.sequence != m_lastSequence + 1) {
+	uint32_t missed = record.sequence - m_lastSequence - 1;
+
+	if (missed < 0x80000000) {
+	    std::cerr << "Error: Missed " << missed << " frames" << std::endl;
+	    Metrics::add(Metrics::missedFrames, missed);
+	    FlightRecorder::record(FlightRecorder::MissedFrames, 0, missed, record.sequence);
+	} else {
+	    std::cerr << "Error: Forwarder restarted its sequence at "
+		      << record.sequence << std::endl;
+	}
+    }
+    m_haveSequence = true;
+    m_lastSequence = record.sequence;
+
+    WmrMessage::decodeFrame(record.data, &m_batch, record.timestamp / 1000000,
+			    record.channel);
+}
+
+void
+IoHandler::loadSequence()
+{
+    const std::string& path = Options::sequenceFilePath();
+
+    if (!m_framed || path.empty()) {
+	return;
+    }
+
+    std::ifstream file(path.c_str());
+    if (file >> m_lastSequence) {
+	m_haveSequence = m_haveStoredSequence = true;
+	m_storedSequence = m_lastSequence;
+    }
+}
+
+void
+IoHandler::saveSequence()
+{
+    const std::string& path = Options::sequenceFilePath();
+
+    if (m_replay || !m_sequenceChanged || path.empty()) {
+	return;
+    }
+
+    /* replace the file at once, so it never is found empty */
+    std::string tmpPath = path + ".tmp";
+    std::ofstream file(tmpPath.c_str(), std::ios::out | std::ios::trunc);
+    file << m_storedSequence << std::endl;
+    file.close();
+
+    if (!file || rename(tmpPath.c_str(), path.c_str()) != 0) {
+	std::cerr << "Error: Could not write sequence file " << path << std::endl;
+    }
+    m_sequenceChanged = false;
+}
+
+void
+IoHandler::stopRecording()
+{
+    std::cerr << "Error: Could not write journal " << Options::recordPath()
+	      << ", stopping to record" << std::endl;
+    m_journal.reset();
+}
+
+void
+IoHandler::scheduleReplay()
+{
+    if (!m_replay->next(m_replayTimestamp, m_recvBuffer, maxReadLength, m_replayLength)) {
+	finishReplay();
+	return;
+    }
+
+    if (m_replayEntries++ == 0) {
+	m_replayStart = m_replayTimestamp;
+	m_replayWallStart = boost::posix_time::microsec_clock::universal_time();
+    }
+
+    if (m_replaySpeed > 0) {
+	uint64_t offset = 0;
+
+	if (m_replayTimestamp > m_replayStart) {
+	    offset = (m_replayTimestamp - m_replayStart) / m_replaySpeed;
+	}
+	m_replayTimer.expires_at(m_replayWallStart +
+				 boost::posix_time::microseconds((int64_t) offset));
+	m_replayTimer.async_wait(boost::bind(&IoHandler::replayEntry, this,
+					     boost::asio::placeholders::error));
+    } else {
+	/* through the queue rather than recursing, so close() gets in */
+	post(boost::bind(&IoHandler::replayEntry, this, boost::system::error_code()));
+    }
+}
+
+void
+IoHandler::replayEntry(const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted || m_state != Connected) {
+	return;
+    }
+
+    m_replayClock->setMicroseconds(m_replayTimestamp);
+    /* there is no watchdog to turn the wheel */
+    m_staleness.advance(m_replayClock->now(),
+			boost::bind(&IoHandler::sourceStale, this, _1, _2, _3, _4));
+    if (m_replayLength == 0) {
+	/* the recording collector (re)connected here */
+	m_parser.reset();
+	m_records.reset();
+	readStart();
+	return;
+    }
+
+    readComplete(boost::system::error_code(), m_replayLength);
+}
+
+void
+IoHandler::finishReplay()
+{
+    boost::posix_time::time_duration elapsed =
+	    boost::posix_time::microsec_clock::universal_time() - m_replayWallStart;
+
+    if (m_replay->error()) {
+	std::cerr << "Error: Journal is corrupt after entry " << m_replayEntries << std::endl;
+    }
+    std::cout << "Replayed " << m_replayEntries << " journal entries in "
+	      << (m_replayEntries ? elapsed.total_milliseconds() : 0) << " ms" << std::endl;
+
+    doClose(boost::system::error_code());
+}
+
 void
 IoHandler::doClose(const boost::system::error_code& error)
 {
@@ -162,7 +605,13 @@ IoHandler::doClose(const boost::system::error_code& error)
 	std::cerr << "Error: " << error.message() << std::endl;
     }
 
+    m_state = Closed;
+    Metrics::set(Metrics::connected, 0);
+    saveSequence();
+    m_resolver.cancel();
+    m_reconnectTimer.cancel();
+    m_watchdog.cancel();
+    m_replayTimer.cancel();
     m_socket.close();
-    m_active = false;
     stop();
 }
@@ -23,13 +23,47 @@
 #include <boost/asio.hpp>
 #include <boost/bind.hpp>
 #include <boost/function.hpp>
+#include <boost/scoped_ptr.hpp>
+#include <atomic>
 #include <fstream>
+#include <random>
+#include "Clock.h"
 #include "Database.h"
+#include "FrameParser.h"
+#include "Journal.h"
+#include "RecordParser.h"
+#include "SampleBatch.h"
+#include "StalenessTracker.h"
 
+/* Keeps a connection to the forwarder alive for the lifetime of the
+ * process: after a disconnect or watchdog expiry it reconnects on the same
+ * io_service after a short, exponentially growing and jittered delay.
+ * The watchdog expects data within a few intervals of the most frequent
+ * source that was still reporting when samples came in last, and reports
+ * sources that fall silent while the others go on.
+ * With the framed protocol, it asks for the frames after the last one it
+ * got, so the forwarder resends what was missed in between.
+ *
+ * Instead of connecting, it can also feed a journal of recorded data
+ * through the same processing, stamping the data with the time it was
+ * originally received, and close once it is done. */
 class IoHandler : public boost::asio::io_service
 {
     public:
-	IoHandler(const std::string& host, const std::string& port, boost::shared_ptr<Database>& db);
+	typedef enum {
+	    Resolving,
+	    Connecting,
+	    Connected,
+	    WaitingForReconnect,
+	    Closed
+	} ConnectionState;
+
+	IoHandler(const std::string& host, const std::string& port,
+		  boost::shared_ptr<Database>& db, boost::shared_ptr<Clock>& clock);
+	/* replays the journal at speed times its pace, or without delays if
+	 * speed is 0 */
+	IoHandler(const std::string& journalPath, double speed,
+		  boost::shared_ptr<Database>& db);
 	~IoHandler();
 
 	void close() {
@@ -38,14 +72,33 @@ class IoHandler : public boost::asio::io_service
 	}
 
 	bool active() {
-	    return m_active;
+	    return m_state != Closed;
+	}
+	/* takes effect from the next received data on, without reconnecting */
+	void setDatabase(const boost::shared_ptr<Database>& db) {
+	    m_db = db;
+	}
+	ConnectionState connectionState() const {
+	    return m_state;
+	}
+	unsigned long reconnects() const {
+	    return m_reconnects;
 	}
 
     private:
 	/* maximum amount of data to read in one operation */
 	static const int maxReadLength = 512;
+	/* reconnect delay bounds, in milliseconds */
+	static const long minReconnectDelay = 50;
+	static const long maxReconnectDelay = 1000;
+	/* watchdog timeout until the first source is seen, in seconds */
+	static const time_t maxWatchdogTimeout = 5 * 60;
 
 	void readStart() {
+	    if (m_replay) {
+		scheduleReplay();
+		return;
+	    }
 	    /* Start an asynchronous read and call read_complete when it completes or fails */
 	    m_socket.async_read_some(boost::asio::buffer(m_recvBuffer, maxReadLength),
 				     boost::bind(&IoHandler::readComplete, this,
@@ -53,27 +106,69 @@ class IoHandler : public boost::asio::io_service
 				     boost::asio::placeholders::bytes_transferred));
 	}
 
+	void startResolve();
+	void handleResolve(const boost::system::error_code& error,
+			   boost::asio::ip::tcp::resolver::iterator endpoint);
 	void handleConnect(const boost::system::error_code& error);
+	void sendRequest();
+	void requestComplete(const boost::system::error_code& error);
+	void handleRecord(const RecordParser::Record& record);
+	void loadSequence();
+	void saveSequence();
 	void readComplete(const boost::system::error_code& error, size_t bytesTransferred);
+	void scheduleReconnect(const boost::system::error_code& error);
+	void reconnectTimeout(const boost::system::error_code& error);
 	void doClose(const boost::system::error_code& error);
-	void resetWatchdog();
-	void watchdogTimeout(const boost::system::error_code& error);
+	void startWatchdog();
+	void resetWatchdog(time_t now);
+	void watchdogTick(const boost::system::error_code& error);
+	void trackSamples();
+	void sourceStale(unsigned int station, StalenessTracker::Source source,
+			 const std::vector<Database::NumericSensors>& sensors, time_t silence);
+	void stopRecording();
+	void scheduleReplay();
+	void replayEntry(const boost::system::error_code& error);
+	void finishReplay();
 
     private:
-	enum {
-	    StartMarker,
-	    Flags,
-	    Type,
-	    Data
-	} m_state;
-
-	size_t m_pos;
+	std::string m_host;
+	std::string m_port;
+	boost::asio::ip::tcp::resolver m_resolver;
 	boost::asio::ip::tcp::socket m_socket;
 	boost::asio::deadline_timer m_watchdog;
+	boost::asio::deadline_timer m_reconnectTimer;
 	boost::shared_ptr<Database> m_db;
-	bool m_active;
+	boost::shared_ptr<Clock> m_clock;
+	std::atomic<ConnectionState> m_state;
+	std::atomic<unsigned long> m_reconnects;
+	long m_reconnectDelay;
+	std::minstd_rand m_random;
 	unsigned char m_recvBuffer[maxReadLength];
-	std::vector<uint8_t> m_data;
+	FrameParser m_parser;
+	bool m_framed;
+	RecordParser m_records;
+	std::string m_request;
+	bool m_haveSequence;
+	uint32_t m_lastSequence;
+	/* the last frame whose samples are stored, which is resumed from */
+	bool m_haveStoredSequence;
+	bool m_sequenceChanged;
+	uint32_t m_storedSequence;
+	SampleBatch m_batch;
+	StalenessTracker m_staleness;
+	time_t m_linkTimeout;
+	time_t m_lastReceived;      /* in seconds of the monotonic clock */
+
+	boost::scoped_ptr<JournalWriter> m_journal;
+	boost::scoped_ptr<JournalReader> m_replay;
+	boost::shared_ptr<ManualClock> m_replayClock;
+	boost::asio::deadline_timer m_replayTimer;
+	double m_replaySpeed;
+	uint64_t m_replayStart;     /* receive time of the first entry, in us */
+	boost::posix_time::ptime m_replayWallStart;
+	uint64_t m_replayTimestamp; /* of the pending entry */
+	size_t m_replayLength;
+	unsigned long m_replayEntries;
 };
 
 #endif /* __IOHANDLER_H__ */
@@ -0,0 +1,182 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <cstring>
+#include "Journal.h"
+
+const char Journal::magic[4] = { 'W', 'M', 'R', 'J' };
+
+JournalWriter::JournalWriter() :
+    m_haveBase(false),
+    m_lastTimestamp(0)
+{
+}
+
+bool
+JournalWriter::open(const std::string& path, bool framed)
+{
+    char header[headerLength];
+    uint8_t flags = framed ? flagFramed : 0;
+
+    std::ifstream existing(path.c_str(), std::ios::in | std::ios::binary);
+    if (existing.read(header, sizeof(header))) {
+	if (memcmp(header, magic, sizeof(magic)) != 0 || (uint8_t) header[4] != version ||
+	    (uint8_t) header[5] != flags) {
+	    return false;
+	}
+    } else if (existing.gcount() > 0) {
+	return false;
+    }
+
+    m_file.open(path.c_str(), std::ios::out | std::ios::app | std::ios::binary);
+    if (!m_file) {
+	return false;
+    }
+    if (existing.gcount() == 0) {
+	m_file.write(magic, sizeof(magic));
+	m_file.put(version);
+	m_file.put(flags);
+    }
+    m_haveBase = false;
+
+    return m_file.flush().good();
+}
+
+void
+JournalWriter::putVarint(uint64_t value)
+{
+    while (value >= 0x80) {
+	m_file.put((char) (value | 0x80));
+	value >>= 7;
+    }
+    m_file.put((char) value);
+}
+
+bool
+JournalWriter::addConnect(uint64_t timestamp)
+{
+    putVarint(0);
+    putVarint(timestamp);
+    m_haveBase = true;
+    m_lastTimestamp = timestamp;
+
+    return m_file.flush().good();
+}
+
+bool
+JournalWriter::addData(uint64_t timestamp, const uint8_t *data, size_t length)
+{
+    if (length == 0) {
+	return true;
+    }
+    if (!m_haveBase) {
+	addConnect(timestamp);
+    }
+    /* the clock may have been set back in between */
+    if (timestamp < m_lastTimestamp) {
+	timestamp = m_lastTimestamp;
+    }
+
+    putVarint(length);
+    putVarint(timestamp - m_lastTimestamp);
+    m_file.write((const char *) data, length);
+    m_lastTimestamp = timestamp;
+
+    return m_file.flush().good();
+}
+
+JournalReader::JournalReader() :
+    m_framed(false),
+    m_error(false),
+    m_lastTimestamp(0)
+{
+}
+
+bool
+JournalReader::open(const std::string& path)
+{
+    char header[headerLength];
+
+    if (!m_file.open(path.c_str(), std::ios::in | std::ios::binary)) {
+	return false;
+    }
+    if (m_file.sgetn(header, sizeof(header)) != (std::streamsize) sizeof(header) ||
+	memcmp(header, magic, sizeof(magic)) != 0 || (uint8_t) header[4] != version) {
+	return false;
+    }
+    m_framed = (header[5] & flagFramed) != 0;
+
+    return true;
+}
+
+bool
+JournalReader::getVarint(uint64_t& value)
+{
+    unsigned int shift = 0;
+
+    value = 0;
+    while (shift < 64) {
+	int c = m_file.sbumpc();
+
+	if (c == std::char_traits<char>::eof()) {
+	    return false;
+	}
+	value |= (uint64_t) (c & 0x7f) << shift;
+	if (!(c & 0x80)) {
+	    return true;
+	}
+	shift += 7;
+    }
+
+    return false;
+}
+
+bool
+JournalReader::next(uint64_t& timestamp, uint8_t *buffer, size_t maxLength, size_t& length)
+{
+    uint64_t value;
+
+    /* a clean end is right before an entry */
+    if (m_error || m_file.sgetc() == std::char_traits<char>::eof()) {
+	return false;
+    }
+
+    if (!getVarint(value) || value > maxLength) {
+	m_error = true;
+	return false;
+    }
+    length = value;
+    if (!getVarint(value)) {
+	m_error = true;
+	return false;
+    }
+
+    if (length == 0) {
+	m_lastTimestamp = value;
+    } else {
+	m_lastTimestamp += value;
+	if (m_file.sgetn((char *) buffer, length) != (std::streamsize) length) {
+	    m_error = true;
+	    return false;
+	}
+    }
+    timestamp = m_lastTimestamp;
+
+    return true;
+}
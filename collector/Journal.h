@@ -0,0 +1,97 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __JOURNAL_H__
+#define __JOURNAL_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <fstream>
+#include <string>
+
+/* Journal of the data received from the forwarder, to reproduce problems
+ * and benchmark the collector offline. After a header telling whether the
+ * data is in the framed protocol, every chunk is stored as it was read,
+ * with its receive time:
+ *
+ *   varint length, varint microseconds since the previous entry, data
+ *
+ * An entry of length 0 marks a new connection; instead of a difference,
+ * it carries the receive time in microseconds since the epoch. Every
+ * writer starts with such an entry, so journals can be appended to. */
+class Journal
+{
+    protected:
+	static const char magic[4];
+	static const uint8_t version = 1;
+	static const uint8_t flagFramed = 0x01;
+	static const size_t headerLength = 6;
+};
+
+class JournalWriter : public Journal
+{
+    public:
+	JournalWriter();
+
+	/* appends to the file, creating it if needed; fails if it has other
+	 * content than a journal of the same kind of data */
+	bool open(const std::string& path, bool framed);
+
+	/* both flush the entry, so it survives a crash of the collector */
+	bool addConnect(uint64_t timestamp);
+	bool addData(uint64_t timestamp, const uint8_t *data, size_t length);
+
+    private:
+	void putVarint(uint64_t value);
+
+    private:
+	std::ofstream m_file;
+	bool m_haveBase;
+	uint64_t m_lastTimestamp;
+};
+
+class JournalReader : public Journal
+{
+    public:
+	JournalReader();
+
+	bool open(const std::string& path);
+	bool framed() const {
+	    return m_framed;
+	}
+
+	/* Reads the next entry into the buffer, setting length to 0 for a
+	 * new connection. Returns false at the end of the journal, or if
+	 * the rest is corrupt or truncated (which error() tells). */
+	bool next(uint64_t& timestamp, uint8_t *buffer, size_t maxLength, size_t& length);
+	bool error() const {
+	    return m_error;
+	}
+
+    private:
+	bool getVarint(uint64_t& value);
+
+    private:
+	std::filebuf m_file;
+	bool m_framed;
+	bool m_error;
+	uint64_t m_lastTimestamp;
+};
+
+#endif /* __JOURNAL_H__ */
@@ -0,0 +1,319 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <time.h>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <boost/bind.hpp>
+#include "Metrics.h"
+
+Histogram::Histogram() :
+    m_count(0),
+    m_sum(0)
+{
+    for (unsigned int i = 0; i < bucketCount; i++) {
+	m_counts[i].store(0, std::memory_order_relaxed);
+    }
+}
+
+void
+Histogram::record(uint64_t value)
+{
+    m_counts[bucketIndex(value)].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum.fetch_add(value, std::memory_order_relaxed);
+}
+
+unsigned int
+Histogram::bucketIndex(uint64_t value)
+{
+    unsigned int magnitude;
+
+    if (value < subBucketCount) {
+	return value;
+    }
+    if (value >> maxValueBits) {
+	return bucketCount - 1;
+    }
+
+    /* value is in [2^magnitude, 2^(magnitude + 1)); its top bits pick
+     * one of the sub buckets of that range */
+    magnitude = 63 - __builtin_clzll(value);
+    return (magnitude - subBucketBits) * subBucketCount +
+	   (value >> (magnitude - subBucketBits));
+}
+
+uint64_t
+Histogram::bucketHighestValue(unsigned int index)
+{
+    unsigned int shift;
+
+    if (index < 2 * subBucketCount) {
+	return index;
+    }
+
+    shift = index / subBucketCount - 1;
+    return (((uint64_t) (index % subBucketCount + subBucketCount + 1)) << shift) - 1;
+}
+
+uint64_t
+Histogram::quantile(double q) const
+{
+    unsigned long counts[bucketCount], total = 0, seen = 0;
+    unsigned int i;
+
+    /* work on a copy, so concurrent updates don't skew the result */
+    for (i = 0; i < bucketCount; i++) {
+	counts[i] = m_counts[i].load(std::memory_order_relaxed);
+	total += counts[i];
+    }
+    if (total == 0) {
+	return 0;
+    }
+
+    for (i = 0; i < bucketCount; i++) {
+	seen += counts[i];
+	if (seen >= q * total) {
+	    break;
+	}
+    }
+
+    return bucketHighestValue(i < bucketCount ? i : bucketCount - 1);
+}
+
+Metrics::Value Metrics::bytesRead(0);
+Metrics::Value Metrics::frames[256];
+Metrics::Value Metrics::checksumFailures(0);
+Metrics::Value Metrics::lengthErrors(0);
+Metrics::Value Metrics::resyncs(0);
+Metrics::Value Metrics::recoveredFrames(0);
+Metrics::Value Metrics::invalidRecordStreams(0);
+Metrics::Value Metrics::missedFrames(0);
+Metrics::Value Metrics::samples[Database::NumericSensorLast];
+Metrics::Value Metrics::dbQueries(0);
+Metrics::Value Metrics::dbQueryErrors(0);
+Metrics::Value Metrics::reconnects(0);
+Metrics::Value Metrics::watchdogTimeouts(0);
+Metrics::Value Metrics::staleSources(0);
+Metrics::Value Metrics::connected(0);
+Metrics::Value Metrics::lastFrameTime(0);
+bool Metrics::timing = false;
+uint64_t Metrics::readTime = 0;
+Histogram Metrics::forwarderLatency;
+Histogram Metrics::frameLatency;
+Histogram Metrics::decodeTime;
+Histogram Metrics::enqueueLatency;
+Histogram Metrics::commitLatency;
+Histogram Metrics::queryTime;
+
+uint64_t
+Metrics::now()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void
+Metrics::updateParser(const FrameParser::Statistics& stats)
+{
+    set(checksumFailures, stats.checksumFailures);
+    set(lengthErrors, stats.lengthErrors);
+    set(resyncs, stats.resyncs);
+    set(recoveredFrames, stats.recoveredFrames);
+}
+
+static void
+writeMetric(std::ostream& out, const char *name, const char *type, const char *help,
+	    const Metrics::Value& value)
+{
+    out << "# HELP " << name << " " << help << "\n"
+	<< "# TYPE " << name << " " << type << "\n"
+	<< name << " " << value.load(std::memory_order_relaxed) << "\n";
+}
+
+static void
+writeLatency(std::ostream& out, const char *stage, const Histogram& histogram)
+{
+    static const double quantiles[] = { 0.5, 0.99, 0.999 };
+
+    for (size_t i = 0; i < sizeof(quantiles) / sizeof(quantiles[0]); i++) {
+	out << "wmr_latency_seconds{stage=\"" << stage << "\",quantile=\"" << quantiles[i]
+	    << "\"} " << histogram.quantile(quantiles[i]) / 1e6 << "\n";
+    }
+    out << "wmr_latency_seconds_sum{stage=\"" << stage << "\"} " << histogram.sum() / 1e6 << "\n"
+	<< "wmr_latency_seconds_count{stage=\"" << stage << "\"} " << histogram.count() << "\n";
+}
+
+void
+Metrics::write(std::ostream& out)
+{
+    writeMetric(out, "wmr_bytes_read_total", "counter",
+		"Bytes received from the forwarder", bytesRead);
+
+    out << "# HELP wmr_frames_total Frames decoded, per message type\n"
+	<< "# TYPE wmr_frames_total counter\n";
+    for (unsigned int type = 0; type < 256; type++) {
+	unsigned long count = frames[type].load(std::memory_order_relaxed);
+	if (count) {
+	    out << "wmr_frames_total{type=\"0x" << std::hex << std::setw(2)
+		<< std::setfill('0') << type << std::dec << "\"} " << count << "\n";
+	}
+    }
+
+    writeMetric(out, "wmr_checksum_failures_total", "counter",
+		"Frames rejected for their checksum", checksumFailures);
+    writeMetric(out, "wmr_length_errors_total", "counter",
+		"Frames rejected for an unknown type", lengthErrors);
+    writeMetric(out, "wmr_resyncs_total", "counter",
+		"Rescans of rejected frames for the next start marker", resyncs);
+    writeMetric(out, "wmr_recovered_frames_total", "counter",
+		"Frames found by rescanning rejected ones", recoveredFrames);
+    writeMetric(out, "wmr_invalid_record_streams_total", "counter",
+		"Connections dropped for data that isn't a record stream", invalidRecordStreams);
+    writeMetric(out, "wmr_missed_frames_total", "counter",
+		"Frames the forwarder couldn't resend, by sequence number", missedFrames);
+
+    out << "# HELP wmr_samples_total Samples handed to the database, per sensor\n"
+	<< "# TYPE wmr_samples_total counter\n";
+    for (unsigned int sensor = 0; sensor < Database::NumericSensorLast; sensor++) {
+	unsigned long count = samples[sensor].load(std::memory_order_relaxed);
+	if (count) {
+	    out << "wmr_samples_total{sensor=\"" << sensor << "\"} " << count << "\n";
+	}
+    }
+
+    writeMetric(out, "wmr_db_queries_total", "counter",
+		"Database queries executed", dbQueries);
+    writeMetric(out, "wmr_db_query_errors_total", "counter",
+		"Database queries that failed", dbQueryErrors);
+    writeMetric(out, "wmr_reconnects_total", "counter",
+		"Reconnects to the forwarder", reconnects);
+    writeMetric(out, "wmr_watchdog_timeouts_total", "counter",
+		"Reconnects because no data arrived for too long", watchdogTimeouts);
+    writeMetric(out, "wmr_stale_sources", "gauge",
+		"Sensors of the stations that missed several intervals", staleSources);
+    writeMetric(out, "wmr_connected", "gauge",
+		"Whether the forwarder is connected", connected);
+    writeMetric(out, "wmr_last_frame_timestamp_seconds", "gauge",
+		"Receive time of the last decoded frame", lastFrameTime);
+
+    out << "# HELP wmr_latency_seconds Receive path latencies: from the forwarder to the "
+	   "socket read (forwarder), from the read to the frame being complete (frame), "
+	   "to the samples going to the database (enqueue) and to the database being done "
+	   "with them (commit); decoding a frame (decode) and running a database query (query)\n"
+	<< "# TYPE wmr_latency_seconds summary\n";
+    writeLatency(out, "forwarder", forwarderLatency);
+    writeLatency(out, "frame", frameLatency);
+    writeLatency(out, "decode", decodeTime);
+    writeLatency(out, "enqueue", enqueueLatency);
+    writeLatency(out, "commit", commitLatency);
+    writeLatency(out, "query", queryTime);
+}
+
+MetricsServer::MetricsServer(boost::asio::io_service& service, unsigned short port) :
+    m_service(service),
+    m_acceptor(service)
+{
+    /* metrics are nobody else's business, so only listen locally */
+    boost::asio::ip::tcp::endpoint endpoint(boost::asio::ip::address_v4::loopback(), port);
+
+    m_acceptor.open(endpoint.protocol());
+    m_acceptor.set_option(boost::asio::ip::tcp::acceptor::reuse_address(true));
+    m_acceptor.bind(endpoint);
+    m_acceptor.listen();
+}
+
+void
+MetricsServer::start()
+{
+    acceptStart();
+}
+
+void
+MetricsServer::stop()
+{
+    boost::system::error_code ignored;
+
+    m_acceptor.close(ignored);
+}
+
+void
+MetricsServer::acceptStart()
+{
+    boost::shared_ptr<Connection> connection(new Connection(m_service));
+
+    m_acceptor.async_accept(connection->socket(),
+			    boost::bind(&MetricsServer::acceptComplete, shared_from_this(), connection,
+					boost::asio::placeholders::error));
+}
+
+void
+MetricsServer::acceptComplete(boost::shared_ptr<Connection> connection,
+			      const boost::system::error_code& error)
+{
+    if (error == boost::asio::error::operation_aborted || !m_acceptor.is_open()) {
+	return;
+    }
+    if (error) {
+	std::cerr << "Error: Could not accept metrics connection: " << error.message() << std::endl;
+    } else {
+	connection->start();
+    }
+    acceptStart();
+}
+
+void
+MetricsServer::Connection::start()
+{
+    boost::asio::async_read_until(m_socket, m_request, "\r\n\r\n",
+				  boost::bind(&Connection::readComplete, shared_from_this(),
+					      boost::asio::placeholders::error));
+}
+
+void
+MetricsServer::Connection::readComplete(const boost::system::error_code& error)
+{
+    std::ostringstream body, response;
+
+    if (error) {
+	return;
+    }
+
+    Metrics::write(body);
+    response << "HTTP/1.0 200 OK\r\n"
+	     << "Content-Type: text/plain; version=0.0.4\r\n"
+	     << "Content-Length: " << body.str().size() << "\r\n"
+	     << "Connection: close\r\n\r\n"
+	     << body.str();
+    m_response = response.str();
+
+    boost::asio::async_write(m_socket, boost::asio::buffer(m_response),
+			     boost::bind(&Connection::writeComplete, shared_from_this()));
+}
+
+void
+MetricsServer::Connection::writeComplete()
+{
+    boost::system::error_code ignored;
+
+    m_socket.shutdown(boost::asio::ip::tcp::socket::shutdown_both, ignored);
+}
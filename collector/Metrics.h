@@ -0,0 +1,174 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __METRICS_H__
+#define __METRICS_H__
+
+#include <stdint.h>
+#include <atomic>
+#include <ostream>
+#include <boost/asio.hpp>
+#include <boost/enable_shared_from_this.hpp>
+#include <boost/shared_ptr.hpp>
+#include "Database.h"
+#include "FrameParser.h"
+
+/* Distribution of durations in microseconds, HDR style: buckets are
+ * linear within each power of two, which keeps their width within 1/16 of
+ * the values they hold from a microsecond up to hours, in a fixed array of
+ * counters. Values are recorded with relaxed atomic increments. */
+class Histogram
+{
+    public:
+	Histogram();
+
+	void record(uint64_t value);
+
+	/* the highest value equivalent to the q-th quantile, 0 if empty */
+	uint64_t quantile(double q) const;
+	unsigned long count() const {
+	    return m_count.load(std::memory_order_relaxed);
+	}
+	uint64_t sum() const {
+	    return m_sum.load(std::memory_order_relaxed);
+	}
+
+    private:
+	static const unsigned int subBucketBits = 4;
+	static const unsigned int subBucketCount = 1 << subBucketBits;
+	/* 2^36 us are about 19 hours; longer durations end up in the last bucket */
+	static const unsigned int maxValueBits = 36;
+	static const unsigned int bucketCount = (maxValueBits - subBucketBits + 1) * subBucketCount;
+
+	static unsigned int bucketIndex(uint64_t value);
+	static uint64_t bucketHighestValue(unsigned int index);
+
+    private:
+	std::atomic<unsigned long> m_counts[bucketCount];
+	std::atomic<unsigned long> m_count;
+	std::atomic<uint64_t> m_sum;
+};
+
+/* Counters and gauges of the collector. They are only ever updated with
+ * relaxed atomic operations, so keeping them costs the receive path next
+ * to nothing; a reader may see them a little out of step with each other,
+ * which doesn't matter for monitoring. */
+class Metrics
+{
+    public:
+	typedef std::atomic<unsigned long> Value;
+
+	static void add(Value& counter, unsigned long amount = 1) {
+	    counter.fetch_add(amount, std::memory_order_relaxed);
+	}
+	static void set(Value& gauge, unsigned long value) {
+	    gauge.store(value, std::memory_order_relaxed);
+	}
+
+	/* takes over the totals the frame parser keeps itself */
+	static void updateParser(const FrameParser::Statistics& stats);
+
+	/* writes all metrics in the Prometheus text format */
+	static void write(std::ostream& out);
+
+	/* monotonic time in microseconds, for the latencies */
+	static uint64_t now();
+	/* records the time since start, if latencies are measured */
+	static void recordSince(Histogram& histogram, uint64_t start) {
+	    if (timing) {
+		histogram.record(now() - start);
+	    }
+	}
+
+    public:
+	static Value bytesRead;
+	static Value frames[256];   /* decoded, per message type */
+	static Value checksumFailures;
+	static Value lengthErrors;
+	static Value resyncs;
+	static Value recoveredFrames;
+	static Value invalidRecordStreams;
+	static Value missedFrames;
+	static Value samples[Database::NumericSensorLast];
+	static Value dbQueries;
+	static Value dbQueryErrors;
+	static Value reconnects;
+	static Value watchdogTimeouts;
+	static Value staleSources;
+	static Value connected;
+	static Value lastFrameTime;
+
+	/* Latencies of the receive path. All but decode and query are counted
+	 * from the moment the data was read off the socket, readTime, which
+	 * only the IO thread touches; forwarder is the time from the forwarder
+	 * receiving a frame to the collector reading it. */
+	static bool timing;
+	static uint64_t readTime;
+	static Histogram forwarderLatency;
+	static Histogram frameLatency;
+	static Histogram decodeTime;
+	static Histogram enqueueLatency;
+	static Histogram commitLatency;
+	static Histogram queryTime;
+};
+
+/* Serves the metrics over HTTP on a local port, on the collector's IO
+ * service. Every request gets the full set, whatever its path. */
+class MetricsServer : public boost::enable_shared_from_this<MetricsServer>
+{
+    public:
+	MetricsServer(boost::asio::io_service& service, unsigned short port);
+
+	/* pending accepts keep the server alive until it is stopped */
+	void start();
+	void stop();
+
+    private:
+	class Connection : public boost::enable_shared_from_this<Connection>
+	{
+	    public:
+		Connection(boost::asio::io_service& service) :
+		    m_socket(service)
+		{ }
+
+		boost::asio::ip::tcp::socket& socket() {
+		    return m_socket;
+		}
+		void start();
+
+	    private:
+		void readComplete(const boost::system::error_code& error);
+		void writeComplete();
+
+	    private:
+		boost::asio::ip::tcp::socket m_socket;
+		boost::asio::streambuf m_request;
+		std::string m_response;
+	};
+
+	void acceptStart();
+	void acceptComplete(boost::shared_ptr<Connection> connection,
+			    const boost::system::error_code& error);
+
+    private:
+	boost::asio::io_service& m_service;
+	boost::asio::ip::tcp::acceptor m_acceptor;
+};
+
+#endif /* __METRICS_H__ */
@@ -17,12 +17,17 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cmath>
 #include <iostream>
 #include <mysql++/exceptions.h>
 #include <mysql++/query.h>
 #include <mysql++/ssqls.h>
+#include <mysql++/transaction.h>
+#include "FlightRecorder.h"
+#include "Metrics.h"
 #include "MysqlDatabase.h"
 #include "Options.h"
+#include "SampleBatch.h"
 
 const char * MysqlDatabase::dbName = "wmr_data";
 const char * MysqlDatabase::numericTableName = "numeric_data";
@@ -35,6 +40,8 @@ sql_create_4(NumericSensorValue, 1, 4,
 
 MysqlDatabase::MysqlDatabase() :
     Database(),
+    m_lastTimestamp(0),
+    m_slowQueryThreshold(0),
     m_connection(NULL)
 {
 }
@@ -42,8 +49,8 @@ MysqlDatabase::MysqlDatabase() :
 MysqlDatabase::~MysqlDatabase()
 {
     if (m_connection) {
-	time_t now = time(NULL);
-	mysqlpp::sql_datetime timestamp(now);
+	/* close the open runs at the time of the last received sample */
+	mysqlpp::sql_datetime timestamp(m_lastTimestamp);
 
 	for (auto iter = m_lastInsertIds.begin(); iter != m_lastInsertIds.end(); ++iter) {
 	    if (iter->first < NumericSensorLast) {
@@ -56,7 +63,8 @@ MysqlDatabase::~MysqlDatabase()
 }
 
 bool
-MysqlDatabase::connect(const std::string& server, const std::string& user, const std::string& password)
+MysqlDatabase::connect(const std::string& server, const std::string& user, const std::string& password,
+		       const std::string& database)
 {
     bool success = false;
 
@@ -72,13 +80,13 @@ MysqlDatabase::connect(const std::string& server, const std::string& user, const
     NumericSensorValue::table(numericTableName);
 
     try {
-	m_connection->select_db(dbName);
+	m_connection->select_db(database);
 	success = true;
     } catch (mysqlpp::DBSelectionFailed& e) {
 	/* DB not yet there, need to create it */
 	try {
-	    m_connection->create_db(dbName);
-	    m_connection->select_db(dbName);
+	    m_connection->create_db(database);
+	    m_connection->select_db(database);
 	    success = true;
 	} catch (mysqlpp::Exception& e) {
 	    std::cerr << "Could not create database: " << e.what() << std::endl;
@@ -88,6 +96,9 @@ MysqlDatabase::connect(const std::string& server, const std::string& user, const
     if (success) {
 	success = createTables();
     }
+    if (success) {
+	checkTables();
+    }
     if (!success) {
 	delete m_connection;
 	m_connection = NULL;
@@ -135,7 +146,7 @@ MysqlDatabase::createTables()
 	      << "  PRIMARY KEY (id), "
 	      << "  KEY sensor_starttime (sensor, starttime), "
 	      << "  KEY sensor_endtime (sensor, endtime)) "
-	      << "ENGINE MyISAM PACK_KEYS 1 ROW_FORMAT DYNAMIC";
+	      << "ENGINE InnoDB ROW_FORMAT DYNAMIC";
 	query.execute();
     } catch (const mysqlpp::BadQuery& er) {
 	std::cerr << "Query error: " << er.what() << std::endl;
@@ -153,6 +164,39 @@ MysqlDatabase::createTables()
     return true;
 }
 
+/* Batches are only stored atomically by a transactional engine, and the
+ * ids of their new rows are taken to be consecutive (see addSensorValues()).
+ * Tables created by older versions are MyISAM, so tell how to convert them. */
+void
+MysqlDatabase::checkTables()
+{
+    try {
+	mysqlpp::Query query = m_connection->query();
+
+	query << "select engine, @@innodb_autoinc_lock_mode from information_schema.tables "
+	      << "where table_schema = database() and table_name = "
+	      << mysqlpp::quote << numericTableName;
+
+	mysqlpp::StoreQueryResult res = query.store();
+	if (!res || res.num_rows() == 0) {
+	    return;
+	}
+
+	std::string engine = res[0][0].conv<std::string>(std::string());
+	if (engine != "InnoDB") {
+	    std::cerr << "Warning: Table " << numericTableName << " uses the " << engine
+		      << " engine, so failed batches can't be rolled back; convert it with "
+		      << "'alter table " << numericTableName << " engine InnoDB'" << std::endl;
+	} else if (res[0][1].conv<int>(0) == 2) {
+	    std::cerr << "Warning: innodb_autoinc_lock_mode is 2, so nothing but the collector "
+		      << "may insert into " << numericTableName << std::endl;
+	}
+    } catch (const mysqlpp::Exception& e) {
+	/* only a check, storing works regardless */
+	std::cerr << "MySQL exception: " << e.what() << std::endl;
+    }
+}
+
 void
 MysqlDatabase::createSensorRows()
 {
@@ -189,29 +233,51 @@ MysqlDatabase::createSensorRows()
 bool
 MysqlDatabase::executeQuery(mysqlpp::Query& query)
 {
+    uint64_t start = Metrics::now();
+
+    Metrics::add(Metrics::dbQueries);
     try {
+	/* the text is gone once it ran, so keep it in case it's slow */
+	std::string text = m_slowQueryThreshold > 0 ? query.str() : std::string();
+
 	query.execute();
+
+	uint64_t elapsed = Metrics::now() - start;
+
+	FlightRecorder::record(FlightRecorder::Query, true, 0, elapsed);
+	if (Metrics::timing) {
+	    Metrics::queryTime.record(elapsed);
+	}
+	if (m_slowQueryThreshold > 0 && elapsed >= m_slowQueryThreshold * 1000ULL) {
+	    if (text.size() > maxSlowQueryLength) {
+		text = text.substr(0, maxSlowQueryLength) + "...";
+	    }
+	    std::cerr << "Slow query (" << elapsed / 1000 << " ms): " << text << std::endl;
+	}
 	return true;
     } catch (const mysqlpp::BadQuery& e) {
 	std::cerr << "MySQL query error: " << e.what() << std::endl;
     } catch (const mysqlpp::Exception& e) {
 	std::cerr << "MySQL exception: " << e.what() << std::endl;
     }
+    Metrics::add(Metrics::dbQueryErrors);
+    FlightRecorder::record(FlightRecorder::Query, false, 0, Metrics::now() - start);
 
     return false;
 }
 
 void
-MysqlDatabase::addSensorValue(NumericSensors sensor, float value, time_t normalInterval)
+MysqlDatabase::addSensorValue(NumericSensors sensor, float value,
+			      time_t normalInterval, time_t now)
 {
     if (sensor == SensorRainAmount) {
-	value = convertRainAmountValue(value);
+	value = convertRainAmountValue(value, now);
     }
 
-    Database::addSensorValue(sensor, value, normalInterval);
+    Database::addSensorValue(sensor, value, normalInterval, now);
 
     if (m_connection) {
-	time_t now = time(NULL);
+	m_lastTimestamp = std::max(m_lastTimestamp, now);
 	std::map<unsigned int, std::pair<float, time_t> >::iterator cacheIter = m_numericCache.find(sensor);
 
 	if (cacheIter != m_numericCache.end() && (now - cacheIter->second.second) > (2 * normalInterval)) {
@@ -228,7 +294,7 @@ MysqlDatabase::addSensorValue(NumericSensors sensor, float value, time_t normalI
 	    updateRowEndTime(numericTableName, idIter->second, timestamp);
 	}
 
-	if (!isnan(value) && (valueChanged || !idValid)) {
+	if (!std::isnan(value) && (valueChanged || !idValid)) {
 	    mysqlpp::Query query = m_connection->query();
 	    NumericSensorValue row(sensor, value, timestamp, timestamp);
 
@@ -241,6 +307,130 @@ MysqlDatabase::addSensorValue(NumericSensors sensor, float value, time_t normalI
     }
 }
 
+bool
+MysqlDatabase::addSensorValues(const SampleBatch& batch)
+{
+    if (!m_connection) {
+	return false;
+    }
+
+    const std::vector<NumericSensors>& sensors = batch.sensors();
+    const std::vector<float>& values = batch.values();
+    const std::vector<time_t>& intervals = batch.intervals();
+    const std::vector<time_t>& timestamps = batch.timestamps();
+
+    /* Work on copies of the run state, so a failed query leaves it untouched.
+     * Runs which are extended are collected per row id and updated with a
+     * single query, rows for new runs go into one multi-row insert. */
+    RainState rain = rainState();
+    std::map<unsigned int, std::pair<float, time_t> > cache(m_numericCache);
+    std::map<unsigned int, mysqlpp::ulonglong> ids(m_lastInsertIds);
+    std::map<unsigned int, size_t> pendingRuns;
+    std::map<mysqlpp::ulonglong, time_t> endTimes;
+    std::vector<NumericSensorValue> rows;
+
+    for (size_t i = 0; i < batch.size(); i++) {
+	NumericSensors sensor = sensors[i];
+	float value = values[i];
+	time_t now = timestamps[i];
+
+	if (sensor == SensorRainAmount) {
+	    value = convertRainAmountValue(value, now);
+	}
+	m_lastTimestamp = std::max(m_lastTimestamp, now);
+
+	std::map<unsigned int, std::pair<float, time_t> >::iterator cacheIter = cache.find(sensor);
+	if (cacheIter != cache.end() && (now - cacheIter->second.second) > (2 * intervals[i])) {
+	    cache.erase(cacheIter);
+	    cacheIter = cache.end();
+	}
+
+	std::map<unsigned int, size_t>::iterator pendingIter = pendingRuns.find(sensor);
+	std::map<unsigned int, mysqlpp::ulonglong>::iterator idIter = ids.find(sensor);
+	bool valueChanged = cacheIter == cache.end() || cacheIter->second.first != value;
+	bool pendingValid = pendingIter != pendingRuns.end();
+	bool idValid = !pendingValid && idIter != ids.end() && idIter->second != 0;
+	mysqlpp::sql_datetime timestamp(now);
+
+	if (pendingValid) {
+	    rows[pendingIter->second].endtime = timestamp;
+	} else if (idValid) {
+	    endTimes[idIter->second] = now;
+	}
+
+	if (!std::isnan(value) && (valueChanged || !(idValid || pendingValid))) {
+	    pendingRuns[sensor] = rows.size();
+	    rows.push_back(NumericSensorValue(sensor, value, timestamp, timestamp));
+	    cache[sensor] = std::make_pair(value, now);
+	}
+    }
+
+    try {
+	/* the end times and the new runs are stored together or not at all,
+	 * so a retried batch doesn't extend its runs twice; on failure the
+	 * rain deltas must be computed from the same base again */
+	mysqlpp::Transaction transaction(*m_connection);
+
+	if (!endTimes.empty()) {
+	    mysqlpp::Query query = m_connection->query();
+	    std::map<mysqlpp::ulonglong, time_t>::const_iterator iter;
+
+	    query << "update " << numericTableName << " set endtime = case id";
+	    for (iter = endTimes.begin(); iter != endTimes.end(); ++iter) {
+		query << " when " << iter->first
+		      << " then '" << mysqlpp::sql_datetime(iter->second) << "'";
+	    }
+	    query << " end where id in (";
+	    for (iter = endTimes.begin(); iter != endTimes.end(); ++iter) {
+		query << (iter == endTimes.begin() ? "" : ", ") << iter->first;
+	    }
+	    query << ")";
+	    if (!executeQuery(query)) {
+		setRainState(rain);
+		return false;
+	    }
+	}
+
+	if (!rows.empty()) {
+	    mysqlpp::Query query = m_connection->query();
+
+	    query.insert(rows.begin(), rows.end());
+	    if (!executeQuery(query)) {
+		setRainState(rain);
+		return false;
+	    }
+
+	    /* A multi-row insert hands out consecutive ids starting at
+	     * insert_id(). InnoDB only guarantees that with an
+	     * innodb_autoinc_lock_mode of 0 or 1, or while no one else
+	     * inserts into the table, which checkTables() warns about. */
+	    mysqlpp::ulonglong firstId = query.insert_id();
+	    for (auto iter = pendingRuns.begin(); iter != pendingRuns.end(); ++iter) {
+		ids[iter->first] = firstId + iter->second;
+	    }
+	}
+
+	transaction.commit();
+    } catch (const mysqlpp::Exception& e) {
+	std::cerr << "MySQL exception: " << e.what() << std::endl;
+	setRainState(rain);
+	return false;
+    }
+
+    m_numericCache.swap(cache);
+    m_lastInsertIds.swap(ids);
+
+    return true;
+}
+
+void
+MysqlDatabase::markStale(NumericSensors sensor)
+{
+    /* the run already ends at the last sample, so just forget it */
+    m_numericCache.erase(sensor);
+    m_lastInsertIds.erase(sensor);
+}
+
 void
 MysqlDatabase::updateRowEndTime(const char *table,
 				mysqlpp::ulonglong id,
@@ -33,12 +33,23 @@ class MysqlDatabase : public virtual Database {
 	virtual ~MysqlDatabase();
 
     public:
-	bool connect(const std::string& server, const std::string& user, const std::string& password);
+	/* creates the database and its tables if they are missing */
+	bool connect(const std::string& server, const std::string& user, const std::string& password,
+		     const std::string& database = dbName);
 
-	virtual void addSensorValue(NumericSensors sensor, float value, time_t normalInterval);
+	virtual void addSensorValue(NumericSensors sensor, float value,
+				    time_t normalInterval, time_t timestamp);
+	virtual bool addSensorValues(const SampleBatch& batch);
+	virtual void markStale(NumericSensors sensor);
+
+	/* logs queries taking at least that long; 0 turns it off */
+	void setSlowQueryThreshold(unsigned int milliseconds) {
+	    m_slowQueryThreshold = milliseconds;
+	}
 
     private:
 	bool createTables();
+	void checkTables();
 	void createSensorRows();
 	bool executeQuery(mysqlpp::Query& query);
 	void updateRowEndTime(const char *table, mysqlpp::ulonglong id, mysqlpp::sql_datetime& timestamp);
@@ -46,9 +57,12 @@ class MysqlDatabase : public virtual Database {
     private:
 	static const char *dbName;
 	static const char *numericTableName;
+	static const size_t maxSlowQueryLength = 256;
 
 	std::map<unsigned int, std::pair<float, time_t> > m_numericCache;
 	std::map<unsigned int, mysqlpp::ulonglong> m_lastInsertIds;
+	time_t m_lastTimestamp;
+	unsigned int m_slowQueryThreshold;
 	mysqlpp::Connection *m_connection;
 };
 
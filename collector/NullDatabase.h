@@ -0,0 +1,46 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __NULLDATABASE_H__
+#define __NULLDATABASE_H__
+
+#include "Database.h"
+
+/* Throws the samples away and only counts them, like a sink writing one
+ * row each, so the benchmarks can measure everything but the storage. */
+class NullDatabase : public Database
+{
+    public:
+	NullDatabase() :
+	    m_samples(0)
+	{ }
+
+	virtual void addSensorValue(NumericSensors sensor, float value,
+				    time_t normalInterval, time_t timestamp) {
+	    m_samples++;
+	}
+	unsigned long samples() const {
+	    return m_samples;
+	}
+
+    private:
+	unsigned long m_samples;
+};
+
+#endif /* __NULLDATABASE_H__ */
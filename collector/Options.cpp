@@ -17,22 +17,28 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#include <cstdlib>
+#include <climits>
 #include <iostream>
 #include <fstream>
+#include <unistd.h>
 #include <boost/foreach.hpp>
 #include <boost/tokenizer.hpp>
 #include <boost/program_options.hpp>
 #include "Options.h"
+#include "StalenessTracker.h"
+#include "WmrMessage.h"
 
 namespace bpo = boost::program_options;
 
-std::string Options::m_target;
+/* so the staleness tracker can keep the deadlines of all sources */
+static const unsigned int maxStaleIntervals = StalenessTracker::maxDeadline / WmrMessage::maxInterval;
+
+Options::Settings Options::m_settings = Options::Settings();
 DebugStream Options::m_debugStreams[DebugCount];
-std::string Options::m_pidFilePath;
-bool Options::m_daemonize = true;
-std::string Options::m_dbPath;
-std::string Options::m_dbUser;
-std::string Options::m_dbPass;
+int Options::m_argc = 0;
+char **Options::m_argv = NULL;
+std::string Options::m_startDirectory;
 
 static void
 usage(std::ostream& stream, const char *programName,
@@ -45,41 +51,113 @@ usage(std::ostream& stream, const char *programName,
 Options::ParseResult
 Options::parse(int argc, char *argv[])
 {
-    std::string defaultPidFilePath;
-    std::string config;
+    Settings settings = Settings();
+    char cwd[PATH_MAX];
+
+    if (getcwd(cwd, sizeof(cwd))) {
+	m_startDirectory = cwd;
+    }
+
+    ParseResult result = parseInto(argc, argv, settings);
+
+    if (result == ParseSuccess) {
+	m_argc = argc;
+	m_argv = argv;
+	m_settings = settings;
+	applyDebugStreams();
+    }
+
+    return result;
+}
+
+bool
+Options::reload()
+{
+    Settings settings = Settings();
+
+    if (!m_argv || parseInto(m_argc, m_argv, settings) != ParseSuccess) {
+	return false;
+    }
+
+    m_settings = settings;
+    return true;
+}
+
+void
+Options::applyDebugStreams()
+{
+    for (unsigned int i = 0; i < DebugCount; i++) {
+	m_debugStreams[i].reset();
+	if (m_settings.debugActive[i]) {
+	    m_debugStreams[i].setFile(m_settings.debugFiles[i]);
+	}
+    }
+}
+
+Options::ParseResult
+Options::parseInto(int argc, char *argv[], Settings& settings)
+{
+    std::string defaultPidFilePath, staleIntervalsHelp;
 
     defaultPidFilePath = "/var/run/";
     defaultPidFilePath += argv[0];
     defaultPidFilePath += ".pid";
 
+    staleIntervalsHelp = "Number of intervals (1 to " + std::to_string(maxStaleIntervals) +
+			 ") a sensor may miss before it is reported as stale; the "
+			 "connection is reset after as many intervals of the most frequent one";
+
     bpo::options_description general("General options");
     general.add_options()
 	("help,h", "Show this help message")
 	("debug,d", bpo::value<std::string>()->default_value("none"),
 	 "Comma separated list of debug flags (all, io, message, data, stats, none) "
-	 " and their files, e.g. message=/tmp/messages.txt");
+	 " and their files, e.g. message=/tmp/messages.txt; stats=<port> serves "
+	 "metrics for Prometheus on that local port")
+	("resync", bpo::value<bool>(&settings.resync)->default_value(true)->implicit_value(true),
+	 "Rescan the bytes of rejected frames for the next frame start")
+	("framed", bpo::value<bool>(&settings.framed)->default_value(false)->implicit_value(true),
+	 "Target is the framed protocol port of the forwarder, which resends "
+	 "frames missed while disconnected")
+	("stale-intervals", bpo::value<unsigned int>(&settings.staleIntervals)->default_value(3),
+	 staleIntervalsHelp.c_str())
+	("sequence-file", bpo::value<std::string>(&settings.sequenceFilePath),
+	 "File to keep the last received frame sequence in, to resume from "
+	 "it after a restart (framed protocol only)")
+	("record", bpo::value<std::string>(&settings.recordPath),
+	 "Append all data received from the target to this journal file")
+	("replay", bpo::value<std::string>(&settings.replayPath),
+	 "Process a journal file instead of connecting to a target, at its "
+	 "original pace or <speed> times as fast (file[:speed], speed max for "
+	 "no delays)")
+	("trace-file", bpo::value<std::string>(&settings.traceFilePath)->default_value("/var/tmp/wmrcollector.trace"),
+	 "File to dump the recent events to on SIGUSR1 or a crash")
+	("print-trace", bpo::value<std::string>(&settings.printTracePath),
+	 "Print the events of a trace file dumped before, and exit");
 
     bpo::options_description daemon("Daemon options");
     daemon.add_options()
 	("pid-file,P",
-	 bpo::value<std::string>(&m_pidFilePath)->default_value(defaultPidFilePath),
+	 bpo::value<std::string>(&settings.pidFilePath)->default_value(defaultPidFilePath),
 	 "Pid file path")
 	("foreground,f", "Run in foreground")
-	("config-file,c", bpo::value<std::string>(&config),
+	("config-file,c", bpo::value<std::string>(&settings.configFilePath),
 	 "File name to read configuration from");
 
     bpo::options_description db("Database options");
     db.add_options()
-	("db-path", bpo::value<std::string>(&m_dbPath)->composing(),
+	("db-path", bpo::value<std::string>(&settings.dbPath)->composing(),
 	 "Path or server:port specification of database server (none to not connect to DB)")
-	("db-user,u", bpo::value<std::string>(&m_dbUser)->composing(),
+	("db-user,u", bpo::value<std::string>(&settings.dbUser)->composing(),
 	 "Database user name")
-	("db-pass,p", bpo::value<std::string>(&m_dbPass)->composing(),
-	 "Database password");
+	("db-pass,p", bpo::value<std::string>(&settings.dbPass)->composing(),
+	 "Database password")
+	("slow-query", bpo::value<unsigned int>(&settings.slowQueryThreshold)->default_value(0),
+	 "Log database queries taking at least this many milliseconds (0 to not log)");
 
     bpo::options_description hidden("Hidden options");
     hidden.add_options()
-	("target", bpo::value<std::string>(&m_target), "Connection target (serial:<device> or tcp:<host>:<port>)");
+	("target", bpo::value<std::string>(&settings.target), "Connection target (serial:<device> or tcp:<host>:<port>)");
 
     bpo::options_description options;
     options.add(general);
@@ -105,8 +183,18 @@ Options::parse(int argc, char *argv[])
 		   variables);
 	bpo::notify(variables);
 
-	if (!config.empty()) {
-	    std::ifstream configFile(config.c_str());
+	if (!settings.configFilePath.empty()) {
+	    /* so a reload finds it after daemonizing, too */
+	    if (settings.configFilePath[0] != '/' && !m_startDirectory.empty()) {
+		settings.configFilePath = m_startDirectory + "/" + settings.configFilePath;
+	    }
+
+	    std::ifstream configFile(settings.configFilePath.c_str());
+	    if (!configFile) {
+		std::cerr << "Error: Could not open configuration file "
+			  << settings.configFilePath << std::endl;
+		return ParseFailure;
+	    }
 	    bpo::store(bpo::parse_config_file(configFile, configOptions), variables);
 	    bpo::notify(variables);
 	}
@@ -116,6 +204,9 @@ Options::parse(int argc, char *argv[])
     } catch (bpo::multiple_occurrences& e) {
 	usage(std::cerr, argv[0], visible);
 	return ParseFailure;
+    } catch (bpo::error& e) {
+	std::cerr << "Error: " << e.what() << std::endl;
+	return ParseFailure;
     }
 
     if (variables.count("help")) {
@@ -123,57 +214,103 @@ Options::parse(int argc, char *argv[])
 	return CloseAfterParse;
     }
 
-    /* check for missing variables */
-    if (!variables.count("target")) {
+    settings.replaySpeed = 1;
+    if (!settings.replayPath.empty()) {
+	size_t pos = settings.replayPath.rfind(':');
+
+	if (pos != std::string::npos) {
+	    std::string speed = settings.replayPath.substr(pos + 1);
+	    char *end;
+
+	    /* otherwise, the colon belongs to the file name */
+	    if (speed == "max") {
+		settings.replaySpeed = 0;
+		settings.replayPath.erase(pos);
+	    } else if ((settings.replaySpeed = strtod(speed.c_str(), &end)) > 0 &&
+		       !speed.empty() && *end == '\0') {
+		settings.replayPath.erase(pos);
+	    } else {
+		settings.replaySpeed = 1;
+	    }
+	}
+    }
+
+    /* check for missing variables; a replay needs no target */
+    if (!variables.count("target") && settings.replayPath.empty() && settings.printTracePath.empty()) {
 	usage(std::cerr, argv[0], visible);
 	return ParseFailure;
     }
 
-    if (variables.count("foreground")) {
-	m_daemonize = false;
+    if (settings.staleIntervals == 0 || settings.staleIntervals > maxStaleIntervals) {
+	std::cerr << "Error: stale-intervals must be between 1 and " << maxStaleIntervals << std::endl;
+	return ParseFailure;
     }
 
-    if (variables.count("debug")) {
-	std::string flags = variables["debug"].as<std::string>();
-	if (flags == "none") {
-	    for (unsigned int i = 0; i < DebugCount; i++) {
-		m_debugStreams[i].reset();
-	    }
-	} else if (flags.substr(0, 3) == "all") {
-	    size_t start = flags.find('=', 3);
+    settings.daemonize = !variables.count("foreground");
+
+    if (variables.count("debug") &&
+	!parseDebugFlags(variables["debug"].as<std::string>(), settings)) {
+	return ParseFailure;
+    }
+
+    return ParseSuccess;
+}
+
+bool
+Options::parseDebugFlags(const std::string& flags, Settings& settings)
+{
+    if (flags == "none") {
+	for (unsigned int i = 0; i < DebugCount; i++) {
+	    settings.debugActive[i] = false;
+	}
+	settings.statsPort = 0;
+    } else if (flags.substr(0, 3) == "all") {
+	size_t start = flags.find('=', 3);
+	std::string file;
+	if (start != std::string::npos) {
+	    file = flags.substr(start + 1);
+	}
+	for (unsigned int i = 0; i < DebugCount; i++) {
+	    settings.debugActive[i] = true;
+	    settings.debugFiles[i] = file;
+	}
+    } else {
+	boost::char_separator<char> sep(",");
+	boost::tokenizer<boost::char_separator<char> > tokens(flags, sep);
+	BOOST_FOREACH(const std::string& item, tokens) {
 	    std::string file;
-	    if (start != std::string::npos) {
-		file = flags.substr(start + 1);
-	    }
-	    for (unsigned int i = 0; i < DebugCount; i++) {
-		m_debugStreams[i].setFile(file);
-	    }
-	} else {
-	    boost::char_separator<char> sep(",");
-	    boost::tokenizer<boost::char_separator<char> > tokens(flags, sep);
-	    BOOST_FOREACH(const std::string& item, tokens) {
-		std::string file;
-		size_t start = item.find('=');
-		unsigned int module;
-
-		if (item.compare(0, 6, "io") == 0) {
-		    module = DebugIo;
-		} else if (item.compare(0, 7, "message") == 0) {
-		    module = DebugMessages;
-		} else if (item.compare(0, 4, "data") == 0) {
-		    module = DebugData;
-		} else {
-		    continue;
-		}
+	    size_t start = item.find('=');
+	    unsigned int module;
+
+	    if (item.compare(0, 2, "io") == 0) {
+		module = DebugIo;
+	    } else if (item.compare(0, 7, "message") == 0) {
+		module = DebugMessages;
+	    } else if (item.compare(0, 4, "data") == 0) {
+		module = DebugData;
+	    } else if (item.compare(0, 5, "stats") == 0) {
+		std::string port = start != std::string::npos ? item.substr(start + 1) : "";
+		char *end;
+		unsigned long value = strtoul(port.c_str(), &end, 10);
 
-		if (start != std::string::npos) {
-		    file = item.substr(start + 1);
+		if (port.empty() || *end != '\0' || value == 0 || value > 65535) {
+		    std::cerr << "Error: stats needs a port, e.g. stats=9120" << std::endl;
+		    return false;
 		}
-		m_debugStreams[module].setFile(file);
+		settings.statsPort = value;
+		continue;
+	    } else {
+		continue;
+	    }
+
+	    if (start != std::string::npos) {
+		file = item.substr(start + 1);
 	    }
+	    settings.debugActive[module] = true;
+	    settings.debugFiles[module] = file;
 	}
     }
 
-    return ParseSuccess;
+    return true;
 }
 
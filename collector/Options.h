@@ -34,6 +34,9 @@ class DebugStream : public std::ostream
 	void reset() {
 	    m_active = false;
 	    rdbuf(std::cout.rdbuf());
+	    if (m_fileBuf.is_open()) {
+		m_fileBuf.close();
+	    }
 	}
 
 	void setFile(const std::string& file) {
@@ -42,6 +45,9 @@ class DebugStream : public std::ostream
 	    } else if (file == "stderr") {
 		rdbuf(std::cerr.rdbuf());
 	    } else if (!file.empty()) {
+		if (m_fileBuf.is_open()) {
+		    m_fileBuf.close();
+		}
 		m_fileBuf.open(file.c_str(), std::ios::out | std::ios::app);
 		rdbuf(&m_fileBuf);
 	    }
@@ -66,32 +72,112 @@ class Options
 	    CloseAfterParse
 	} ParseResult;
 
+    private:
+	static const unsigned int DebugIo = 0;
+	static const unsigned int DebugMessages = 1;
+	static const unsigned int DebugData = 2;
+	static const unsigned int DebugCount = 3;
+
+    public:
+	/* all values of the options, so they can be replaced as a whole */
+	typedef struct {
+	    std::string target;
+	    std::string pidFilePath;
+	    bool daemonize;
+	    std::string configFilePath;
+	    std::string dbPath;
+	    std::string dbUser;
+	    std::string dbPass;
+	    unsigned int slowQueryThreshold;
+	    bool resync;
+	    bool framed;
+	    unsigned int staleIntervals;
+	    std::string sequenceFilePath;
+	    std::string recordPath;
+	    std::string replayPath;
+	    double replaySpeed;
+	    std::string traceFilePath;
+	    std::string printTracePath;
+	    unsigned short statsPort;
+	    bool debugActive[DebugCount];
+	    std::string debugFiles[DebugCount];
+	} Settings;
+
 	static const std::string& target() {
-	    return m_target;
+	    return m_settings.target;
 	}
 	static bool daemonize() {
-	    return m_daemonize;
+	    return m_settings.daemonize;
 	}
 	static const std::string& pidFilePath() {
-	    return m_pidFilePath;
+	    return m_settings.pidFilePath;
+	}
+	static const std::string& configFilePath() {
+	    return m_settings.configFilePath;
 	}
 	static const std::string& databasePath() {
-	    return m_dbPath;
+	    return m_settings.dbPath;
 	}
 	static const std::string& databaseUser() {
-	    return m_dbUser;
+	    return m_settings.dbUser;
 	}
 	static const std::string& databasePassword() {
-	    return m_dbPass;
+	    return m_settings.dbPass;
+	}
+	static unsigned int slowQueryThreshold() {
+	    return m_settings.slowQueryThreshold;
+	}
+	static bool resync() {
+	    return m_settings.resync;
+	}
+	static bool framed() {
+	    return m_settings.framed;
+	}
+	static unsigned int staleIntervals() {
+	    return m_settings.staleIntervals;
+	}
+	static const std::string& sequenceFilePath() {
+	    return m_settings.sequenceFilePath;
+	}
+	static const std::string& recordPath() {
+	    return m_settings.recordPath;
+	}
+	static const std::string& replayPath() {
+	    return m_settings.replayPath;
+	}
+	/* 0 for as fast as possible */
+	static double replaySpeed() {
+	    return m_settings.replaySpeed;
+	}
+	static const std::string& traceFilePath() {
+	    return m_settings.traceFilePath;
+	}
+	static const std::string& printTracePath() {
+	    return m_settings.printTracePath;
+	}
+	/* 0 if metrics aren't served */
+	static unsigned short statsPort() {
+	    return m_settings.statsPort;
+	}
+
+	static const Settings& settings() {
+	    return m_settings;
 	}
 
 	static ParseResult parse(int argc, char *argv[]);
+	/* Parses the command line and configuration file again, and takes
+	 * the result over if it is valid. The debug streams are left alone
+	 * until applyDebugStreams() is called. */
+	static bool reload();
+	/* replaces all settings, e.g. by those from before a reload */
+	static void assign(const Settings& settings) {
+	    m_settings = settings;
+	}
+	/* routes the debug streams as the settings say; the debug log must
+	 * not be writing to them meanwhile */
+	static void applyDebugStreams();
 
     private:
-	static const unsigned int DebugIo = 0;
-	static const unsigned int DebugMessages = 1;
-	static const unsigned int DebugData = 2;
-	static const unsigned int DebugCount = 3;
 	static DebugStream m_debugStreams[DebugCount];
 
     public:
@@ -106,12 +192,15 @@ class Options
 	}
 
     private:
-	static std::string m_target;
-	static std::string m_pidFilePath;
-	static bool m_daemonize;
-	static std::string m_dbPath;
-	static std::string m_dbUser;
-	static std::string m_dbPass;
+	static ParseResult parseInto(int argc, char *argv[], Settings& settings);
+	static bool parseDebugFlags(const std::string& flags, Settings& settings);
+
+    private:
+	static Settings m_settings;
+	static int m_argc;
+	static char **m_argv;
+	/* the working directory at startup, as a daemon changes to / */
+	static std::string m_startDirectory;
 };
 
 #endif /* __OPTIONS_H__ */
@@ -0,0 +1,72 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "RecordParser.h"
+
+static uint32_t
+getBe32(const uint8_t *p)
+{
+    return ((uint32_t) p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+RecordParser::RecordParser()
+{
+    m_buffer.reserve(maxLength);
+    m_record.data.reserve(64);
+}
+
+void
+RecordParser::reset()
+{
+    m_buffer.clear();
+}
+
+bool
+RecordParser::feed(const uint8_t *data, size_t length, const RecordHandler& handler)
+{
+    size_t pos = 0;
+
+    m_buffer.insert(m_buffer.end(), data, data + length);
+
+    while (m_buffer.size() - pos >= headerLength) {
+	const uint8_t *header = &m_buffer[pos];
+	size_t recordLength = (header[0] << 8) | header[1];
+
+	if (recordLength <= headerLength || recordLength > maxLength) {
+	    m_buffer.clear();
+	    return false;
+	}
+	if (m_buffer.size() - pos < recordLength) {
+	    break;
+	}
+
+	m_record.type = header[2];
+	m_record.channel = header[3];
+	m_record.sequence = getBe32(header + 4);
+	m_record.timestamp = ((uint64_t) getBe32(header + 8) << 32) | getBe32(header + 12);
+	m_record.data.assign(header + headerLength, header + recordLength);
+	pos += recordLength;
+
+	handler(m_record);
+    }
+
+    /* keep the incomplete rest for the next call */
+    m_buffer.erase(m_buffer.begin(), m_buffer.begin() + pos);
+    return true;
+}
@@ -0,0 +1,66 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RECORDPARSER_H__
+#define __RECORDPARSER_H__
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <vector>
+#include <boost/function.hpp>
+
+/* Splits the stream of the forwarder's framed protocol into records: a
+ * 16 byte big-endian header (length including the header, type, channel,
+ * sequence number, receive time in microseconds) followed by the payload,
+ * which for frame records is a checksum-validated frame, and for status
+ * records a byte telling whether the station is attached. */
+class RecordParser
+{
+    public:
+	static const uint8_t TypeFrame = 1;
+	static const uint8_t TypeStatus = 2;
+
+	static const uint8_t StatusDetached = 0;
+	static const uint8_t StatusAttached = 1;
+
+	typedef struct {
+	    uint8_t type;
+	    uint8_t channel;
+	    uint32_t sequence;
+	    uint64_t timestamp;
+	    std::vector<uint8_t> data;
+	} Record;
+
+	typedef boost::function<void (const Record& record)> RecordHandler;
+
+	RecordParser();
+
+	/* returns false if the stream can't be a record stream */
+	bool feed(const uint8_t *data, size_t length, const RecordHandler& handler);
+	void reset();
+
+    private:
+	static const size_t headerLength = 16;
+	static const size_t maxLength = 1024;
+
+	std::vector<uint8_t> m_buffer;
+	Record m_record;
+};
+
+#endif /* __RECORDPARSER_H__ */
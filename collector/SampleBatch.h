@@ -0,0 +1,92 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __SAMPLEBATCH_H__
+#define __SAMPLEBATCH_H__
+
+#include <time.h>
+#include <vector>
+#include "Database.h"
+
+/* Decoded sensor samples, stored column-wise so a sink can walk one
+ * attribute at a time. Meant to be reused: clear() keeps the capacity. */
+class SampleBatch
+{
+    public:
+	SampleBatch(size_t capacity = 64) {
+	    reserve(capacity);
+	}
+
+	void add(Database::NumericSensors sensor, float value, time_t interval,
+		 time_t timestamp, unsigned int station) {
+	    m_sensors.push_back(sensor);
+	    m_values.push_back(value);
+	    m_intervals.push_back(interval);
+	    m_timestamps.push_back(timestamp);
+	    m_stations.push_back(station);
+	}
+
+	void clear() {
+	    m_sensors.clear();
+	    m_values.clear();
+	    m_intervals.clear();
+	    m_timestamps.clear();
+	    m_stations.clear();
+	}
+
+	void reserve(size_t capacity) {
+	    m_sensors.reserve(capacity);
+	    m_values.reserve(capacity);
+	    m_intervals.reserve(capacity);
+	    m_timestamps.reserve(capacity);
+	    m_stations.reserve(capacity);
+	}
+
+	size_t size() const {
+	    return m_sensors.size();
+	}
+	bool empty() const {
+	    return m_sensors.empty();
+	}
+
+	const std::vector<Database::NumericSensors>& sensors() const {
+	    return m_sensors;
+	}
+	const std::vector<float>& values() const {
+	    return m_values;
+	}
+	const std::vector<time_t>& intervals() const {
+	    return m_intervals;
+	}
+	const std::vector<time_t>& timestamps() const {
+	    return m_timestamps;
+	}
+	const std::vector<unsigned int>& stations() const {
+	    return m_stations;
+	}
+
+    private:
+	std::vector<Database::NumericSensors> m_sensors;
+	std::vector<float> m_values;
+	std::vector<time_t> m_intervals;
+	std::vector<time_t> m_timestamps;
+	std::vector<unsigned int> m_stations;
+};
+
+#endif /* __SAMPLEBATCH_H__ */
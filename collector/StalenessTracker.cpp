@@ -0,0 +1,207 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "StalenessTracker.h"
+
+StalenessTracker::StalenessTracker(unsigned int missedIntervals) :
+    m_missedIntervals(missedIntervals),
+    m_now(0),
+    m_linkInterval(0),
+    m_staleCount(0)
+{
+}
+
+StalenessTracker::Source
+StalenessTracker::sourceForSensor(Database::NumericSensors sensor)
+{
+    switch (sensor) {
+	case Database::SensorTempInside:
+	case Database::SensorHumidityInside:
+	case Database::SensorDewPointInside:
+	    return SourceInside;
+	case Database::SensorTempOutsideCh1:
+	case Database::SensorHumidityOutsideCh1:
+	case Database::SensorDewPointOutsideCh1:
+	    return SourceChannel1;
+	case Database::SensorTempOutsideCh2:
+	case Database::SensorHumidityOutsideCh2:
+	case Database::SensorDewPointOutsideCh2:
+	    return SourceChannel2;
+	case Database::SensorTempOutsideCh3:
+	case Database::SensorHumidityOutsideCh3:
+	case Database::SensorDewPointOutsideCh3:
+	    return SourceChannel3;
+	case Database::SensorAirPressure:
+	    return SourcePressure;
+	case Database::SensorUVLevel:
+	    return SourceUV;
+	case Database::SensorWindSpeedAvg:
+	case Database::SensorWindSpeedGust:
+	case Database::SensorWindDirection:
+	    return SourceWind;
+	case Database::SensorRainRate:
+	case Database::SensorRainAmount:
+	case Database::SensorRainTotalSum:
+	    return SourceRain;
+	default:
+	    break;
+    }
+
+    return SourceCount;
+}
+
+const char *
+StalenessTracker::sourceName(Source source)
+{
+    static const char *names[SourceCount] = {
+	"inside temperature", "temperature channel 1", "temperature channel 2",
+	"temperature channel 3", "air pressure", "UV", "wind", "rain"
+    };
+
+    return source < SourceCount ? names[source] : "unknown";
+}
+
+bool
+StalenessTracker::update(unsigned int station, Database::NumericSensors sensor,
+			 time_t interval, time_t now)
+{
+    Source source = sourceForSensor(sensor);
+    bool wasStale = false;
+    time_t span, deadline;
+
+    if (source == SourceCount || interval <= 0) {
+	return false;
+    }
+    if (m_now == 0) {
+	m_now = now;
+    }
+
+    uint32_t k = key(station, source);
+    std::map<uint32_t, Tracked>::iterator iter = m_sources.find(k);
+    if (iter == m_sources.end()) {
+	Tracked tracked;
+
+	tracked.interval = interval;
+	tracked.deadline = 0;
+	tracked.lastSeen = now;
+	tracked.stale = false;
+	iter = m_sources.insert(std::make_pair(k, tracked)).first;
+	if (m_linkInterval == 0 || interval < m_linkInterval) {
+	    m_linkInterval = interval;
+	}
+    }
+
+    Tracked& tracked = iter->second;
+    if (std::find(tracked.sensors.begin(), tracked.sensors.end(), sensor) == tracked.sensors.end()) {
+	tracked.sensors.push_back(sensor);
+    }
+    if (tracked.stale) {
+	tracked.stale = false;
+	m_staleCount--;
+	wasStale = true;
+	if (m_linkInterval == 0 || tracked.interval < m_linkInterval) {
+	    m_linkInterval = tracked.interval;
+	}
+    }
+    tracked.lastSeen = now;
+
+    span = std::min<time_t>(tracked.interval * m_missedIntervals, maxDeadline);
+    deadline = std::max(now, m_now) + span;
+    if (deadline != tracked.deadline) {
+	tracked.deadline = deadline;
+	m_wheel[deadline % wheelSize].push_back(k);
+    }
+
+    return wasStale;
+}
+
+void
+StalenessTracker::expire(uint32_t key, Tracked& tracked, time_t now, const StaleHandler& handler)
+{
+    tracked.stale = true;
+    m_staleCount++;
+    updateLinkInterval();
+    handler(key >> 8, (Source) (key & 0xff), tracked.sensors, now - tracked.lastSeen);
+}
+
+/* only done when a source goes stale, so scanning them all is fine */
+void
+StalenessTracker::updateLinkInterval()
+{
+    m_linkInterval = 0;
+    for (auto iter = m_sources.begin(); iter != m_sources.end(); ++iter) {
+	const Tracked& tracked = iter->second;
+
+	if (!tracked.stale && (m_linkInterval == 0 || tracked.interval < m_linkInterval)) {
+	    m_linkInterval = tracked.interval;
+	}
+    }
+}
+
+void
+StalenessTracker::advance(time_t now, const StaleHandler& handler)
+{
+    if (m_now == 0) {
+	m_now = now;
+	return;
+    }
+
+    if (now - m_now >= (time_t) wheelSize) {
+	/* we were held up for more than a turn, so go through everything */
+	for (unsigned int i = 0; i < wheelSize; i++) {
+	    m_wheel[i].clear();
+	}
+	for (auto iter = m_sources.begin(); iter != m_sources.end(); ++iter) {
+	    Tracked& tracked = iter->second;
+
+	    if (tracked.stale) {
+		continue;
+	    }
+	    if (tracked.deadline <= now) {
+		expire(iter->first, tracked, now, handler);
+	    } else {
+		m_wheel[tracked.deadline % wheelSize].push_back(iter->first);
+	    }
+	}
+	m_now = now;
+	return;
+    }
+
+    while (m_now < now) {
+	std::vector<uint32_t>& slot = m_wheel[++m_now % wheelSize];
+
+	/* the handler may not add to this slot, but keep it safe anyway */
+	m_expiring.swap(slot);
+	for (size_t i = 0; i < m_expiring.size(); i++) {
+	    std::map<uint32_t, Tracked>::iterator iter = m_sources.find(m_expiring[i]);
+	    Tracked& tracked = iter->second;
+
+	    if (tracked.stale || tracked.deadline < m_now) {
+		continue;
+	    } else if (tracked.deadline == m_now) {
+		expire(iter->first, tracked, now, handler);
+	    } else if (tracked.deadline % wheelSize == m_now % wheelSize) {
+		/* due in a later turn of the wheel */
+		slot.push_back(iter->first);
+	    }
+	}
+	m_expiring.clear();
+    }
+}
@@ -0,0 +1,118 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __STALENESSTRACKER_H__
+#define __STALENESSTRACKER_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <map>
+#include <vector>
+#include <boost/function.hpp>
+#include "Database.h"
+
+/* Knows when each source of samples of each station (a temperature
+ * channel, the barometer, the UV, wind and rain sensors) is due to report
+ * again, from the interval the decoder gives their samples, and tells which
+ * ones missed a few intervals in a row. Sources are tracked rather than
+ * single sensors, as some of the latter are only sent now and then, like
+ * the wind gust speed when it differs from the average.
+ *
+ * Deadlines are kept on a timer wheel with one slot per second, so noting
+ * a sample and finding the expired sources are cheap however many there
+ * are. Slots are cleaned up lazily: rescheduling a source only adds it to
+ * its new slot, and entries whose deadline moved on are skipped. The wheel
+ * is turned by calling advance() about once a second. */
+class StalenessTracker
+{
+    public:
+	typedef enum {
+	    SourceInside,
+	    SourceChannel1,
+	    SourceChannel2,
+	    SourceChannel3,
+	    SourcePressure,
+	    SourceUV,
+	    SourceWind,
+	    SourceRain,
+	    SourceCount
+	} Source;
+
+	/* called with the sensors the source delivered, and the time since
+	 * it last did */
+	typedef boost::function<void (unsigned int station, Source source,
+				      const std::vector<Database::NumericSensors>& sensors,
+				      time_t silence)> StaleHandler;
+
+	/* The longest a source may be silent before it is stale, in seconds;
+	 * longer deadlines are cut short to it. */
+	static const time_t maxDeadline = 1024;
+
+	StalenessTracker(unsigned int missedIntervals);
+
+	static Source sourceForSensor(Database::NumericSensors sensor);
+	static const char * sourceName(Source source);
+
+	/* notes a sample arriving at now (in seconds of a monotonic clock);
+	 * returns true if its source had been stale */
+	bool update(unsigned int station, Database::NumericSensors sensor,
+		    time_t interval, time_t now);
+	/* hands the sources that missed their deadline by now to the handler */
+	void advance(time_t now, const StaleHandler& handler);
+
+	/* how long the link may go without data: the missed intervals of
+	 * the most frequent source still reporting, 0 while there is none */
+	time_t linkTimeout() const {
+	    return m_linkInterval * m_missedIntervals;
+	}
+	size_t staleCount() const {
+	    return m_staleCount;
+	}
+
+    private:
+	/* twice as long as any deadline, so a turn of the wheel doesn't
+	 * reach the deadlines noted in it */
+	static const unsigned int wheelSize = 2 * maxDeadline;
+
+	typedef struct {
+	    time_t interval;
+	    time_t deadline;
+	    time_t lastSeen;
+	    bool stale;
+	    std::vector<Database::NumericSensors> sensors;
+	} Tracked;
+
+	static uint32_t key(unsigned int station, Source source) {
+	    return (station << 8) | source;
+	}
+
+	void expire(uint32_t key, Tracked& tracked, time_t now, const StaleHandler& handler);
+	void updateLinkInterval();
+
+    private:
+	unsigned int m_missedIntervals;
+	std::map<uint32_t, Tracked> m_sources;
+	std::vector<uint32_t> m_wheel[wheelSize];
+	std::vector<uint32_t> m_expiring;
+	time_t m_now;
+	time_t m_linkInterval;
+	size_t m_staleCount;
+};
+
+#endif /* __STALENESSTRACKER_H__ */
@@ -0,0 +1,349 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Write path benchmark: feeds the same synthetic stream of samples of all
+ * sensors into a sink, per sample through addSensorValue() or in batches
+ * through addSensorValues(), and reports the throughput, the latency of
+ * each of these calls (a commit), and what the sink stored. Batches are
+ * either what arrives at once, i.e. the samples of the same second, or a
+ * fixed number of samples.
+ *
+ * The MySQL sink writes into its own database (wmr_bench by default),
+ * which is dropped before every run. */
+
+#include <stdint.h>
+#include <time.h>
+#include <algorithm>
+#include <iomanip>
+#include <iostream>
+#include <random>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <boost/foreach.hpp>
+#include <boost/program_options.hpp>
+#include <boost/shared_ptr.hpp>
+#include <boost/tokenizer.hpp>
+#include <mysql++/mysql++.h>
+#include "Database.h"
+#include "MysqlDatabase.h"
+#include "NullDatabase.h"
+#include "SampleBatch.h"
+
+namespace bpo = boost::program_options;
+
+/* Produces the samples the decoder would for a station with three outside
+ * sensors, at the decoder's intervals. The values walk randomly, in steps
+ * of their resolution, so runs of equal values come out as in reality. */
+class SampleStream
+{
+    public:
+	SampleStream() :
+	    m_random(42),
+	    m_now(1350000000)
+	{
+	    /* the sensors of a message share its phase */
+	    add(Database::SensorTempInside, 0, 15, 21.5f, 0.1f, 0.2f);
+	    add(Database::SensorHumidityInside, 0, 15, 45, 1, 0.1f);
+	    add(Database::SensorDewPointInside, 0, 15, 9.2f, 0.1f, 0.2f);
+	    for (int ch = 0; ch < 3; ch++) {
+		add((Database::NumericSensors) (Database::SensorTempOutsideCh1 + 10 * ch),
+		    1 + ch, 60, 8.0f + ch, 0.1f, 0.4f);
+		add((Database::NumericSensors) (Database::SensorHumidityOutsideCh1 + 10 * ch),
+		    1 + ch, 60, 80, 1, 0.2f);
+		add((Database::NumericSensors) (Database::SensorDewPointOutsideCh1 + 10 * ch),
+		    1 + ch, 60, 4.5f + ch, 0.1f, 0.4f);
+	    }
+	    add(Database::SensorAirPressure, 4, 60, 1013, 1, 0.05f);
+	    add(Database::SensorUVLevel, 5, 60, 2, 1, 0.02f);
+	    add(Database::SensorWindSpeedAvg, 6, 48, 3.0f, 0.1f, 0.8f);
+	    add(Database::SensorWindSpeedGust, 6, 48, 5.0f, 0.1f, 0.9f);
+	    add(Database::SensorWindDirection, 6, 48, 225, 22.5f, 0.3f);
+	    add(Database::SensorRainRate, 7, 70, 0, 0.254f, 0.02f);
+	    add(Database::SensorRainAmount, 7, 70, 120, 0.254f, 0.02f);
+	    add(Database::SensorRainTotalSum, 7, 70, 120, 0.254f, 0.02f);
+	}
+
+	/* appends the samples of the next second that has any */
+	void next(SampleBatch& batch) {
+	    size_t size = batch.size();
+
+	    while (batch.size() == size) {
+		m_now++;
+		for (size_t i = 0; i < m_sensors.size(); i++) {
+		    Sensor& s = m_sensors[i];
+
+		    if ((m_now + 7 * s.message) % s.interval != 0) {
+			continue;
+		    }
+		    if (std::uniform_real_distribution<float>(0, 1)(m_random) < s.changeRate) {
+			s.value += std::bernoulli_distribution(0.5)(m_random) ? s.step : -s.step;
+			s.value = std::max(0.0f, s.value);
+		    }
+		    batch.add(s.sensor, s.value, s.interval, m_now, 0);
+		}
+	    }
+	}
+
+    private:
+	typedef struct {
+	    Database::NumericSensors sensor;
+	    unsigned int message;
+	    time_t interval;
+	    float value;
+	    float step;
+	    float changeRate;
+	} Sensor;
+
+	void add(Database::NumericSensors sensor, unsigned int message, time_t interval,
+		 float value, float step, float changeRate) {
+	    Sensor s = { sensor, message, interval, value, step, changeRate };
+	    m_sensors.push_back(s);
+	}
+
+    private:
+	std::vector<Sensor> m_sensors;
+	std::minstd_rand m_random;
+	time_t m_now;
+};
+
+typedef struct {
+    std::string server;
+    std::string user;
+    std::string password;
+    std::string name;
+} MysqlSettings;
+
+static uint64_t
+monotonicNanoseconds()
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+/* A connection of our own, for what the sink doesn't tell. */
+static bool
+mysqlQuery(const MysqlSettings& settings, const std::string& statement,
+	   mysqlpp::ulonglong *result = NULL)
+{
+    mysqlpp::Connection connection;
+
+    try {
+	if (!connection.connect(NULL, settings.server.c_str(), settings.user.c_str(),
+				settings.password.c_str())) {
+	    std::cerr << "Could not connect to database" << std::endl;
+	    return false;
+	}
+
+	mysqlpp::Query query = connection.query();
+	query << statement;
+	if (!result) {
+	    query.execute();
+	    return true;
+	}
+
+	mysqlpp::StoreQueryResult res = query.store();
+	if (!res || res.num_rows() == 0) {
+	    return false;
+	}
+	*result = res[0][0].conv<mysqlpp::ulonglong>(0);
+    } catch (const mysqlpp::Exception& e) {
+	std::cerr << "MySQL error: " << e.what() << std::endl;
+	return false;
+    }
+
+    return true;
+}
+
+static void
+printRow(const std::string& sink, const std::string& strategy, unsigned long samples,
+	 uint64_t elapsed, std::vector<uint64_t>& latencies, const std::string& rows,
+	 const std::string& bytes)
+{
+    size_t count = latencies.size();
+
+    std::sort(latencies.begin(), latencies.end());
+    std::cout << std::left << std::setw(8) << sink << std::setw(12) << strategy
+	      << std::right << std::fixed << std::setprecision(0)
+	      << std::setw(10) << samples
+	      << std::setw(12) << (elapsed ? samples * 1e9 / elapsed : 0)
+	      << std::setw(9) << count
+	      << std::setprecision(1)
+	      << std::setw(10) << (count ? latencies[count / 2] / 1e3 : 0)
+	      << std::setw(10) << (count ? latencies[count * 99 / 100] / 1e3 : 0)
+	      << std::setw(10) << rows << std::setw(12) << bytes << std::endl;
+}
+
+/* batchSize 0 stands for per sample, 1 for the samples of one second */
+static bool
+runBenchmark(const std::string& sinkName, size_t batchSize, unsigned long samples,
+	     const MysqlSettings& settings)
+{
+    boost::shared_ptr<Database> db;
+    NullDatabase *null = NULL;
+    SampleStream stream;
+    SampleBatch pending, batch;
+    std::vector<uint64_t> latencies;
+    std::ostringstream strategy, rows, bytes;
+    unsigned long done = 0;
+    uint64_t start, elapsed;
+
+    if (sinkName == "null") {
+	null = new NullDatabase();
+	db.reset(null);
+    } else if (sinkName == "mysql") {
+	MysqlDatabase *mysql = new MysqlDatabase();
+
+	db.reset(mysql);
+	if (!mysqlQuery(settings, "drop database if exists " + settings.name) ||
+	    !mysql->connect(settings.server, settings.user, settings.password, settings.name)) {
+	    std::cerr << "Could not set up database " << settings.name << std::endl;
+	    return false;
+	}
+    } else {
+	std::cerr << "Unknown sink " << sinkName << std::endl;
+	return false;
+    }
+
+    if (batchSize == 0) {
+	strategy << "sample";
+    } else if (batchSize == 1) {
+	strategy << "second";
+    } else {
+	strategy << "batch-" << batchSize;
+    }
+
+    start = monotonicNanoseconds();
+    while (done < samples) {
+	pending.clear();
+	stream.next(pending);
+
+	for (size_t i = 0; i < pending.size() && done < samples; i++, done++) {
+	    batch.add(pending.sensors()[i], pending.values()[i], pending.intervals()[i],
+		      pending.timestamps()[i], pending.stations()[i]);
+	}
+	if (batchSize > 1 && batch.size() < batchSize && done < samples) {
+	    continue;
+	}
+
+	if (batchSize == 0) {
+	    for (size_t i = 0; i < batch.size(); i++) {
+		uint64_t before = monotonicNanoseconds();
+
+		db->addSensorValue(batch.sensors()[i], batch.values()[i],
+				   batch.intervals()[i], batch.timestamps()[i]);
+		latencies.push_back(monotonicNanoseconds() - before);
+	    }
+	} else {
+	    uint64_t before = monotonicNanoseconds();
+
+	    db->addSensorValues(batch);
+	    latencies.push_back(monotonicNanoseconds() - before);
+	}
+	batch.clear();
+    }
+    elapsed = monotonicNanoseconds() - start;
+
+    if (null) {
+	rows << null->samples();
+	bytes << "-";
+    } else {
+	mysqlpp::ulonglong count = 0, size = 0;
+
+	/* let it close its open runs first */
+	db.reset();
+	if (mysqlQuery(settings, "select count(*) from " + settings.name + ".numeric_data", &count)) {
+	    rows << count;
+	} else {
+	    rows << "?";
+	}
+	if (mysqlQuery(settings, "select data_length + index_length from information_schema.tables "
+		       "where table_schema = '" + settings.name + "' and table_name = 'numeric_data'",
+		       &size)) {
+	    bytes << size;
+	} else {
+	    bytes << "?";
+	}
+    }
+
+    printRow(sinkName, strategy.str(), done, elapsed, latencies, rows.str(), bytes.str());
+    return true;
+}
+
+int main(int argc, char *argv[])
+{
+    std::string sinks;
+    unsigned long samples;
+    size_t batchSize;
+    MysqlSettings settings;
+
+    bpo::options_description options("Options");
+    options.add_options()
+	("help,h", "Show this help message")
+	("sinks", bpo::value<std::string>(&sinks)->default_value("null"),
+	 "Comma separated list of sinks to benchmark (null, mysql)")
+	("samples", bpo::value<unsigned long>(&samples)->default_value(100000),
+	 "Number of samples to write per run")
+	("batch", bpo::value<size_t>(&batchSize)->default_value(256),
+	 "Samples per addSensorValues() call in the fixed size batch run")
+	("db-path", bpo::value<std::string>(&settings.server)->default_value("localhost"),
+	 "Path or server:port specification of database server")
+	("db-user,u", bpo::value<std::string>(&settings.user), "Database user name")
+	("db-pass,p", bpo::value<std::string>(&settings.password), "Database password")
+	("db-name", bpo::value<std::string>(&settings.name)->default_value("wmr_bench"),
+	 "Database to write to; it is dropped before every run");
+
+    bpo::variables_map variables;
+    try {
+	bpo::store(bpo::parse_command_line(argc, argv, options), variables);
+	bpo::notify(variables);
+    } catch (bpo::error& e) {
+	std::cerr << e.what() << std::endl << options << std::endl;
+	return 1;
+    }
+    if (variables.count("help")) {
+	std::cout << "Usage: " << argv[0] << " [options]" << std::endl << options << std::endl;
+	return 0;
+    }
+    if (settings.name == "wmr_data" || batchSize < 2) {
+	std::cerr << "Refusing to use the collector's database, and batches must have "
+		  << "at least two samples" << std::endl;
+	return 1;
+    }
+
+    std::cout << std::left << std::setw(8) << "sink" << std::setw(12) << "strategy"
+	      << std::right << std::setw(10) << "samples" << std::setw(12) << "samples/s"
+	      << std::setw(9) << "commits" << std::setw(10) << "p50_us"
+	      << std::setw(10) << "p99_us" << std::setw(10) << "rows"
+	      << std::setw(12) << "bytes" << std::endl;
+
+    boost::char_separator<char> sep(",");
+    boost::tokenizer<boost::char_separator<char> > tokens(sinks, sep);
+    BOOST_FOREACH(const std::string& sink, tokens) {
+	if (!runBenchmark(sink, 0, samples, settings) ||
+	    !runBenchmark(sink, 1, samples, settings) ||
+	    !runBenchmark(sink, batchSize, samples, settings)) {
+	    return 1;
+	}
+    }
+
+    return 0;
+}
@@ -0,0 +1,241 @@
+/*
+ * Oregon WMR88/WMR88A data collection daemon
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Checks that the watchdog reconnects a link that falls silent within a
+ * few intervals of the most frequent source, rather than waiting for the
+ * slower ones or for all of them to go stale. A stand-in for the forwarder
+ * sends one frame from each source of a station and then nothing, while
+ * the handler's clock is moved on a second at a time until it reconnects.
+ * Run "make check". */
+
+#include <stdint.h>
+#include <atomic>
+#include <iostream>
+#include <vector>
+#include <boost/asio.hpp>
+#include <boost/bind.hpp>
+#include <boost/lexical_cast.hpp>
+#include <boost/thread.hpp>
+#include "Clock.h"
+#include "Database.h"
+#include "IoHandler.h"
+#include "NullDatabase.h"
+#include "Options.h"
+
+/* "within about a minute" */
+static const time_t maxSilence = 60;
+/* how far the clock may run before the test gives up, well past the
+ * five minutes the watchdog waits before it has seen any source */
+static const time_t maxWait = 10 * 60;
+static const time_t start = 1350000000;
+
+static void
+appendFrame(std::vector<uint8_t>& stream, const uint8_t *frame, size_t length)
+{
+    uint16_t checksum = 0;
+
+    stream.push_back(0xff);
+    stream.push_back(0xff);
+    for (size_t i = 0; i < length; i++) {
+	stream.push_back(frame[i]);
+	checksum += frame[i];
+    }
+    stream.push_back(checksum & 0xff);
+    stream.push_back(checksum >> 8);
+}
+
+/* inside and outside temperature, air pressure, wind and rain */
+static std::vector<uint8_t>
+makeStation()
+{
+    static const uint8_t inside[] = { 0x00, 0x42, 0x00, 0xe7, 0x00, 0x3c, 0x8b, 0x00, 0x00, 0x20 };
+    static const uint8_t outside[] = { 0x00, 0x42, 0x01, 0xe7, 0x00, 0x3c, 0x8b, 0x00, 0x00, 0x20 };
+    static const uint8_t pressure[] = { 0x00, 0x46, 0xf5, 0x33, 0xfc, 0x33 };
+    static const uint8_t wind[] = { 0x00, 0x48, 0x00, 0x0c, 0x12, 0x30, 0x01, 0x00, 0x20 };
+    static const uint8_t rain[] = { 0x00, 0x41, 0x00, 0x00, 0x02, 0x00, 0x10, 0x00, 0x4a, 0x03,
+				    0x00, 0x0c, 0x01, 0x01, 0x0c };
+    std::vector<uint8_t> stream;
+
+    appendFrame(stream, inside, sizeof(inside));
+    appendFrame(stream, outside, sizeof(outside));
+    appendFrame(stream, pressure, sizeof(pressure));
+    appendFrame(stream, wind, sizeof(wind));
+    appendFrame(stream, rain, sizeof(rain));
+    return stream;
+}
+
+/* Accepts the handler's connection, sends the station's frames once and
+ * waits for the handler to connect again. Blocking, in a thread of its
+ * own, so it doesn't depend on the handler's IO service. */
+class SilentForwarder
+{
+    public:
+	SilentForwarder() :
+	    m_acceptor(m_service, boost::asio::ip::tcp::endpoint(
+				      boost::asio::ip::address_v4::loopback(), 0)),
+	    m_first(m_service),
+	    m_second(m_service),
+	    m_stopping(false),
+	    m_reconnected(false)
+	{ }
+	~SilentForwarder() {
+	    if (m_thread.joinable()) {
+		boost::asio::ip::tcp::socket wakeup(m_service);
+		boost::system::error_code ignored;
+
+		/* gets an accept still waiting for the handler out of it */
+		m_stopping = true;
+		wakeup.connect(m_acceptor.local_endpoint(), ignored);
+		m_thread.join();
+	    }
+	}
+
+	unsigned short port() const {
+	    return m_acceptor.local_endpoint().port();
+	}
+	bool reconnected() const {
+	    return m_reconnected;
+	}
+	void start() {
+	    m_thread = boost::thread(boost::bind(&SilentForwarder::run, this));
+	}
+
+    private:
+	void run() {
+	    boost::system::error_code error;
+	    std::vector<uint8_t> stream = makeStation();
+
+	    m_acceptor.accept(m_first, error);
+	    if (!error && !m_stopping) {
+		boost::asio::write(m_first, boost::asio::buffer(stream), error);
+	    }
+	    /* the first connection stays open, just silent */
+	    if (!error) {
+		m_acceptor.accept(m_second, error);
+	    }
+	    m_reconnected = !error && !m_stopping;
+	}
+
+    private:
+	boost::asio::io_service m_service;
+	boost::asio::ip::tcp::acceptor m_acceptor;
+	boost::asio::ip::tcp::socket m_first, m_second;
+	std::atomic<bool> m_stopping;
+	std::atomic<bool> m_reconnected;
+	boost::thread m_thread;
+};
+
+class SilenceTest
+{
+    public:
+	SilenceTest(IoHandler& handler, ManualClock& clock, SilentForwarder& forwarder,
+		    NullDatabase& sink) :
+	    m_handler(handler),
+	    m_clock(clock),
+	    m_forwarder(forwarder),
+	    m_sink(sink),
+	    m_timer(handler),
+	    m_silentSince(0),
+	    m_silence(-1)
+	{
+	    wait();
+	}
+
+	/* how long the link was silent before the handler reconnected, or
+	 * -1 if it didn't */
+	time_t silence() const {
+	    return m_silence;
+	}
+
+    private:
+	void wait() {
+	    m_timer.expires_from_now(boost::posix_time::milliseconds(100));
+	    m_timer.async_wait(boost::bind(&SilenceTest::tick, this));
+	}
+
+	/* runs on the handler's IO service, as the clock isn't shared */
+	void tick() {
+	    if (m_silentSince == 0) {
+		/* the clock stands until the frames are in */
+		if (m_sink.samples() > 0) {
+		    m_silentSince = m_clock.now();
+		}
+	    } else if (m_forwarder.reconnected()) {
+		m_silence = m_clock.now() - m_silentSince;
+		m_handler.close();
+		return;
+	    } else if (m_clock.now() - m_silentSince >= maxWait) {
+		m_handler.close();
+		return;
+	    } else {
+		/* ten seconds of the link for every tick of the watchdog */
+		m_clock.advance(1);
+	    }
+	    wait();
+	}
+
+    private:
+	IoHandler& m_handler;
+	ManualClock& m_clock;
+	SilentForwarder& m_forwarder;
+	NullDatabase& m_sink;
+	boost::asio::deadline_timer m_timer;
+	time_t m_silentSince;
+	time_t m_silence;
+};
+
+int main(int argc, char *argv[])
+{
+    /* the settings the handler takes, as the collector has them by default */
+    char *defaults[] = { argv[0], (char *) "test", NULL };
+    ManualClock *manualClock = new ManualClock(start);
+    boost::shared_ptr<Clock> clock(manualClock);
+    NullDatabase *sink = new NullDatabase();
+    boost::shared_ptr<Database> db(sink);
+    SilentForwarder forwarder;
+    time_t silence;
+
+    if (Options::parse(2, defaults) != Options::ParseSuccess) {
+	return 1;
+    }
+
+    forwarder.start();
+    {
+	IoHandler handler("127.0.0.1", boost::lexical_cast<std::string>(forwarder.port()),
+			  db, clock);
+	SilenceTest test(handler, *manualClock, forwarder, *sink);
+
+	handler.run();
+	silence = test.silence();
+    }
+
+    if (silence < 0) {
+	std::cerr << "FAIL: silent link not reconnected within " << maxWait
+		  << " seconds" << std::endl;
+	return 1;
+    }
+    if (silence > maxSilence) {
+	std::cerr << "FAIL: silent link reconnected after " << silence
+		  << " seconds, more than " << maxSilence << std::endl;
+	return 1;
+    }
+
+    std::cout << "PASS: silent link reconnected after " << silence << " seconds" << std::endl;
+    return 0;
+}
@@ -17,26 +17,61 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
-#include <iostream>
-#include <sstream>
-#include <iomanip>
-#include <cassert>
 #include <cmath>
+#include <boost/bind.hpp>
+#include "DebugLog.h"
+#include "FlightRecorder.h"
+#include "FrameParser.h"
+#include "Metrics.h"
+#include "SampleBatch.h"
 #include "WmrMessage.h"
 #include "Options.h"
 
-#define HEX(value) \
-    "0x" << std::setbase(16) << std::setw(2) << \
-    std::setfill('0') << (unsigned int) (value) << std::dec
-#define DEC(value) \
-    std::dec << (unsigned int) (value)
-
-WmrMessage::WmrMessage(const std::vector<uint8_t>& data, boost::shared_ptr<Database>& db) :
-    m_db(db)
+WmrMessage::WmrMessage(const std::vector<uint8_t>& data, SampleBatch& batch,
+		       time_t timestamp, unsigned int station) :
+    m_batch(&batch),
+    m_timestamp(timestamp),
+    m_station(station)
 {
     m_valid = checkValidityAndCopyData(data);
 }
 
+size_t
+WmrMessage::decodeBuffer(FrameParser& parser, const uint8_t *data, size_t length,
+			 time_t timestamp, unsigned int station, SampleBatch& batch)
+{
+    return parser.feed(data, length,
+		       boost::bind(&WmrMessage::decodeFrame, _1, &batch, timestamp, station));
+}
+
+void
+WmrMessage::decodeFrame(const std::vector<uint8_t>& frame, SampleBatch *batch,
+			time_t timestamp, unsigned int station)
+{
+    WmrMessage message(frame, *batch, timestamp, station);
+
+    FlightRecorder::record(FlightRecorder::Frame, frame.size() > 1 ? frame[1] : 0,
+			   message.isValid());
+    if (message.isValid()) {
+	uint64_t start = 0;
+
+	Metrics::add(Metrics::frames[frame[1]]);
+	Metrics::set(Metrics::lastFrameTime, timestamp);
+	if (Metrics::timing) {
+	    start = Metrics::now();
+	    Metrics::frameLatency.record(start - Metrics::readTime);
+	}
+	message.parse();
+	Metrics::recordSince(Metrics::decodeTime, start);
+    }
+}
+
+void
+WmrMessage::storeValue(Database::NumericSensors sensor, float value, time_t interval)
+{
+    m_batch->add(sensor, value, interval, m_timestamp, m_station);
+}
+
 ssize_t
 WmrMessage::packetLengthForType(uint8_t type)
 {
@@ -58,32 +93,47 @@ WmrMessage::packetLengthForType(uint8_t type)
     return -1;
 }
 
-bool
-WmrMessage::checkValidityAndCopyData(const std::vector<uint8_t>& data)
+/* the sum of the bytes before the checksum, and the checksum itself */
+static uint16_t
+calculatedChecksum(const std::vector<uint8_t>& data)
 {
-    DebugStream& debug = Options::messageDebug();
     std::vector<uint8_t>::const_iterator iter;
-    uint16_t calcChecksum = 0, pktChecksum;
-    ssize_t expected;
+    uint16_t checksum = 0;
+
+    for (iter = data.begin(); iter < data.end() - 2; iter++) {
+	checksum += *iter;
+    }
+    return checksum;
+}
 
+static uint16_t
+packetChecksum(const std::vector<uint8_t>& data)
+{
+    return (data[data.size() - 1] << 8) | data[data.size() - 2];
+}
+
+bool
+WmrMessage::checksumValid(const std::vector<uint8_t>& data)
+{
     /* minimum packet length: flags + type + 2 byte checksum */
     if (data.size() < 4) {
-	if (debug) {
-	    debug << "Packet too small (" << data.size();
-	    debug << " bytes, minimum: 4 bytes)" << std::endl;
-	}
 	return false;
     }
 
-    for (iter = data.begin(); iter < data.end() - 2; iter++) {
-	calcChecksum += *iter;
-    }
-    pktChecksum = (data[data.size() - 1] << 8) | data[data.size() - 2];
+    return calculatedChecksum(data) == packetChecksum(data);
+}
 
-    if (calcChecksum != pktChecksum) {
-	if (debug) {
-	    debug << "Checksum mismatch: " << calcChecksum;
-	    debug << " vs. " << pktChecksum << std::endl;
+bool
+WmrMessage::checkValidityAndCopyData(const std::vector<uint8_t>& data)
+{
+    DebugStream& debug = Options::messageDebug();
+    ssize_t expected;
+
+    if (!checksumValid(data)) {
+	if (debug && data.size() < 4) {
+	    DebugLog::log(DebugLog::MessageTooSmall, data.size());
+	} else if (debug) {
+	    DebugLog::log(DebugLog::MessageChecksum, calculatedChecksum(data), packetChecksum(data));
 	}
 	return false;
     }
@@ -95,16 +145,14 @@ WmrMessage::checkValidityAndCopyData(const std::vector<uint8_t>& data)
     expected = packetLengthForType(m_type);
     if (expected < 0) {
 	if (debug) {
-	    debug << "Unexpected type " << HEX(m_type) << std::endl;
+	    DebugLog::log(DebugLog::MessageUnknownType, m_type);
 	}
 	return false;
     } else {
 	expected -= 4; /* flags + type + checksum */
 	if (m_data.size() != (size_t) expected) {
 	    if (debug) {
-		debug << "Unexpected packet size for type " << HEX(m_type);
-		debug << " (" << m_data.size() << " vs. " << expected << ")";
-		debug << std::endl;
+		DebugLog::log(DebugLog::MessageBadSize, m_type, m_data.size(), expected);
 	    }
 	    return false;
 	}
@@ -123,24 +171,8 @@ WmrMessage::parse()
     }
 
     if (debug) {
-	time_t now = time(NULL);
-	struct tm time;
-
-	localtime_r(&now, &time);
-	debug << "MESSAGE[";
-	debug << std::setw(2) << std::setfill('0') << time.tm_mday;
-	debug << "." << std::setw(2) << std::setfill('0') << (time.tm_mon + 1);
-	debug << "." << (time.tm_year + 1900) << " ";
-	debug << std::setw(2) << std::setfill('0') << time.tm_hour;
-	debug << ":" << std::setw(2) << std::setfill('0') << time.tm_min;
-	debug << ":" << std::setw(2) << std::setfill('0') << time.tm_sec;
-	debug << "]: type " << HEX(m_type);
-	debug << ", flags " << HEX(m_flags);
-	debug << ", data ";
-	for (size_t i = 0; i < m_data.size(); i++) {
-	    debug << " " << HEX(m_data[i]);
-	}
-	debug << std::endl;
+	DebugLog::logData(DebugLog::MessageHeader, &m_data[0], m_data.size(),
+			  m_timestamp, m_type, m_flags);
     }
 
     parseFlags();
@@ -165,12 +197,8 @@ WmrMessage::parse()
 	    parseDateTimeMessage();
 	    break;
 	default:
-	    {
-		DebugStream& dataDebug = Options::dataDebug();
-		if (dataDebug) {
-		    dataDebug << "DATA: Unhandled message received";
-		    dataDebug << "(type " << HEX(m_type) << ")." << std::endl;
-		}
+	    if (Options::dataDebug()) {
+		DebugLog::log(DebugLog::DataUnhandled, m_type);
 	    }
 	    break;
     }
@@ -179,39 +207,14 @@ WmrMessage::parse()
 void
 WmrMessage::parseFlags()
 {
-    DebugStream& debug = Options::messageDebug();
-    bool batteryLow = m_flags & 0x40;
-
-    if (debug) {
-	debug << "Battery " << (batteryLow ? "low" : "ok");
-    }
-    if (m_type == msgTypeDateTime) {
-	bool externalPowerMissing = m_flags & 0x80;
-	bool dcfSync = m_flags & 0x20;
-	bool dcfSignalOk = m_flags & 0x10;
-	if (debug) {
-	    if (!externalPowerMissing) {
-		debug << ", externally powered";
-	    }
-	    debug << ", DCF " << (dcfSync ? "" : "not ") << "synchronized";
-	    debug << ", DCF signal " << (dcfSignalOk ? "ok" : "weak");
-	}
-    }
-    if (debug) {
-	debug << std::endl;
+    if (Options::messageDebug()) {
+	DebugLog::log(DebugLog::MessageFlags, m_type, m_flags);
     }
 }
 
 void
 WmrMessage::parseTemperatureMessage()
 {
-    static const char *trendStrings[] = {
-	"steady", "rising", "falling", "???"
-    };
-    static const char *smileyStrings[] = {
-	"   ", ":-)", ":-(", ":-|"
-    };
-
     DebugStream& debug = Options::messageDebug();
     unsigned int sensor = m_data[0] & 0xf;
     unsigned int smiley = m_data[0] >> 6;
@@ -229,42 +232,37 @@ WmrMessage::parseTemperatureMessage()
     }
 
     if (debug) {
-	debug << "Sensor " << sensor << ": temperature " << temperature;
-	debug << "°C (trend: " << trendStrings[tempTrend];
-	debug << "), dew point " << dewPoint << "°C, humidity ";
-	debug << humidity << "% (trend: " << trendStrings[humidTrend];
-	debug << "), smiley " << smileyStrings[smiley] << std::endl;
+	DebugLog::log(DebugLog::MessageTemperature, sensor, temperature, tempTrend,
+		      dewPoint, humidity, humidTrend, smiley);
     }
 
-    if (m_db) {
-	time_t interval = (sensor == 0) ? 15 : 60;
+    time_t interval = (sensor == 0) ? 15 : 60;
 
-	Database::NumericSensors tempSensor = (sensor == 0) ? Database::SensorTempInside :
-					      (sensor == 1) ? Database::SensorTempOutsideCh1 :
-					      (sensor == 2) ? Database::SensorTempOutsideCh2 :
-					      (sensor == 3) ? Database::SensorTempOutsideCh3 :
-					      Database::NumericSensorLast;
-	if (tempSensor != Database::NumericSensorLast) {
-	    m_db->addSensorValue(tempSensor, temperature, interval);
-	}
+    Database::NumericSensors tempSensor = (sensor == 0) ? Database::SensorTempInside :
+					  (sensor == 1) ? Database::SensorTempOutsideCh1 :
+					  (sensor == 2) ? Database::SensorTempOutsideCh2 :
+					  (sensor == 3) ? Database::SensorTempOutsideCh3 :
+					  Database::NumericSensorLast;
+    if (tempSensor != Database::NumericSensorLast) {
+	storeValue(tempSensor, temperature, interval);
+    }
 
-	Database::NumericSensors dewSensor = (sensor == 0) ? Database::SensorDewPointInside :
-					     (sensor == 1) ? Database::SensorDewPointOutsideCh1 :
-					     (sensor == 2) ? Database::SensorDewPointOutsideCh2 :
-					     (sensor == 3) ? Database::SensorDewPointOutsideCh3 :
-					     Database::NumericSensorLast;
-	if (dewSensor != Database::NumericSensorLast) {
-	    m_db->addSensorValue(dewSensor, dewPoint, interval);
-	}
+    Database::NumericSensors dewSensor = (sensor == 0) ? Database::SensorDewPointInside :
+					 (sensor == 1) ? Database::SensorDewPointOutsideCh1 :
+					 (sensor == 2) ? Database::SensorDewPointOutsideCh2 :
+					 (sensor == 3) ? Database::SensorDewPointOutsideCh3 :
+					 Database::NumericSensorLast;
+    if (dewSensor != Database::NumericSensorLast) {
+	storeValue(dewSensor, dewPoint, interval);
+    }
 
-	Database::NumericSensors humidSensor = (sensor == 0) ? Database::SensorHumidityInside :
-					       (sensor == 1) ? Database::SensorHumidityOutsideCh1 :
-					       (sensor == 2) ? Database::SensorHumidityOutsideCh2 :
-					       (sensor == 3) ? Database::SensorHumidityOutsideCh3 :
-					       Database::NumericSensorLast;
-	if (humidSensor != Database::NumericSensorLast) {
-	    m_db->addSensorValue(humidSensor, humidity, interval);
-	}
+    Database::NumericSensors humidSensor = (sensor == 0) ? Database::SensorHumidityInside :
+					   (sensor == 1) ? Database::SensorHumidityOutsideCh1 :
+					   (sensor == 2) ? Database::SensorHumidityOutsideCh2 :
+					   (sensor == 3) ? Database::SensorHumidityOutsideCh3 :
+					   Database::NumericSensorLast;
+    if (humidSensor != Database::NumericSensorLast) {
+	storeValue(humidSensor, humidity, interval);
     }
 }
 
@@ -278,38 +276,20 @@ WmrMessage::parseRainMessage()
     float total = 0.01f * 25.4f * ((m_data[7] << 8) + m_data[6]);
 
     if (debug) {
-	debug << "Rain: rate " << rate << ", this hour " << thisHour;
-	debug << ", thisDay " << thisDay << ", total " << total;
-	debug << " since " << std::setw(2) << std::setfill('0') << DEC(m_data[10]);
-	debug << "." << std::setw(2) << std::setfill('0') << DEC(m_data[11]);
-	debug << "." << DEC(2000 + m_data[12]) << " ";
-	debug << std::setw(2) << std::setfill('0') << DEC(m_data[9]);
-	debug << ":" << std::setw(2) << std::setfill('0') << DEC(m_data[8]);
-	debug << std::endl;
+	/* start of the total: minute, hour, day, month, year */
+	DebugLog::logData(DebugLog::MessageRain, &m_data[8], 5,
+			  rate, thisHour, thisDay, total);
     }
 
-    if (m_db) {
-	static const time_t interval = 70;
-	m_db->addSensorValue(Database::SensorRainRate, rate, interval);
-	m_db->addSensorValue(Database::SensorRainAmount, total, interval);
-	m_db->addSensorValue(Database::SensorRainTotalSum, total, interval);
-    }
+    static const time_t interval = maxInterval;
+    storeValue(Database::SensorRainRate, rate, interval);
+    storeValue(Database::SensorRainAmount, total, interval);
+    storeValue(Database::SensorRainTotalSum, total, interval);
 }
 
 void
 WmrMessage::parsePressureMessage()
 {
-    static const char *forecastStrings[] = {
-	"partly cloudy", /* day */	"rainy",
-	"cloudy",			"sunny", /* day */
-	"clear", /* night */		"snowy",
-	"partly cloudy", /* night */	"???",
-	"???",				"???",
-	"???",				"???",
-	"???",				"???",
-	"???",				"???"
-    };
-
     DebugStream& debug = Options::messageDebug();
     unsigned int absPressure = ((m_data[1] & 0xf) << 8) + m_data[0];
     unsigned int relPressure = ((m_data[3] & 0xf) << 8) + m_data[2];
@@ -317,27 +297,17 @@ WmrMessage::parsePressureMessage()
     unsigned int relForecast = m_data[3] >> 4;
 
     if (debug) {
-	debug << std::dec;
-	debug << "Absolute pressure: " << absPressure << " mbar (forecast: ";
-	debug << forecastStrings[absForecast] << ")" << std::endl;
-	debug << "Relative pressure: " << relPressure << " mbar (forecast: ";
-	debug << forecastStrings[relForecast] << ")" << std::endl;
+	DebugLog::log(DebugLog::MessagePressure, absPressure, absForecast,
+		      relPressure, relForecast);
     }
 
-    if (m_db) {
-	static const time_t interval = 60;
-	m_db->addSensorValue(Database::SensorAirPressure, relPressure, interval);
-    }
+    static const time_t interval = 60;
+    storeValue(Database::SensorAirPressure, relPressure, interval);
 }
 
 void
 WmrMessage::parseWindMessage()
 {
-    static const char *directionStrings[] = {
-	"N", "NNE", "NE", "ENE", "E", "ESE", "SE", "SSE",
-	"S", "SSW", "SW", "WSW", "W", "WNW", "NW", "NNW"
-    };
-
     DebugStream& debug = Options::messageDebug();
     uint8_t direction = m_data[0] & 0x0f;
     float degrees = 360.0f * direction / 16.0f;
@@ -352,26 +322,16 @@ WmrMessage::parseWindMessage()
     }
 
     if (debug) {
-	debug << "Wind direction " << directionStrings[direction];
-	debug << " -> " << degrees << "°, speed avg. ";
-	debug << avgSpeed << " m/s, gust " << gustSpeed << " m/s" << std::endl;
-	debug << "Wind chill temperature ";
-	if (isnan(windChill)) {
-	    debug << "n/a";
-	} else {
-	    debug << windChill << " °C";
-	}
-	debug << std::endl;
+	DebugLog::log(DebugLog::MessageWind, direction, degrees,
+		      avgSpeed, gustSpeed, windChill);
     }
 
-    if (m_db) {
-	static const time_t interval = 48;
-	m_db->addSensorValue(Database::SensorWindSpeedAvg, avgSpeed, interval);
-	if (avgSpeed != gustSpeed) {
-	    m_db->addSensorValue(Database::SensorWindSpeedGust, gustSpeed, interval);
-	}
-	m_db->addSensorValue(Database::SensorWindDirection, degrees, interval);
+    static const time_t interval = 48;
+    storeValue(Database::SensorWindSpeedAvg, avgSpeed, interval);
+    if (avgSpeed != gustSpeed) {
+	storeValue(Database::SensorWindSpeedGust, gustSpeed, interval);
     }
+    storeValue(Database::SensorWindDirection, degrees, interval);
 }
 
 void
@@ -381,12 +341,10 @@ WmrMessage::parseUVMessage()
     unsigned int level = m_data[1];
 
     if (debug) {
-	debug << "UV level: " << level << std::endl;
-    }
-    if (m_db) {
-	static const time_t interval = 60;
-	m_db->addSensorValue(Database::SensorUVLevel, (float) level, interval);
+	DebugLog::log(DebugLog::DataUV, level);
     }
+    static const time_t interval = 60;
+    storeValue(Database::SensorUVLevel, (float) level, interval);
 }
 
 void
@@ -395,13 +353,7 @@ WmrMessage::parseDateTimeMessage()
     DebugStream& debug = Options::dataDebug();
 
     if (debug) {
-	int timezone = (m_data[7] >= 128) ? 128 - m_data[7] : m_data[7];
-	debug << "Date = " << std::setw(2) << std::setfill('0') << DEC(m_data[4]);
-	debug << "." << std::setw(2) << std::setfill('0') << DEC(m_data[5]);
-	debug << "." << DEC(2000 + m_data[6]) << std::endl;
-	debug << "Time = " << std::setw(2) << std::setfill('0') << DEC(m_data[3]);
-	debug << ":" << std::setw(2) << std::setfill('0') << DEC(m_data[2]);
-	debug << " (GMT" << (timezone >= 0 ? "+" : "") << timezone << ")";
-	debug << std::endl;
+	/* minute, hour, day, month, year, timezone */
+	DebugLog::logData(DebugLog::DataDateTime, &m_data[2], 6);
     }
 }
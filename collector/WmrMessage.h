@@ -21,15 +21,30 @@
 #define __WMRMESSAGE_H__
 
 #include <vector>
-#include <boost/shared_ptr.hpp>
 #include "Database.h"
 
+class FrameParser;
+class SampleBatch;
+
 class WmrMessage
 {
     public:
-	WmrMessage(const std::vector<uint8_t>& data, boost::shared_ptr<Database>& db);
+	WmrMessage(const std::vector<uint8_t>& data, SampleBatch& batch,
+		   time_t timestamp, unsigned int station);
+
+	/* the longest interval a sensor reports in, that of the rain gauge */
+	static const time_t maxInterval = 70;
 
 	static ssize_t packetLengthForType(uint8_t type);
+	/* checks size and checksum of a frame (flags to checksum) */
+	static bool checksumValid(const std::vector<uint8_t>& data);
+	/* Splits the buffer into frames and appends the samples of all valid
+	 * ones to the batch. Returns the number of frames found. */
+	static size_t decodeBuffer(FrameParser& parser, const uint8_t *data, size_t length,
+				   time_t timestamp, unsigned int station, SampleBatch& batch);
+	/* appends the samples of a single frame to the batch */
+	static void decodeFrame(const std::vector<uint8_t>& frame, SampleBatch *batch,
+				time_t timestamp, unsigned int station);
 	bool isValid() const {
 	    return m_valid;
 	}
@@ -45,6 +60,7 @@ class WmrMessage
 
     private:
 	bool checkValidityAndCopyData(const std::vector<uint8_t>& data);
+	void storeValue(Database::NumericSensors sensor, float value, time_t interval);
 
 	void parseFlags();
 	void parseTemperatureMessage();
@@ -55,7 +71,9 @@ class WmrMessage
 	void parseDateTimeMessage();
 
     private:
-	boost::shared_ptr<Database> m_db;
+	SampleBatch *m_batch;
+	time_t m_timestamp;
+	unsigned int m_station;
 	bool m_valid;
 	uint8_t m_flags;
 	uint8_t m_type;
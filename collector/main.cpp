@@ -20,26 +20,225 @@
 #include <cerrno>
 #include <csignal>
 #include <iostream>
+#include <boost/asio/signal_set.hpp>
 #include <boost/scoped_ptr.hpp>
-#include <boost/thread.hpp>
+#include "Clock.h"
+#include "DebugLog.h"
+#include "FlightRecorder.h"
 #include "IoHandler.h"
+#include "Metrics.h"
 #include "MysqlDatabase.h"
 #include "Options.h"
 #include "PidFile.h"
 
 static IoHandler *
-getHandler(const std::string& target, boost::shared_ptr<Database>& db)
+getHandler(const std::string& target, boost::shared_ptr<Database>& db,
+	   boost::shared_ptr<Clock>& clock)
 {
     size_t pos = target.find(':');
     if (pos != std::string::npos) {
 	std::string host = target.substr(0, pos);
 	std::string port = target.substr(pos + 1);
-	return new IoHandler(host, port, db);
+	return new IoHandler(host, port, db, clock);
     }
 
     return NULL;
 }
 
+/* leaves db empty if the configuration asks for no database */
+static bool
+connectDatabase(boost::shared_ptr<Database>& db)
+{
+    const std::string& dbPath = Options::databasePath();
+
+    db.reset();
+    if (dbPath == "none") {
+	return true;
+    }
+
+    MysqlDatabase *mysql = new MysqlDatabase();
+    if (!mysql->connect(dbPath, Options::databaseUser(), Options::databasePassword())) {
+	delete mysql;
+	return false;
+    }
+    mysql->setSlowQueryThreshold(Options::slowQueryThreshold());
+    db.reset(mysql);
+
+    return true;
+}
+
+/* Handles the signals on the handler's IO service: SIGINT, SIGQUIT and
+ * SIGTERM close it, SIGUSR1 dumps the flight recorder and SIGHUP reloads
+ * the configuration. A reload is applied as a whole or not at all; it
+ * reopens the debug files and reconnects to the database if its settings
+ * changed, but leaves the connection to the target alone. */
+class SignalHandler
+{
+    public:
+	SignalHandler(IoHandler& handler, boost::shared_ptr<Database>& db) :
+	    m_signals(handler, SIGINT, SIGQUIT, SIGTERM),
+	    m_handler(handler),
+	    m_db(db)
+	{
+	    m_signals.add(SIGHUP);
+	    m_signals.add(SIGUSR1);
+	    wait();
+	}
+
+	/* served on the handler's IO service, so it needs no thread of its own */
+	void startMetrics() {
+	    if (Options::statsPort()) {
+		m_metrics.reset(new MetricsServer(m_handler, Options::statsPort()));
+		m_metrics->start();
+	    }
+	    Metrics::timing = Options::statsPort() != 0;
+	}
+
+    private:
+	void wait() {
+	    m_signals.async_wait(boost::bind(&SignalHandler::handleSignal, this,
+					     boost::asio::placeholders::error, _2));
+	}
+
+	void handleSignal(const boost::system::error_code& error, int signal) {
+	    if (error) {
+		return;
+	    }
+
+	    switch (signal) {
+		case SIGHUP:
+		    reload();
+		    break;
+		case SIGUSR1:
+		    if (FlightRecorder::dump()) {
+			std::cerr << "Dumped recent events to " << Options::traceFilePath() << std::endl;
+		    } else {
+			std::cerr << "Error: Could not dump recent events to "
+				  << Options::traceFilePath() << ": " << strerror(errno) << std::endl;
+		    }
+		    break;
+		default:
+		    m_handler.close();
+		    return;
+	    }
+
+	    wait();
+	}
+
+	void reload();
+
+    private:
+	boost::asio::signal_set m_signals;
+	IoHandler& m_handler;
+	boost::shared_ptr<Database>& m_db;
+	boost::shared_ptr<MetricsServer> m_metrics;
+};
+
+void
+SignalHandler::reload()
+{
+    Options::Settings old = Options::settings();
+    boost::shared_ptr<MetricsServer> metrics;
+    boost::shared_ptr<Database> db;
+    bool dbChanged, statsChanged;
+
+    if (!Options::reload()) {
+	std::cerr << "Error: Could not parse configuration, keeping the old one" << std::endl;
+	return;
+    }
+
+    Options::Settings settings = Options::settings();
+    std::string ignored;
+
+    /* the running handler was set up with these */
+    if (settings.target != old.target || settings.replayPath != old.replayPath ||
+	settings.replaySpeed != old.replaySpeed) {
+	ignored += " target";
+    }
+    if (settings.framed != old.framed) {
+	ignored += " framed";
+    }
+    if (settings.resync != old.resync) {
+	ignored += " resync";
+    }
+    if (settings.staleIntervals != old.staleIntervals) {
+	ignored += " stale-intervals";
+    }
+    if (settings.sequenceFilePath != old.sequenceFilePath) {
+	ignored += " sequence-file";
+    }
+    if (settings.recordPath != old.recordPath) {
+	ignored += " record";
+    }
+    if (!ignored.empty()) {
+	std::cerr << "Warning: Changes of" << ignored << " take effect after a restart" << std::endl;
+    }
+    settings.target = old.target;
+    settings.replayPath = old.replayPath;
+    settings.replaySpeed = old.replaySpeed;
+    settings.framed = old.framed;
+    settings.resync = old.resync;
+    settings.staleIntervals = old.staleIntervals;
+    settings.sequenceFilePath = old.sequenceFilePath;
+    settings.recordPath = old.recordPath;
+    settings.pidFilePath = old.pidFilePath;
+    settings.daemonize = old.daemonize;
+    Options::assign(settings);
+
+    /* set up everything that can fail before changing anything */
+    statsChanged = settings.statsPort != old.statsPort;
+    if (statsChanged && settings.statsPort) {
+	try {
+	    metrics.reset(new MetricsServer(m_handler, settings.statsPort));
+	} catch (std::exception& e) {
+	    std::cerr << "Error: Could not serve metrics on port " << settings.statsPort
+		      << ": " << e.what() << ", keeping the old configuration" << std::endl;
+	    Options::assign(old);
+	    return;
+	}
+    }
+
+    dbChanged = settings.dbPath != old.dbPath || settings.dbUser != old.dbUser ||
+		settings.dbPass != old.dbPass;
+    if (dbChanged && !connectDatabase(db)) {
+	std::cerr << "Error: Could not connect to database, keeping the old configuration"
+		  << std::endl;
+	Options::assign(old);
+	return;
+    }
+
+    if (statsChanged) {
+	/* closing the acceptor releases the old server once its accept is aborted */
+	if (m_metrics) {
+	    m_metrics->stop();
+	}
+	if (metrics) {
+	    metrics->start();
+	}
+	m_metrics = metrics;
+	Metrics::timing = settings.statsPort != 0;
+    }
+
+    if (dbChanged) {
+	/* the old database closes its runs when the handler lets go of it */
+	m_db = db;
+	m_handler.setDatabase(m_db);
+    } else if (MysqlDatabase *mysql = dynamic_cast<MysqlDatabase *>(m_db.get())) {
+	mysql->setSlowQueryThreshold(settings.slowQueryThreshold);
+    }
+
+    /* reopens the debug files as well, so they can be rotated */
+    DebugLog::stop();
+    Options::applyDebugStreams();
+    DebugLog::start();
+
+    if (settings.traceFilePath != old.traceFilePath) {
+	FlightRecorder::install(settings.traceFilePath);
+    }
+
+    std::cerr << "Reloaded configuration" << std::endl;
+}
+
 int main(int argc, char *argv[])
 {
     Options::ParseResult result = Options::parse(argc, argv);
@@ -49,27 +248,26 @@ int main(int argc, char *argv[])
 	return 0;
     }
 
+    if (!Options::printTracePath().empty()) {
+	if (!FlightRecorder::print(Options::printTracePath(), std::cout)) {
+	    std::cerr << "Could not read trace file " << Options::printTracePath() << std::endl;
+	    return 1;
+	}
+	return 0;
+    }
+
     try {
-	sigset_t oldMask, newMask, waitMask;
-	struct timespec pollTimeout;
-	siginfo_t info;
-	const std::string& dbPath = Options::databasePath();
 	PidFile pid(Options::pidFilePath());
 	boost::shared_ptr<Database> db;
-	bool running = true;
+	boost::shared_ptr<Clock> clock(new SystemClock());
 
 	if (Options::daemonize()) {
 	    pid.aquire();
 	}
 
-	if (dbPath != "none") {
-	    MysqlDatabase *mysql = new MysqlDatabase();
-	    if (!mysql->connect(dbPath, Options::databaseUser(), Options::databasePassword())) {
-		std::cerr << "Could not connect to database" << std::endl;
-		delete mysql;
-		return 1;
-	    }
-	    db.reset(mysql);
+	if (!connectDatabase(db)) {
+	    std::cerr << "Could not connect to database" << std::endl;
+	    return 1;
 	}
 
 	if (Options::daemonize()) {
@@ -82,53 +280,32 @@ int main(int argc, char *argv[])
 	    pid.write();
 	}
 
-	pollTimeout.tv_sec = 2;
-	pollTimeout.tv_nsec = 0;
-
-	while (running) {
-	    boost::scoped_ptr<IoHandler> handler(getHandler(Options::target(), db));
-	    if (!handler) {
-		std::ostringstream msg;
-		msg << "Target " << Options::target() << " is invalid.";
-		throw std::runtime_error(msg.str());
-	    }
-
-	    /* block all signals for background thread */
-	    sigfillset(&newMask);
-	    pthread_sigmask(SIG_BLOCK, &newMask, &oldMask);
-
-	    /* run the IO service in background thread */
-	    boost::thread t(boost::bind(&IoHandler::run, handler.get()));
-
-	    /* restore previous signals */
-	    pthread_sigmask(SIG_SETMASK, &oldMask, 0);
-
-	    /* wait for signal indicating time to shut down */
-	    sigemptyset(&waitMask);
-	    sigaddset(&waitMask, SIGINT);
-	    sigaddset(&waitMask, SIGQUIT);
-	    sigaddset(&waitMask, SIGTERM);
+	/* only start the debug writer thread after daemon() forked */
+	DebugLog::start();
+	FlightRecorder::install(Options::traceFilePath());
 
-	    pthread_sigmask(SIG_BLOCK, &waitMask, 0);
+	/* the handler reconnects by itself, so it lives as long as we do,
+	 * or until it is done with the journal to replay */
+	boost::scoped_ptr<IoHandler> handler(Options::replayPath().empty() ?
+		getHandler(Options::target(), db, clock) :
+		new IoHandler(Options::replayPath(), Options::replaySpeed(), db));
+	if (!handler) {
+	    std::ostringstream msg;
+	    msg << "Target " << Options::target() << " is invalid.";
+	    throw std::runtime_error(msg.str());
+	}
 
-	    do {
-		if (sigtimedwait(&waitMask, &info, &pollTimeout) >= 0) {
-		    running = false;
-		    handler->close();
-		    break;
-		}
-	    } while (handler->active());
+	SignalHandler signals(*handler, db);
+	signals.startMetrics();
 
-	    t.join();
-	    /* wait some time until retrying */
-	    if (running) {
-		sleep(10);
-	    }
-	}
+	/* everything runs on the handler's IO service, until it is closed */
+	handler->run();
     } catch (std::exception& e) {
 	std::cerr << "Exception: " << e.what() << std::endl;
+	DebugLog::stop();
 	return 1;
     }
 
+    DebugLog::stop();
     return 0;
 }
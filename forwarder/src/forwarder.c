@@ -17,175 +17,1471 @@
  * along with this program.  If not, see <http://www.gnu.org/licenses/>.
  */
 
+#define _GNU_SOURCE  /* sendmmsg */
 #include <errno.h>
 #include <fcntl.h>
+#include <limits.h>
 #include <netdb.h>
 #include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
 #include <sys/epoll.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-#include <sys/time.h>
+#include <sys/timerfd.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
+#include "frame.h"
+#include "history.h"
+#include "record.h"
 
 #define MAXEVENTS  64
-#define MAXCLIENTS 32
+
+#define CLIENT_BUFSIZE 16384
+#define HID_REPORT_SIZE 8
+/* payload collected from HID reports per wakeup before it is sent out */
+#define HID_BATCH_SIZE 4096
+/* reports waiting to be written to the device */
+#define HID_QUEUE_LEN 8
+
+/* worst case: a 6 byte frame with 2 marker bytes becomes a 22 byte record */
+#define RECORD_BATCH_SIZE (HID_BATCH_SIZE * 3 + RECORD_HEADER_LEN + WMR_MAX_FRAME_LEN)
+#define CLIENT_REQUEST_MAX 256
+
+/* datagrams handed to the kernel per sendmmsg() call */
+#define MULTICAST_BATCH 64
+#define MULTICAST_TTL   1
+
+#define HISTORY_FRAMES         4096
+/* interval of writing the history file, in seconds */
+#define HISTORY_FLUSH_INTERVAL 60
 
 #define HEARTBEAT_INTERVAL 25
 #define RESET_TIMEOUT      60
+/* reopen attempts while the device is gone and nothing changes in /dev */
+#define HID_RETRY_INTERVAL 10
+
+enum {
+    SLOW_CLIENT_DISCONNECT,
+    SLOW_CLIENT_DROP_OLDEST
+};
+
+struct client {
+    int fd;
+    int index;              /* position in the client table */
+    int want_write;         /* EPOLLOUT is armed */
+    char *buf;              /* output ring of g_client_bufsize bytes */
+    size_t head;            /* offset of the oldest pending byte */
+    size_t len;             /* number of pending bytes */
+    unsigned long dropped;  /* bytes dropped due to a full buffer */
+    int framed;             /* connected to the framed protocol port */
+    struct hid_device *dev; /* whose raw data a raw client gets */
+    int streaming;          /* framed client sent its request */
+    int catching_up;        /* sending history before live records */
+    uint32_t next_sequence; /* of the next history record to send */
+    int filtered;           /* only gets the subscribed message types */
+    uint8_t types[32];      /* bitmap of subscribed message types */
+    unsigned long sent;     /* bytes written to the socket */
+    char request[CLIENT_REQUEST_MAX];
+    size_t request_len;
+};
+
+struct hid_device {
+    const char *path;
+    const char *name;         /* of the device node, for inotify */
+    int channel;              /* index, tags its records */
+    char *port;               /* of the raw data listener, or NULL */
+    int listen_fd;
+    int watch;                /* inotify watch of the node's directory */
+    int fd;                   /* -1 while detached */
+    int retry_fd;             /* timerfd for reopening the device */
+    int heartbeat_fd;         /* periodic timerfd for the heartbeat */
+    int reset_fd;             /* timerfd for the receive timeout */
+    int timers_active;
+    struct timespec last_recv;
+    char out[HID_QUEUE_LEN][HID_REPORT_SIZE];
+    int out_head;
+    int out_len;
+    int want_write;           /* EPOLLOUT is armed */
+    struct frame_parser parser;
+    struct history *history;  /* of the frames of all devices, also numbers them */
+    uint64_t recv_time;       /* of the current batch, in us */
+
+    /* statistics, kept over reattaches */
+    unsigned long reports;         /* read from the device */
+    unsigned long short_reports;   /* reads returning less than a report */
+    unsigned long invalid_reports; /* with a length byte of 0 or beyond the report */
+    unsigned long bytes;           /* payload passed on */
+    unsigned long heartbeats;
+    unsigned long resets;
+    unsigned long attaches;
+    unsigned long detaches;
+};
+
+struct client_table {
+    struct client **clients;  /* compact, unordered */
+    int count;
+    int capacity;
+    struct client **by_fd;    /* lookup by descriptor */
+    int fd_capacity;
+};
+
+/* Optional UDP multicast of the frame records, one record per datagram,
+ * so any number of listeners costs one send per frame. Listeners see lost
+ * datagrams as sequence gaps and can fill them over the framed TCP port. */
+struct multicast {
+    int fd;
+    struct sockaddr_in group;
+    unsigned long sent;
+    unsigned long dropped;
+};
+
+/* Counters not belonging to a device or client. Everything is updated
+ * with plain increments from the event loop, and only read when a
+ * snapshot is requested on the stats port. */
+struct stats {
+    unsigned long wakeups;          /* returns from epoll_pwait() */
+    unsigned long events;           /* handled in those wakeups */
+    unsigned long clients_accepted;
+    unsigned long clients_closed;
+    unsigned long slow_disconnects; /* clients given up on for a full buffer */
+    unsigned long bytes_dropped;    /* for slow clients already closed */
+    unsigned long snapshots;
+};
+
+static int g_running = 1;
+static size_t g_client_bufsize = CLIENT_BUFSIZE;
+static int g_slow_client_policy = SLOW_CLIENT_DISCONNECT;
+static struct multicast g_multicast = { .fd = -1 };
+static struct stats g_stats;
+
+static int
+create_and_bind_socket(char *port)
+{
+    struct addrinfo hints;
+    struct addrinfo *result, *rp;
+    int s, sfd;
+
+    memset(&hints, 0, sizeof (struct addrinfo));
+    hints.ai_family = AF_UNSPEC;     /* Return IPv4 and IPv6 choices */
+    hints.ai_socktype = SOCK_STREAM; /* We want a TCP socket */
+    hints.ai_flags = AI_PASSIVE;     /* FIXME: All interfaces */
+
+    s = getaddrinfo(NULL, port, &hints, &result);
+    if (s != 0) {
+	fprintf (stderr, "getaddrinfo: %s\n", gai_strerror(s));
+	return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+	int opt = 1;
+
+	sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
+	if (sfd == -1) {
+	    continue;
+	}
+
+	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) == -1) {
+	    perror("setsockopt");
+	} else if (bind(sfd, rp->ai_addr, rp->ai_addrlen) < 0) {
+	    perror("bind");
+	} else {
+	    /* We managed to bind successfully! */
+	    break;
+	}
+
+	close(sfd);
+    }
+
+    if (rp == NULL) {
+	fprintf(stderr, "Could not bind\n");
+	return -1;
+    }
+
+   freeaddrinfo(result);
+   return sfd;
+}
+
+static int make_fd_non_blocking(int fd);
+
+static int
+open_listener(char *port)
+{
+    int sfd = create_and_bind_socket(port);
+
+    if (sfd < 0 || make_fd_non_blocking(sfd) < 0) {
+	perror("open socket");
+    } else if (listen(sfd, SOMAXCONN) < 0) {
+	perror("listen");
+    } else {
+	return sfd;
+    }
+
+    if (sfd >= 0) {
+	close(sfd);
+    }
+    return -1;
+}
+
+static int
+make_fd_non_blocking (int fd)
+{
+    int flags, s;
+
+    flags = fcntl(fd, F_GETFL, 0);
+    if (flags == -1) {
+	perror("fcntl");
+	return -1;
+    }
+
+    flags |= O_NONBLOCK;
+    s = fcntl(fd, F_SETFL, flags);
+    if (s == -1) {
+	perror("fcntl");
+	return -1;
+    }
+
+    return 0;
+}
+
+static int
+add_fd_to_epoll(int efd, int fd)
+{
+    struct epoll_event event;
+
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) < 0) {
+	perror("epoll_ctl");
+	return -1;
+    }
+
+    return 0;
+}
+
+static int
+hid_set_want_write(int efd, struct hid_device *dev, int want_write)
+{
+    struct epoll_event event;
+
+    if (dev->want_write == want_write) {
+	return 0;
+    }
+
+    event.data.fd = dev->fd;
+    event.events = EPOLLIN | EPOLLET | (want_write ? EPOLLOUT : 0);
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, dev->fd, &event) < 0) {
+	perror("epoll_ctl");
+	return -1;
+    }
+
+    dev->want_write = want_write;
+    return 0;
+}
+
+static int
+hid_flush(int efd, struct hid_device *dev)
+{
+    while (dev->out_len > 0) {
+	ssize_t n = write(dev->fd, dev->out[dev->out_head], HID_REPORT_SIZE);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return hid_set_want_write(efd, dev, 1);
+	    }
+	    perror("write hid");
+	    return -1;
+	}
+
+	/* hidraw takes reports as a whole */
+	dev->out_head = (dev->out_head + 1) % HID_QUEUE_LEN;
+	dev->out_len--;
+    }
+
+    return hid_set_want_write(efd, dev, 0);
+}
+
+static int
+hid_send_report(int efd, struct hid_device *dev, const char *report)
+{
+    if (dev->out_len == HID_QUEUE_LEN) {
+	/* the device is stuck; older commands are superseded anyway */
+	dev->out_head = (dev->out_head + 1) % HID_QUEUE_LEN;
+	dev->out_len--;
+    }
+
+    memcpy(dev->out[(dev->out_head + dev->out_len) % HID_QUEUE_LEN],
+	   report, HID_REPORT_SIZE);
+    dev->out_len++;
+
+    return hid_flush(efd, dev);
+}
+
+static int
+send_hmr_reset(int efd, struct hid_device *dev)
+{
+    static const char reset[] = { 0x20, 0x00, 0x08, 0x01, 0x00, 0x00, 0x00, 0x00 };
+    dev->resets++;
+    return hid_send_report(efd, dev, reset);
+}
+
+static int
+send_hmr_heartbeat(int efd, struct hid_device *dev)
+{
+    static const char heartbeat[] = { 0x01, 0xd0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    dev->heartbeats++;
+    return hid_send_report(efd, dev, heartbeat);
+}
+
+static int
+arm_timer(int tfd, long first_ms, long interval_ms)
+{
+    struct itimerspec spec;
+
+    spec.it_value.tv_sec = first_ms / 1000;
+    spec.it_value.tv_nsec = (first_ms % 1000) * 1000000;
+    spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    if (timerfd_settime(tfd, 0, &spec, NULL) < 0) {
+	perror("timerfd_settime");
+	return -1;
+    }
+
+    return 0;
+}
+
+static long
+ms_since(const struct timespec *then)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - then->tv_sec) * 1000 + (now.tv_nsec - then->tv_nsec) / 1000000;
+}
+
+/* The station only sends data while it gets heartbeats, and needs a reset
+ * if it stays silent, so both are only done while someone is listening. */
+static int
+hid_start_timers(int efd, struct hid_device *dev)
+{
+    if (send_hmr_reset(efd, dev) < 0 || send_hmr_heartbeat(efd, dev) < 0) {
+	return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &dev->last_recv);
+    dev->timers_active = 1;
+
+    if (arm_timer(dev->heartbeat_fd, HEARTBEAT_INTERVAL * 1000, HEARTBEAT_INTERVAL * 1000) < 0 ||
+	arm_timer(dev->reset_fd, RESET_TIMEOUT * 1000, 0) < 0) {
+	return -1;
+    }
+
+    return 0;
+}
+
+static void
+hid_stop_timers(struct hid_device *dev)
+{
+    arm_timer(dev->heartbeat_fd, 0, 0);
+    arm_timer(dev->reset_fd, 0, 0);
+    dev->timers_active = 0;
+}
+
+static int
+hid_handle_timer(int efd, struct hid_device *dev, int tfd)
+{
+    uint64_t expirations;
+
+    if (read(tfd, &expirations, sizeof(expirations)) < 0 || !dev->timers_active) {
+	return 0;
+    }
+
+    if (tfd == dev->heartbeat_fd) {
+	return send_hmr_heartbeat(efd, dev);
+    } else {
+	/* the timer isn't moved on every received report; check here
+	 * whether something came in since it was armed */
+	long elapsed = ms_since(&dev->last_recv);
+
+	if (elapsed < RESET_TIMEOUT * 1000) {
+	    return arm_timer(tfd, RESET_TIMEOUT * 1000 - elapsed, 0);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &dev->last_recv);
+	if (arm_timer(tfd, RESET_TIMEOUT * 1000, 0) < 0) {
+	    return -1;
+	}
+	return send_hmr_reset(efd, dev);
+    }
+}
+
+static struct client *
+add_client(struct client_table *table, int fd, struct hid_device *dev)
+{
+    struct client *cl;
+
+    if (table->count == table->capacity) {
+	int capacity = table->capacity ? 2 * table->capacity : 8;
+	struct client **clients = realloc(table->clients, capacity * sizeof(*clients));
+	if (!clients) {
+	    return NULL;
+	}
+	table->clients = clients;
+	table->capacity = capacity;
+    }
+    if (fd >= table->fd_capacity) {
+	int capacity = table->fd_capacity ? table->fd_capacity : 16;
+	struct client **by_fd;
+
+	while (capacity <= fd) {
+	    capacity *= 2;
+	}
+	by_fd = realloc(table->by_fd, capacity * sizeof(*by_fd));
+	if (!by_fd) {
+	    return NULL;
+	}
+	memset(by_fd + table->fd_capacity, 0,
+	       (capacity - table->fd_capacity) * sizeof(*by_fd));
+	table->by_fd = by_fd;
+	table->fd_capacity = capacity;
+    }
+
+    cl = calloc(1, sizeof(*cl));
+    if (cl) {
+	cl->buf = malloc(g_client_bufsize);
+    }
+    if (!cl || !cl->buf) {
+	free(cl);
+	return NULL;
+    }
+
+    cl->fd = fd;
+    cl->framed = dev == NULL;
+    cl->dev = dev;
+    cl->index = table->count;
+    table->clients[table->count++] = cl;
+    table->by_fd[fd] = cl;
+
+    return cl;
+}
+
+static struct client *
+find_client(struct client_table *table, int fd)
+{
+    if (fd < 0 || fd >= table->fd_capacity) {
+	return NULL;
+    }
+    return table->by_fd[fd];
+}
+
+static void
+remove_client(struct client_table *table, struct client *cl)
+{
+    struct client *last = table->clients[--table->count];
+
+    /* move the last entry into the gap to keep the table compact */
+    last->index = cl->index;
+    table->clients[cl->index] = last;
+    table->by_fd[cl->fd] = NULL;
+
+    if (cl->dropped > 0) {
+	printf("Dropped %lu bytes for slow client on descriptor %d\n",
+	       cl->dropped, cl->fd);
+    }
+    g_stats.clients_closed++;
+    g_stats.bytes_dropped += cl->dropped;
+    close(cl->fd);
+    free(cl->buf);
+    free(cl);
+}
+
+static void
+free_clients(struct client_table *table)
+{
+    while (table->count > 0) {
+	remove_client(table, table->clients[0]);
+    }
+    free(table->clients);
+    free(table->by_fd);
+    memset(table, 0, sizeof(*table));
+}
+
+static int
+client_set_want_write(int efd, struct client *cl, int want_write)
+{
+    struct epoll_event event;
+
+    if (cl->want_write == want_write) {
+	return 0;
+    }
+
+    event.data.fd = cl->fd;
+    event.events = EPOLLIN | EPOLLET | (want_write ? EPOLLOUT : 0);
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, cl->fd, &event) < 0) {
+	perror("epoll_ctl");
+	return -1;
+    }
+
+    cl->want_write = want_write;
+    return 0;
+}
+
+/* Appends data to the client's output ring. If it doesn't fit, the slow
+ * client policy decides between dropping the oldest pending bytes and
+ * giving up on the client (return value -1). Framed clients are always
+ * given up on: dropping bytes would cut their records apart, and they
+ * get what they missed resent when they reconnect. */
+static int
+client_queue(struct client *cl, const char *data, size_t len)
+{
+    size_t tail, first;
+
+    if (cl->len + len > g_client_bufsize) {
+	size_t excess = cl->len + len - g_client_bufsize;
+
+	if (g_slow_client_policy == SLOW_CLIENT_DISCONNECT || cl->framed) {
+	    fprintf(stderr, "Output buffer of client on descriptor %d full, "
+		    "disconnecting\n", cl->fd);
+	    g_stats.slow_disconnects++;
+	    return -1;
+	}
+	if (len > g_client_bufsize) {
+	    /* only the newest bytes survive */
+	    data += len - g_client_bufsize;
+	    excess -= len - g_client_bufsize;
+	    cl->dropped += len - g_client_bufsize;
+	    len = g_client_bufsize;
+	}
+	cl->head = (cl->head + excess) % g_client_bufsize;
+	cl->len -= excess;
+	cl->dropped += excess;
+    }
+
+    tail = (cl->head + cl->len) % g_client_bufsize;
+    first = g_client_bufsize - tail;
+    if (first > len) {
+	first = len;
+    }
+    memcpy(cl->buf + tail, data, first);
+    memcpy(cl->buf, data + first, len - first);
+    cl->len += len;
+
+    return 0;
+}
+
+/* Writes as much pending output as the socket takes without blocking,
+ * and arms EPOLLOUT for the rest. */
+static int
+client_flush(int efd, struct client *cl)
+{
+    while (cl->len > 0) {
+	struct iovec iov[2];
+	size_t first = g_client_bufsize - cl->head;
+	int iovcnt = 1;
+	ssize_t n;
+
+	iov[0].iov_base = cl->buf + cl->head;
+	iov[0].iov_len = first < cl->len ? first : cl->len;
+	if (iov[0].iov_len < cl->len) {
+	    iov[1].iov_base = cl->buf;
+	    iov[1].iov_len = cl->len - iov[0].iov_len;
+	    iovcnt = 2;
+	}
+
+	n = writev(cl->fd, iov, iovcnt);
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return client_set_want_write(efd, cl, 1);
+	    }
+	    return -1;
+	}
+
+	cl->head = (cl->head + n) % g_client_bufsize;
+	cl->len -= n;
+	cl->sent += n;
+    }
+
+    cl->head = 0;
+    return client_set_want_write(efd, cl, 0);
+}
+
+static int
+client_wants(const struct client *cl, uint8_t type)
+{
+    return !cl->filtered || (cl->types[type / 8] & (1 << (type % 8)));
+}
+
+/* Queues the records of a batch matching the client's subscription. Raw
+ * clients get the frames with their start marker, as the station sent
+ * them. */
+static int
+client_queue_records(struct client *cl, const char *data, size_t len)
+{
+    static const char marker[] = { 0xff, 0xff };
+    size_t pos;
+
+    if (cl->framed && !cl->filtered) {
+	return client_queue(cl, data, len);
+    }
+
+    for (pos = 0; pos < len; pos += get_be16(data + pos)) {
+	const char *frame = data + pos + RECORD_HEADER_LEN;
+	size_t frame_len = get_be16(data + pos) - RECORD_HEADER_LEN;
+
+	if (data[pos + 2] != RECORD_FRAME) {
+	    /* status records only make sense in the framed protocol */
+	    if (cl->framed && client_queue(cl, data + pos, RECORD_HEADER_LEN + frame_len) < 0) {
+		return -1;
+	    }
+	    continue;
+	}
+	if (!client_wants(cl, frame[1])) {
+	    continue;
+	}
+	if (cl->framed) {
+	    if (client_queue(cl, data + pos, RECORD_HEADER_LEN + frame_len) < 0) {
+		return -1;
+	    }
+	} else if (client_queue(cl, marker, sizeof(marker)) < 0 ||
+		   client_queue(cl, frame, frame_len) < 0) {
+	    return -1;
+	}
+    }
+
+    return 0;
+}
+
+/* Sends either raw data of a device or a batch of its records to the
+ * clients that want it. */
+static void
+broadcast(int efd, struct client_table *table, const struct hid_device *dev,
+	  int records, const char *data, size_t len)
+{
+    int i;
+
+    for (i = 0; i < table->count; ) {
+	struct client *cl = table->clients[i];
+	int wants_records = cl->framed ? cl->streaming && !cl->catching_up :
+					 cl->filtered && cl->dev == dev;
+	int wants_raw = !cl->framed && !cl->filtered && cl->dev == dev;
+
+	if (records ? !wants_records : !wants_raw) {
+	    i++;
+	} else if ((records ? client_queue_records(cl, data, len) : client_queue(cl, data, len)) < 0 ||
+		   client_flush(efd, cl) < 0) {
+	    remove_client(table, cl);
+	    /* keep i, as remove_client moved the last client here */
+	} else {
+	    i++;
+	}
+    }
+}
+
+static int
+open_multicast(struct multicast *mc, char *spec, const char *ifaddr)
+{
+    char *port = strrchr(spec, ':');
+    struct in_addr iface;
+    unsigned char ttl = MULTICAST_TTL;
+
+    memset(mc, 0, sizeof(*mc));
+    mc->fd = -1;
+    mc->group.sin_family = AF_INET;
+
+    if (!port || port == spec) {
+	fprintf(stderr, "Multicast destination must be given as group:port\n");
+	return -1;
+    }
+    *port++ = '\0';
+    mc->group.sin_port = htons(atoi(port));
+    if (inet_pton(AF_INET, spec, &mc->group.sin_addr) != 1 ||
+	!IN_MULTICAST(ntohl(mc->group.sin_addr.s_addr)) || mc->group.sin_port == 0) {
+	fprintf(stderr, "Invalid multicast destination %s:%s\n", spec, port);
+	return -1;
+    }
+
+    mc->fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (mc->fd < 0) {
+	perror("socket");
+	return -1;
+    }
+    if (setsockopt(mc->fd, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl)) < 0) {
+	perror("setsockopt");
+    }
+    if (ifaddr) {
+	if (inet_pton(AF_INET, ifaddr, &iface) != 1) {
+	    fprintf(stderr, "Invalid interface address %s\n", ifaddr);
+	    close(mc->fd);
+	    mc->fd = -1;
+	    return -1;
+	}
+	if (setsockopt(mc->fd, IPPROTO_IP, IP_MULTICAST_IF, &iface, sizeof(iface)) < 0) {
+	    perror("setsockopt");
+	}
+    }
+
+    return 0;
+}
+
+/* Sends a batch of records, each as its own datagram, with as few
+ * syscalls as possible. A full socket buffer drops the rest of the batch. */
+static void
+multicast_records(struct multicast *mc, const char *data, size_t len)
+{
+    struct mmsghdr msgs[MULTICAST_BATCH];
+    struct iovec iov[MULTICAST_BATCH];
+    size_t pos = 0;
+
+    while (pos < len) {
+	unsigned int count = 0, sent = 0;
+
+	memset(msgs, 0, sizeof(msgs));
+	while (pos < len && count < MULTICAST_BATCH) {
+	    size_t record_len = get_be16(data + pos);
+
+	    iov[count].iov_base = (char *) data + pos;
+	    iov[count].iov_len = record_len;
+	    msgs[count].msg_hdr.msg_iov = &iov[count];
+	    msgs[count].msg_hdr.msg_iovlen = 1;
+	    msgs[count].msg_hdr.msg_name = &mc->group;
+	    msgs[count].msg_hdr.msg_namelen = sizeof(mc->group);
+	    pos += record_len;
+	    count++;
+	}
+
+	while (sent < count) {
+	    int n = sendmmsg(mc->fd, msgs + sent, count - sent, 0);
+
+	    if (n < 0) {
+		if (errno == EINTR) {
+		    continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		    perror("sendmmsg");
+		}
+		mc->dropped += count - sent;
+		break;
+	    }
+	    sent += n;
+	}
+	mc->sent += sent;
+    }
+}
+
+static uint64_t
+realtime_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+struct record_batch {
+    struct hid_device *dev;
+    char data[RECORD_BATCH_SIZE];
+    size_t len;
+};
+
+static void
+add_frame_record(const uint8_t *frame, size_t len, void *user_data)
+{
+    struct record_batch *records = user_data;
+    struct hid_device *dev = records->dev;
+    char *p = records->data + records->len;
+
+    put_be16(p, RECORD_HEADER_LEN + len);
+    p[2] = RECORD_FRAME;
+    p[3] = dev->channel;
+    put_be32(p + 4, dev->history->next_sequence);
+    put_be64(p + 8, dev->recv_time);
+    memcpy(p + RECORD_HEADER_LEN, frame, len);
+    history_add(dev->history, p, RECORD_HEADER_LEN + len);
+    records->len += RECORD_HEADER_LEN + len;
+}
+
+/* Sends a batch of HID payload as is to the raw clients, and the frames
+ * completed by it as records to the framed clients. */
+static void
+dispatch_batch(int efd, struct client_table *clients, struct hid_device *dev,
+	       const char *batch, size_t len)
+{
+    static struct record_batch records;
+
+    broadcast(efd, clients, dev, 0, batch, len);
+
+    records.dev = dev;
+    records.len = 0;
+    frame_parser_feed(&dev->parser, (const uint8_t *) batch, len,
+		      add_frame_record, &records);
+    if (records.len > 0) {
+	broadcast(efd, clients, dev, 1, records.data, records.len);
+	if (g_multicast.fd >= 0) {
+	    multicast_records(&g_multicast, records.data, records.len);
+	}
+    }
+}
+
+/* Builds a status record telling whether the station is attached. Its
+ * sequence is the one the next frame will get. */
+static void
+make_status_record(char *p, const struct hid_device *dev)
+{
+    put_be16(p, RECORD_STATUS_LEN);
+    p[2] = RECORD_STATUS;
+    p[3] = dev->channel;
+    put_be32(p + 4, dev->history->next_sequence);
+    put_be64(p + 8, realtime_us());
+    p[RECORD_HEADER_LEN] = dev->fd >= 0 ? STATUS_ATTACHED : STATUS_DETACHED;
+}
+
+static void
+broadcast_status(int efd, struct client_table *clients, const struct hid_device *dev)
+{
+    char record[RECORD_STATUS_LEN];
+
+    make_status_record(record, dev);
+    broadcast(efd, clients, dev, 1, record, sizeof(record));
+    if (g_multicast.fd >= 0) {
+	multicast_records(&g_multicast, record, sizeof(record));
+    }
+}
+
+static int
+hid_open(int efd, struct hid_device *dev)
+{
+    int fd = open(dev->path, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+
+    if (fd < 0) {
+	if (errno != ENOENT) {
+	    perror("open hid");
+	}
+	return -1;
+    }
+    if (add_fd_to_epoll(efd, fd) < 0) {
+	close(fd);
+	return -1;
+    }
+
+    dev->fd = fd;
+    dev->attaches++;
+    dev->want_write = 0;
+    dev->out_head = 0;
+    dev->out_len = 0;
+    /* a frame can't continue across a reattach */
+    frame_parser_reset(&dev->parser);
+    arm_timer(dev->retry_fd, 0, 0);
+
+    return 0;
+}
+
+/* Gives up the device after an error or its removal. Clients stay
+ * connected; it is reopened as soon as it shows up again, and in any
+ * case tried again every HID_RETRY_INTERVAL seconds in case it stayed. */
+static void
+hid_detach(int efd, struct client_table *clients, struct hid_device *dev)
+{
+    if (dev->fd < 0) {
+	return;
+    }
+
+    fprintf(stderr, "Lost %s\n", dev->path);
+    close(dev->fd);
+    dev->fd = -1;
+    dev->detaches++;
+    hid_stop_timers(dev);
+    arm_timer(dev->retry_fd, HID_RETRY_INTERVAL * 1000, HID_RETRY_INTERVAL * 1000);
+    broadcast_status(efd, clients, dev);
+}
+
+static void
+hid_attach(int efd, struct client_table *clients, struct hid_device *dev)
+{
+    if (dev->fd >= 0 || hid_open(efd, dev) < 0) {
+	return;
+    }
+
+    printf("Opened %s\n", dev->path);
+    broadcast_status(efd, clients, dev);
+    if (clients->count > 0 && hid_start_timers(efd, dev) < 0) {
+	hid_detach(efd, clients, dev);
+    }
+}
+
+/* Reads the inotify events of the device directories, and tries to open
+ * a missing device when its node was created or its permissions changed. */
+static int
+handle_dev_events(int efd, int inotify_fd, struct client_table *clients,
+		  struct hid_device *devs, int ndevs)
+{
+    char buf[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+
+    while (1) {
+	ssize_t n = read(inotify_fd, buf, sizeof(buf));
+	char *p;
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		break;
+	    }
+	    perror("read inotify");
+	    return -1;
+	}
+
+	for (p = buf; p < buf + n; ) {
+	    struct inotify_event *event = (struct inotify_event *) p;
+	    int i;
+
+	    for (i = 0; i < ndevs && event->len > 0; i++) {
+		if (event->wd == devs[i].watch && strcmp(event->name, devs[i].name) == 0) {
+		    hid_attach(efd, clients, &devs[i]);
+		}
+	    }
+	    p += sizeof(struct inotify_event) + event->len;
+	}
+    }
+
+    return 0;
+}
+
+/* Watches the directory of the device node; returns the watch descriptor */
+static int
+watch_device_dir(int inotify_fd, const char *path)
+{
+    const char *slash = strrchr(path, '/');
+    char dir[PATH_MAX];
+    int wd;
+
+    if (!slash) {
+	strcpy(dir, ".");
+    } else if (slash == path) {
+	strcpy(dir, "/");
+    } else {
+	snprintf(dir, sizeof(dir), "%.*s", (int) (slash - path), path);
+    }
+
+    wd = inotify_add_watch(inotify_fd, dir, IN_CREATE | IN_ATTRIB | IN_MOVED_TO);
+    if (wd < 0) {
+	perror("inotify_add_watch");
+    }
+
+    return wd;
+}
+
+/* Sends the history records the client asked for, as far as its buffer
+ * takes them, and goes on when it has drained. Once the client has seen
+ * everything, it gets live records from broadcast(). */
+static int
+client_catch_up(int efd, struct client *cl, struct history *hist)
+{
+    while (cl->catching_up) {
+	const struct history_entry *entry;
+	size_t queued = 0;
+
+	if (!history_get(hist, cl->next_sequence) && cl->next_sequence != hist->next_sequence) {
+	    /* overwritten while the client was catching up */
+	    fprintf(stderr, "Client on descriptor %d missed frames %u to %u\n",
+		    cl->fd, cl->next_sequence, history_oldest(hist) - 1);
+	    cl->next_sequence = history_oldest(hist);
+	}
+
+	while ((entry = history_get(hist, cl->next_sequence)) &&
+	       cl->len + entry->len <= g_client_bufsize) {
+	    if (client_wants(cl, entry->record[RECORD_HEADER_LEN + 1])) {
+		client_queue(cl, entry->record, entry->len);
+		queued++;
+	    }
+	    cl->next_sequence++;
+	}
+	if (!entry || (queued == 0 && cl->len == 0)) {
+	    /* up to date, or the buffer is too small for any record */
+	    cl->catching_up = 0;
+	}
+
+	if (client_flush(efd, cl) < 0) {
+	    return -1;
+	}
+	if (cl->want_write) {
+	    /* resumed on EPOLLOUT */
+	    break;
+	}
+    }
+
+    return 0;
+}
+
+static void
+start_catch_up(struct client *cl, struct history *hist, uint32_t after)
+{
+    /* distance from the newest record; a client that is ahead of us saw
+     * a previous run whose history we lost, so it gets all there is */
+    uint32_t missed = hist->next_sequence - 1 - after;
+
+    history_expire(hist, realtime_us());
+    if (missed == 0 || hist->count == 0) {
+	return;
+    }
+
+    if (missed <= hist->count) {
+	cl->next_sequence = after + 1;
+    } else {
+	if (after + 1 != history_oldest(hist)) {
+	    fprintf(stderr, "History for client on descriptor %d starts at %u, "
+		    "it asked for %u\n", cl->fd, history_oldest(hist), after + 1);
+	}
+	cl->next_sequence = history_oldest(hist);
+    }
+    cl->catching_up = 1;
+}
+
+/* Parses a comma separated list of hex message types (e.g. "42,48") into
+ * the client's subscription. */
+static int
+parse_types(struct client *cl, const char *list)
+{
+    memset(cl->types, 0, sizeof(cl->types));
+    while (*list) {
+	char *end;
+	unsigned long type = strtoul(list, &end, 16);
+
+	if (end == list || type > 0xff || (*end != ',' && *end != '\0')) {
+	    return -1;
+	}
+	cl->types[type / 8] |= 1 << (type % 8);
+	list = *end ? end + 1 : end;
+    }
+    cl->filtered = 1;
+
+    return 0;
+}
+
+/* Framed clients send "STREAM [after=<sequence>] [types=<list>]". Raw
+ * clients may send "SUBSCRIBE <list>", after which they only get frames
+ * of those types (with start marker) instead of the raw byte stream;
+ * anything else they send is ignored, as it always was. */
+static int
+handle_client_request(struct client *cl, struct hid_device *devs, int ndevs, char *line)
+{
+    char *saveptr, *token, *end;
+    unsigned long after = 0;
+    int catch_up = 0, i;
+
+    token = strtok_r(line, " ", &saveptr);
+    if (!token) {
+	return 0;
+    }
+
+    if (!cl->framed) {
+	if (strcmp(token, "SUBSCRIBE") == 0) {
+	    token = strtok_r(NULL, " ", &saveptr);
+	    if (!token || parse_types(cl, token) < 0) {
+		fprintf(stderr, "Invalid subscription from descriptor %d\n", cl->fd);
+		return -1;
+	    }
+	}
+	return 0;
+    }
 
-static int g_running = 1;
+    if (strcmp(token, "STREAM") != 0) {
+	fprintf(stderr, "Unknown request '%s' from descriptor %d\n", token, cl->fd);
+	return 0;
+    }
+
+    while ((token = strtok_r(NULL, " ", &saveptr)) != NULL) {
+	if (strncmp(token, "after=", 6) == 0) {
+	    after = strtoul(token + 6, &end, 10);
+	    if (end == token + 6 || *end != '\0') {
+		goto invalid;
+	    }
+	    catch_up = 1;
+	} else if (strncmp(token, "types=", 6) == 0) {
+	    if (parse_types(cl, token + 6) < 0) {
+		goto invalid;
+	    }
+	} else {
+	    goto invalid;
+	}
+    }
+
+    cl->streaming = 1;
+    for (i = 0; i < ndevs; i++) {
+	char record[RECORD_STATUS_LEN];
+
+	if (devs[i].fd >= 0) {
+	    continue;
+	}
+	make_status_record(record, &devs[i]);
+	if (client_queue(cl, record, sizeof(record)) < 0) {
+	    return -1;
+	}
+    }
+    if (catch_up) {
+	/* the history is shared by all devices */
+	start_catch_up(cl, devs->history, after);
+    }
+    return 0;
+
+invalid:
+    fprintf(stderr, "Invalid request parameter '%s' from descriptor %d\n", token, cl->fd);
+    return -1;
+}
 
+/* Splits client input into request lines. Returns -1 if the client
+ * should be dropped. */
 static int
-create_and_bind_socket(char *port)
+handle_client_input(struct client *cl, struct hid_device *devs, int ndevs,
+		    const char *data, size_t len)
 {
-    struct addrinfo hints;
-    struct addrinfo *result, *rp;
-    int s, sfd;
-
-    memset(&hints, 0, sizeof (struct addrinfo));
-    hints.ai_family = AF_UNSPEC;     /* Return IPv4 and IPv6 choices */
-    hints.ai_socktype = SOCK_STREAM; /* We want a TCP socket */
-    hints.ai_flags = AI_PASSIVE;     /* FIXME: All interfaces */
+    size_t i;
 
-    s = getaddrinfo(NULL, port, &hints, &result);
-    if (s != 0) {
-	fprintf (stderr, "getaddrinfo: %s\n", gai_strerror(s));
-	return -1;
+    for (i = 0; i < len; i++) {
+	if (data[i] == '\n') {
+	    cl->request[cl->request_len] = '\0';
+	    if (cl->request_len > 0 && cl->request[cl->request_len - 1] == '\r') {
+		cl->request[cl->request_len - 1] = '\0';
+	    }
+	    cl->request_len = 0;
+	    if (handle_client_request(cl, devs, ndevs, cl->request) < 0) {
+		return -1;
+	    }
+	} else if (cl->request_len == CLIENT_REQUEST_MAX - 1) {
+	    if (!cl->framed) {
+		/* not a request */
+		cl->request_len = 0;
+		continue;
+	    }
+	    fprintf(stderr, "Request from descriptor %d too long\n", cl->fd);
+	    return -1;
+	} else {
+	    cl->request[cl->request_len++] = data[i];
+	}
     }
 
-    for (rp = result; rp != NULL; rp = rp->ai_next) {
-	int opt = 1;
+    return 0;
+}
 
-	sfd = socket(rp->ai_family, rp->ai_socktype, rp->ai_protocol);
-	if (sfd == -1) {
-	    continue;
+static int
+accept_clients(int efd, int listenfd, struct hid_device *raw_dev,
+	       struct client_table *clients, struct hid_device *devs, int ndevs)
+{
+    while (1) {
+	struct sockaddr in_addr;
+	socklen_t in_len;
+	int infd, s, i;
+	char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
+
+	in_len = sizeof(in_addr);
+	infd = accept(listenfd, &in_addr, &in_len);
+	if (infd == -1) {
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		/* We have processed all incoming
+		 * connections. */
+		break;
+	    } else {
+		perror("accept");
+		break;
+	    }
 	}
 
-	if (setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (char *)&opt, sizeof(opt)) == -1) {
-	    perror("setsockopt");
-	} else if (bind(sfd, rp->ai_addr, rp->ai_addrlen) < 0) {
-	    perror("bind");
-	} else {
-	    /* We managed to bind successfully! */
-	    break;
+	s = getnameinfo(&in_addr, in_len, hbuf, sizeof(hbuf),
+			sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
+	if (s == 0) {
+	    printf("Accepted %sconnection on descriptor %d "
+		   "(host=%s, port=%s)\n", raw_dev ? "" : "framed ", infd, hbuf, sbuf);
 	}
 
-	close(sfd);
-    }
+	/* Make the incoming socket non-blocking and add it to the
+	 * list of fds to monitor. */
+	s = make_fd_non_blocking(infd);
+	if (s == -1) {
+	    close(infd);
+	    continue;
+	}
 
-    if (rp == NULL) {
-	fprintf(stderr, "Could not bind\n");
-	return -1;
+	if (add_fd_to_epoll(efd, infd) < 0) {
+	    close(infd);
+	    continue;
+	}
+	if (!add_client(clients, infd, raw_dev)) {
+	    fprintf(stderr, "Out of memory for client on descriptor %d\n", infd);
+	    close(infd);
+	    continue;
+	}
+	g_stats.clients_accepted++;
+	for (i = 0; i < ndevs; i++) {
+	    struct hid_device *dev = &devs[i];
+
+	    if (dev->fd >= 0 && !dev->timers_active && hid_start_timers(efd, dev) < 0) {
+		hid_detach(efd, clients, dev);
+	    }
+	}
     }
 
-   freeaddrinfo(result);
-   return sfd;
+    return 0;
 }
 
-static int
-make_fd_non_blocking (int fd)
+static void
+write_stats(FILE *f, struct client_table *clients, struct hid_device *devs, int ndevs,
+	    struct history *hist)
 {
-    int flags, s;
+    int i;
 
-    flags = fcntl(fd, F_GETFL, 0);
-    if (flags == -1) {
-	perror("fcntl");
-	return -1;
+    fprintf(f, "wakeups %lu\n", g_stats.wakeups);
+    fprintf(f, "events %lu\n", g_stats.events);
+    fprintf(f, "clients %d\n", clients->count);
+    fprintf(f, "clients_accepted %lu\n", g_stats.clients_accepted);
+    fprintf(f, "clients_closed %lu\n", g_stats.clients_closed);
+    fprintf(f, "slow_disconnects %lu\n", g_stats.slow_disconnects);
+    fprintf(f, "bytes_dropped %lu\n", g_stats.bytes_dropped);
+    fprintf(f, "snapshots %lu\n", g_stats.snapshots);
+    fprintf(f, "history.count %zu\n", hist->count);
+    fprintf(f, "history.oldest %u\n", history_oldest(hist));
+    fprintf(f, "history.next %u\n", hist->next_sequence);
+    if (g_multicast.fd >= 0) {
+	fprintf(f, "multicast.sent %lu\n", g_multicast.sent);
+	fprintf(f, "multicast.dropped %lu\n", g_multicast.dropped);
     }
 
-    flags |= O_NONBLOCK;
-    s = fcntl(fd, F_SETFL, flags);
-    if (s == -1) {
-	perror("fcntl");
-	return -1;
+    for (i = 0; i < ndevs; i++) {
+	const struct hid_device *dev = &devs[i];
+
+	fprintf(f, "device.%d.path %s\n", i, dev->path);
+	fprintf(f, "device.%d.attached %d\n", i, dev->fd >= 0);
+	fprintf(f, "device.%d.attaches %lu\n", i, dev->attaches);
+	fprintf(f, "device.%d.detaches %lu\n", i, dev->detaches);
+	fprintf(f, "device.%d.reports %lu\n", i, dev->reports);
+	fprintf(f, "device.%d.short_reports %lu\n", i, dev->short_reports);
+	fprintf(f, "device.%d.invalid_reports %lu\n", i, dev->invalid_reports);
+	fprintf(f, "device.%d.bytes %lu\n", i, dev->bytes);
+	fprintf(f, "device.%d.frames %lu\n", i, dev->parser.frames);
+	fprintf(f, "device.%d.checksum_failures %lu\n", i, dev->parser.checksum_failures);
+	fprintf(f, "device.%d.length_errors %lu\n", i, dev->parser.length_errors);
+	fprintf(f, "device.%d.resyncs %lu\n", i, dev->parser.resyncs);
+	fprintf(f, "device.%d.heartbeats %lu\n", i, dev->heartbeats);
+	fprintf(f, "device.%d.resets %lu\n", i, dev->resets);
     }
 
-    return 0;
+    for (i = 0; i < clients->count; i++) {
+	const struct client *cl = clients->clients[i];
+	const char *kind = cl->framed ? "framed" : "raw";
+
+	fprintf(f, "client.%d.kind %s\n", cl->fd, kind);
+	if (!cl->framed) {
+	    fprintf(f, "client.%d.device %d\n", cl->fd, cl->dev->channel);
+	}
+	fprintf(f, "client.%d.sent %lu\n", cl->fd, cl->sent);
+	fprintf(f, "client.%d.queued %zu\n", cl->fd, cl->len);
+	fprintf(f, "client.%d.dropped %lu\n", cl->fd, cl->dropped);
+    }
 }
 
-static int
-write_exact(int fd, const char *buf, ssize_t len)
+/* Answers each connection to the stats port with a snapshot of the
+ * counters, one "name value" line each, and closes it. Nothing is read
+ * from the connection, and the snapshot is written without blocking;
+ * it easily fits into the socket buffer, and is cut short otherwise. */
+static void
+serve_stats(int listenfd, struct client_table *clients, struct hid_device *devs, int ndevs,
+	    struct history *hist)
 {
-    ssize_t written = 0;
+    while (1) {
+	int infd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	char *text = NULL;
+	size_t len = 0;
+	FILE *f;
 
-    while (written < len) {
-	ssize_t n = write(fd, buf, len - written);
+	if (infd < 0) {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept");
+	    }
+	    return;
+	}
 
-	if (n < 0) {
-	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+	g_stats.snapshots++;
+	f = open_memstream(&text, &len);
+	if (f) {
+	    write_stats(f, clients, devs, ndevs, hist);
+	    fclose(f);
+	    if (send(infd, text, len, MSG_NOSIGNAL) < 0) {
+		perror("write stats");
+	    }
+	}
+	free(text);
+	close(infd);
+    }
+}
+
+/* Reads HID reports until the device has none left, which is required in
+ * edge-triggered mode, and appends their payload to the batch buffer.
+ * Returns -1 if the device failed. */
+static int
+read_hid_reports(struct hid_device *dev, char *batch, size_t *batch_len)
+{
+    while (*batch_len + HID_REPORT_SIZE - 1 <= HID_BATCH_SIZE) {
+	char buf[HID_REPORT_SIZE];
+	ssize_t count = read(dev->fd, buf, sizeof(buf));
+
+	if (count < 0) {
+	    if (errno == EINTR) {
 		continue;
 	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 0;
+	    }
+	    perror("read hid");
 	    return -1;
-	} else if (n == 0) {
+	} else if (count == 0) {
 	    return 0;
+	}
+
+	dev->reports++;
+	if (count == HID_REPORT_SIZE) {
+	    /* unsigned, so a corrupt length byte can't pass the check;
+	     * a report always carries at least one byte */
+	    int length = (unsigned char) buf[0];
+	    if (length > 0 && length < HID_REPORT_SIZE) {
+		memcpy(batch + *batch_len, buf + 1, length);
+		*batch_len += length;
+		dev->bytes += length;
+	    } else {
+		dev->invalid_reports++;
+	    }
 	} else {
-	    buf += n;
-	    written += n;
+	    dev->short_reports++;
 	}
     }
 
-    return written;
+    /* batch full; the caller sends it and calls us again */
+    return 1;
 }
 
-static int
-send_hmr_reset(int fd)
+/* Finds the device a descriptor belongs to, be it the device itself, its
+ * raw data listener or one of its timers. */
+static struct hid_device *
+find_device(struct hid_device *devs, int ndevs, int fd)
 {
-    static const char reset[] = { 0x20, 0x00, 0x08, 0x01, 0x00, 0x00, 0x00, 0x00 };
-    return write_exact(fd, reset, sizeof(reset));
-}
+    int i;
 
-static int
-send_hmr_heartbeat(int fd)
-{
-    static const char heartbeat[] = { 0x01, 0xd0, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
-    return write_exact(fd, heartbeat, sizeof(heartbeat));
+    for (i = 0; i < ndevs; i++) {
+	struct hid_device *dev = &devs[i];
+
+	if (dev->fd == fd || dev->listen_fd == fd || dev->heartbeat_fd == fd ||
+	    dev->reset_fd == fd || dev->retry_fd == fd) {
+	    return dev;
+	}
+    }
+
+    return NULL;
 }
 
 static int
-add_fd_to_epoll(int efd, int fd)
+setup_device(int efd, int inotify_fd, struct hid_device *dev)
 {
-    struct epoll_event event;
+    dev->heartbeat_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    dev->reset_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    dev->retry_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (dev->heartbeat_fd < 0 || dev->reset_fd < 0 || dev->retry_fd < 0) {
+	perror("timerfd_create");
+	return -1;
+    }
 
-    event.data.fd = fd;
-    event.events = EPOLLIN | EPOLLET;
-    if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) < 0) {
-	perror("epoll_ctl");
+    dev->watch = watch_device_dir(inotify_fd, dev->path);
+    if (dev->watch < 0) {
 	return -1;
     }
 
+    if (add_fd_to_epoll(efd, dev->heartbeat_fd) < 0 || add_fd_to_epoll(efd, dev->reset_fd) < 0 ||
+	add_fd_to_epoll(efd, dev->retry_fd) < 0) {
+	return -1;
+    }
+    if (dev->listen_fd >= 0 && add_fd_to_epoll(efd, dev->listen_fd) < 0) {
+	return -1;
+    }
+
+    if (hid_open(efd, dev) < 0) {
+	fprintf(stderr, "Waiting for %s\n", dev->path);
+	arm_timer(dev->retry_fd, HID_RETRY_INTERVAL * 1000, HID_RETRY_INTERVAL * 1000);
+    }
+
     return 0;
 }
 
 static void
-remove_client(int fd, int *clientfds, int *client_count)
+cleanup_device(struct hid_device *dev)
+{
+    if (dev->fd >= 0) {
+	close(dev->fd);
+	dev->fd = -1;
+    }
+    if (dev->heartbeat_fd >= 0) {
+	close(dev->heartbeat_fd);
+    }
+    if (dev->reset_fd >= 0) {
+	close(dev->reset_fd);
+    }
+    if (dev->retry_fd >= 0) {
+	close(dev->retry_fd);
+    }
+    dev->heartbeat_fd = dev->reset_fd = dev->retry_fd = -1;
+    dev->timers_active = 0;
+}
+
+/* Reads what the device has, and passes it on. */
+static void
+handle_device_input(int efd, struct client_table *clients, struct hid_device *dev)
 {
-    int cl, clnext;
+    /* shared by all devices */
+    static char batch[HID_BATCH_SIZE];
+    size_t batch_len = 0;
+    int s;
 
-    close (fd);
-    for (cl = 0; cl < *client_count; cl++) {
-	if (fd == clientfds[cl]) {
-	    for (clnext = cl + 1; clnext < *client_count; clnext++) {
-		clientfds[cl] = clientfds[clnext];
-	    }
-	    (*client_count)--;
-	    break;
-	}
+    clock_gettime(CLOCK_MONOTONIC, &dev->last_recv);
+    dev->recv_time = realtime_us();
+
+    /* send everything read in this wakeup with one write per client */
+    while ((s = read_hid_reports(dev, batch, &batch_len)) > 0) {
+	dispatch_batch(efd, clients, dev, batch, batch_len);
+	batch_len = 0;
+    }
+    if (batch_len > 0) {
+	dispatch_batch(efd, clients, dev, batch, batch_len);
+    }
+    if (s < 0) {
+	hid_detach(efd, clients, dev);
     }
 }
 
 static void
-event_loop(int sockfd, int hidfd)
+event_loop(struct hid_device *devs, int ndevs, int framed_sockfd, int stats_sockfd,
+	   struct history *hist)
 {
-    int efd, i, s;
+    int efd, i, flush_fd = -1, inotify_fd = -1;
     struct epoll_event events[MAXEVENTS];
-    struct timeval last_recv, last_heartbeat;
-    int clientfds[MAXCLIENTS];
-    int client_count = 0;
+    struct client_table clients;
+    sigset_t term_mask, wait_mask;
+
+    /* only let SIGINT/SIGTERM in while waiting, so they always interrupt
+     * epoll and the history is written out before exiting */
+    sigemptyset(&term_mask);
+    sigaddset(&term_mask, SIGINT);
+    sigaddset(&term_mask, SIGTERM);
+    sigprocmask(SIG_BLOCK, &term_mask, &wait_mask);
+
+    memset(&clients, 0, sizeof(clients));
 
     efd = epoll_create1(0);
     if (efd == -1) {
@@ -193,129 +1489,135 @@ event_loop(int sockfd, int hidfd)
 	goto out;
     }
 
-    if (add_fd_to_epoll(efd, hidfd) < 0 || add_fd_to_epoll(efd, sockfd) < 0) {
+    inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (inotify_fd < 0) {
+	perror("inotify_init");
+	goto out;
+    }
+    if (add_fd_to_epoll(efd, inotify_fd) < 0) {
+	goto out;
+    }
+    if (framed_sockfd >= 0 && add_fd_to_epoll(efd, framed_sockfd) < 0) {
+	goto out;
+    }
+    if (stats_sockfd >= 0 && add_fd_to_epoll(efd, stats_sockfd) < 0) {
 	goto out;
     }
+    if (hist->fd >= 0) {
+	/* the history is written in batches; make sure a quiet station
+	 * doesn't keep the last ones in memory for too long */
+	flush_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (flush_fd < 0) {
+	    perror("timerfd_create");
+	    goto out;
+	}
+	if (add_fd_to_epoll(efd, flush_fd) < 0 ||
+	    arm_timer(flush_fd, HISTORY_FLUSH_INTERVAL * 1000, HISTORY_FLUSH_INTERVAL * 1000) < 0) {
+	    goto out;
+	}
+    }
+
+    for (i = 0; i < ndevs; i++) {
+	if (setup_device(efd, inotify_fd, &devs[i]) < 0) {
+	    goto out;
+	}
+    }
 
     memset(events, 0, sizeof(events));
-    memset(&last_recv, 0, sizeof(last_recv));
-    memset(&last_heartbeat, 0, sizeof(last_heartbeat));
 
-    /* The event loop */
+    /* The event loop; all timing is done by the timers, so there's
+     * no need to wake up while nothing happens */
     while (1) {
 	int n, item;
 
-	n = epoll_wait (efd, events, MAXEVENTS, 2000);
+	n = epoll_pwait(efd, events, MAXEVENTS, -1, &wait_mask);
 	if (n < 0) {
 	    if (errno != EINTR) {
 		perror("epoll_wait");
 	    }
 	    goto out;
 	}
-
-	if (client_count > 0) {
-	    struct timeval now;
-
-	    gettimeofday(&now, NULL);
-	    if (now.tv_sec - last_recv.tv_sec > RESET_TIMEOUT) {
-		send_hmr_reset(hidfd);
-		last_recv = now;
-	    }
-	    if (now.tv_sec - last_heartbeat.tv_sec > HEARTBEAT_INTERVAL) {
-		send_hmr_heartbeat(hidfd);
-		last_heartbeat = now;
-	    }
-	}
+	g_stats.wakeups++;
+	g_stats.events += n;
 
 	for (item = 0; item < n; item++) {
 	    struct epoll_event *ev = &events[item];
+	    struct hid_device *dev = find_device(devs, ndevs, ev->data.fd);
 
-	    if (ev->events & (EPOLLERR | EPOLLHUP)) {
+	    if (dev && dev->fd == ev->data.fd) {
+		if (ev->events & (EPOLLERR | EPOLLHUP)) {
+		    hid_detach(efd, &clients, dev);
+		    continue;
+		}
+		if ((ev->events & EPOLLOUT) && hid_flush(efd, dev) < 0) {
+		    hid_detach(efd, &clients, dev);
+		    continue;
+		}
+		if (ev->events & EPOLLIN) {
+		    handle_device_input(efd, &clients, dev);
+		}
+	    } else if (ev->events & (EPOLLERR | EPOLLHUP)) {
 		fprintf (stderr, "epoll error\n");
-		if (ev->data.fd == sockfd || ev->data.fd == hidfd) {
+		if (ev->data.fd == framed_sockfd || ev->data.fd == stats_sockfd ||
+		    (dev && ev->data.fd == dev->listen_fd)) {
 		    goto out;
 		} else {
-		    remove_client(ev->data.fd, clientfds, &client_count);
+		    struct client *cl = find_client(&clients, ev->data.fd);
+		    if (cl) {
+			remove_client(&clients, cl);
+		    }
 		    continue;
 		}
-	    } else if (sockfd == ev->data.fd) {
-		/* We have a notification on the listening socket, which
+	    } else if (framed_sockfd == ev->data.fd || (dev && dev->listen_fd == ev->data.fd)) {
+		/* We have a notification on a listening socket, which
 		 * means one or more incoming connections. */
-		while (1) {
-		    struct sockaddr in_addr;
-		    socklen_t in_len;
-		    int infd;
-		    char hbuf[NI_MAXHOST], sbuf[NI_MAXSERV];
-
-		    in_len = sizeof(in_addr);
-		    infd = accept(sockfd, &in_addr, &in_len);
-		    if (infd == -1) {
-			if (errno == EAGAIN || errno == EWOULDBLOCK) {
-			    /* We have processed all incoming
-			     * connections. */
-			    break;
-			} else {
-			    perror("accept");
-			    break;
-			}
-		    }
-
-		    s = getnameinfo(&in_addr, in_len, hbuf, sizeof(hbuf),
-				    sbuf, sizeof(sbuf), NI_NUMERICHOST | NI_NUMERICSERV);
-		    if (s == 0) {
-			printf("Accepted connection on descriptor %d "
-			       "(host=%s, port=%s)\n", infd, hbuf, sbuf);
-		    }
-
-		    /* Make the incoming socket non-blocking and add it to the
-		     * list of fds to monitor. */
-		    s = make_fd_non_blocking(infd);
-		    if (s == -1) {
-			close(infd);
-			continue;
-		    }
+		if (accept_clients(efd, ev->data.fd, ev->data.fd == framed_sockfd ? NULL : dev,
+				   &clients, devs, ndevs) < 0) {
+		    goto out;
+		}
+	    } else if (stats_sockfd >= 0 && stats_sockfd == ev->data.fd) {
+		serve_stats(stats_sockfd, &clients, devs, ndevs, hist);
+	    } else if (dev && (dev->heartbeat_fd == ev->data.fd || dev->reset_fd == ev->data.fd)) {
+		if (hid_handle_timer(efd, dev, ev->data.fd) < 0) {
+		    hid_detach(efd, &clients, dev);
+		}
+	    } else if (dev && dev->retry_fd == ev->data.fd) {
+		uint64_t expirations;
 
-		    if (add_fd_to_epoll(efd, infd) < 0) {
-			close(infd);
-			continue;
-		    }
-		    if (client_count < MAXCLIENTS) {
-			if (client_count == 0) {
-			    send_hmr_reset(hidfd);
-			    send_hmr_heartbeat(hidfd);
-			    gettimeofday(&last_recv, NULL);
-			    last_heartbeat = last_recv;
-			}
-			clientfds[client_count++] = infd;
-		    }
+		if (read(dev->retry_fd, &expirations, sizeof(expirations)) > 0) {
+		    hid_attach(efd, &clients, dev);
 		}
-	    } else if (hidfd == ev->data.fd) {
-		char buf[8];
-		ssize_t count = read(hidfd, buf, sizeof(buf));
-
-		gettimeofday(&last_recv, NULL);
-		if (count == 8) {
-		    int cl, length = buf[0];
-		    if (length < 8) {
-			for (cl = 0; cl < client_count; ) {
-			    if (write_exact(clientfds[cl], buf + 1, length) < 0) {
-				remove_client(clientfds[cl], clientfds, &client_count);
-				/* keep cl, as remove_client shifted the array */
-			    } else {
-				cl++;
-			    }
-			}
-		    }
+	    } else if (inotify_fd == ev->data.fd) {
+		if (handle_dev_events(efd, inotify_fd, &clients, devs, ndevs) < 0) {
+		    goto out;
+		}
+	    } else if (flush_fd == ev->data.fd) {
+		uint64_t expirations;
+
+		if (read(flush_fd, &expirations, sizeof(expirations)) > 0) {
+		    history_flush(hist);
 		}
 	    } else {
-		/* We have data on the fd waiting to be read. Read and
-		 * discard it. We must read whatever data is available
-		 * completely, as we are running in edge-triggered mode
-		 * and won't get a notification again for the same
+		/* We have data on the fd waiting to be read. Read it
+		 * and look for requests. We must read whatever data is
+		 * available completely, as we are running in edge-triggered
+		 * mode and won't get a notification again for the same
 		 * data. */
+		struct client *cl = find_client(&clients, ev->data.fd);
 		int done = 0;
 
-		while (1) {
+		if (!cl) {
+		    continue;
+		}
+		if ((ev->events & EPOLLOUT) && client_flush(efd, cl) < 0) {
+		    done = 1;
+		}
+		if (!done && !cl->want_write && cl->catching_up &&
+		    client_catch_up(efd, cl, hist) < 0) {
+		    done = 1;
+		}
+
+		while (!done && (ev->events & EPOLLIN)) {
 		    ssize_t count;
 		    char buf[512];
 
@@ -332,23 +1634,46 @@ event_loop(int sockfd, int hidfd)
 			/* End of file. The remote has closed the connection */
 			done = 1;
 			break;
+		    } else if (handle_client_input(cl, devs, ndevs, buf, count) < 0) {
+			done = 1;
 		    }
 		}
+		/* send replies to requests, or go on with the history */
+		if (!done && !cl->want_write &&
+		    (cl->catching_up ? client_catch_up(efd, cl, hist) : client_flush(efd, cl)) < 0) {
+		    done = 1;
+		}
 
 		if (done) {
 		    printf ("Closed connection on descriptor %d\n", ev->data.fd);
 		    /* Closing the descriptor will make epoll remove it
 		     * from the set of descriptors which are monitored. */
-		    remove_client(ev->data.fd, clientfds, &client_count);
+		    remove_client(&clients, cl);
+		}
+	    }
+	}
+
+	if (clients.count == 0) {
+	    for (i = 0; i < ndevs; i++) {
+		if (devs[i].timers_active) {
+		    hid_stop_timers(&devs[i]);
 		}
 	    }
 	}
     }
 
 out:
-    for (i = 0; i < client_count; i++) {
-	close(clientfds[i]);
+    free_clients(&clients);
+    for (i = 0; i < ndevs; i++) {
+	cleanup_device(&devs[i]);
+    }
+    if (inotify_fd >= 0) {
+	close(inotify_fd);
     }
+    if (flush_fd >= 0) {
+	close(flush_fd);
+    }
+    sigprocmask(SIG_SETMASK, &wait_mask, NULL);
     if (efd >= 0) {
 	close(efd);
     }
@@ -357,7 +1682,36 @@ out:
 static void
 usage(const char *program)
 {
-    fprintf(stderr, "Usage: %s [-f] [-p port] [-P pidfile] devicename\n", program);
+    fprintf(stderr, "Usage: %s [-f] [-p port] [-F framed-port] [-P pidfile] [-b bufsize] "
+	    "[-s disconnect|drop] [-H frames] [-A minutes] [-S historyfile] "
+	    "[-M group:port] [-m interface-address] [-T stats-port] devicename[:port]...\n", program);
+}
+
+/* Parses "path[:port]". Devices without a port of their own are only
+ * served on the framed port, except for the first one, which gets the
+ * default port for compatibility. */
+static int
+parse_device(struct hid_device *dev, char *spec, int channel, char *default_port)
+{
+    char *colon = strrchr(spec, ':');
+
+    memset(dev, 0, sizeof(*dev));
+    dev->fd = dev->listen_fd = dev->watch = -1;
+    dev->heartbeat_fd = dev->reset_fd = dev->retry_fd = -1;
+    dev->channel = channel;
+    dev->port = default_port;
+
+    if (colon) {
+	*colon = '\0';
+	dev->port = colon + 1;
+	if (*dev->port == '\0') {
+	    return -1;
+	}
+    }
+    dev->path = spec;
+    dev->name = strrchr(spec, '/') ? strrchr(spec, '/') + 1 : spec;
+
+    return 0;
 }
 
 static void
@@ -369,14 +1723,22 @@ handle_sigterm(int signal)
 int
 main (int argc, char *argv[])
 {
-    int opt, hidfd, sfd = -1;
+    int opt, i, ndevs, framed_sfd = -1, stats_sfd = -1;
     int daemonize = 1;
     char *port = "9876";
+    char *framed_port = NULL;
     char *pid_path = NULL;
-    char *hid_path = NULL;
+    struct hid_device *devs;
     int pidfd = -1;
+    size_t history_frames = HISTORY_FRAMES;
+    unsigned int history_minutes = 0;
+    char *history_path = NULL;
+    struct history hist;
+    char *multicast_spec = NULL;
+    char *multicast_if = NULL;
+    char *stats_port = NULL;
 
-    while ((opt = getopt(argc, argv, "fp:P:d:")) != -1) {
+    while ((opt = getopt(argc, argv, "fp:F:P:d:b:s:H:A:S:M:m:T:")) != -1) {
 	switch (opt) {
 	    case 'f':
 		daemonize = 0;
@@ -384,20 +1746,70 @@ main (int argc, char *argv[])
 	    case 'p':
 		port = optarg;
 		break;
+	    case 'F':
+		framed_port = optarg;
+		break;
 	    case 'P':
 		pid_path = optarg;
 		break;
+	    case 'b':
+		g_client_bufsize = strtoul(optarg, NULL, 0);
+		if (g_client_bufsize == 0) {
+		    usage(argv[0]);
+		    exit(EXIT_FAILURE);
+		}
+		break;
+	    case 's':
+		if (strcmp(optarg, "disconnect") == 0) {
+		    g_slow_client_policy = SLOW_CLIENT_DISCONNECT;
+		} else if (strcmp(optarg, "drop") == 0) {
+		    g_slow_client_policy = SLOW_CLIENT_DROP_OLDEST;
+		} else {
+		    usage(argv[0]);
+		    exit(EXIT_FAILURE);
+		}
+		break;
+	    case 'H':
+		history_frames = strtoul(optarg, NULL, 0);
+		break;
+	    case 'A':
+		history_minutes = strtoul(optarg, NULL, 0);
+		break;
+	    case 'S':
+		history_path = optarg;
+		break;
+	    case 'M':
+		multicast_spec = optarg;
+		break;
+	    case 'm':
+		multicast_if = optarg;
+		break;
+	    case 'T':
+		stats_port = optarg;
+		break;
 	    default:
 		usage(argv[0]);
 		exit(EXIT_FAILURE);
 	}
     }
 
-    if (optind >= argc) {
+    /* channels are a byte in the records */
+    ndevs = argc - optind;
+    if (ndevs < 1 || ndevs > 256) {
 	usage(argv[0]);
 	exit(EXIT_FAILURE);
     }
-    hid_path = argv[optind];
+    devs = calloc(ndevs, sizeof(*devs));
+    if (!devs) {
+	perror("calloc");
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ndevs; i++) {
+	if (parse_device(&devs[i], argv[optind + i], i, i == 0 ? port : NULL) < 0) {
+	    usage(argv[0]);
+	    exit(EXIT_FAILURE);
+	}
+    }
 
     if (pid_path) {
 	/* open pidfile */
@@ -434,32 +1846,55 @@ main (int argc, char *argv[])
     signal(SIGINT, handle_sigterm);
     signal(SIGTERM, handle_sigterm);
 
+    /* the history outlives device and listener failures */
+    if (history_init(&hist, history_frames, history_minutes, history_path) < 0) {
+	fprintf(stderr, "Could not set up history\n");
+	exit(EXIT_FAILURE);
+    }
+    if (multicast_spec && open_multicast(&g_multicast, multicast_spec, multicast_if) < 0) {
+	exit(EXIT_FAILURE);
+    }
+    for (i = 0; i < ndevs; i++) {
+	devs[i].history = &hist;
+    }
+
+    /* the event loop takes care of the device coming and going by itself,
+     * so we only get here again if listening failed */
     while (1) {
-	int ok = 0;
+	int ok = 1;
 
-	hidfd = open(hid_path, O_RDWR);
-	if (hidfd < 0 || make_fd_non_blocking(hidfd) < 0) {
-	    perror("open hid");
-	} else {
-	    sfd = create_and_bind_socket(port);
-	    if (sfd < 0 || make_fd_non_blocking(sfd) < 0) {
-		perror("open socket");
-	    } else if (listen(sfd, SOMAXCONN) < 0) {
-		perror("listen");
-	    } else {
-		ok = 1;
+	for (i = 0; i < ndevs && ok; i++) {
+	    if (devs[i].port) {
+		devs[i].listen_fd = open_listener(devs[i].port);
+		ok = devs[i].listen_fd >= 0;
 	    }
 	}
+	if (ok && framed_port) {
+	    framed_sfd = open_listener(framed_port);
+	    ok = framed_sfd >= 0;
+	}
+	if (ok && stats_port) {
+	    stats_sfd = open_listener(stats_port);
+	    ok = stats_sfd >= 0;
+	}
 
 	if (ok) {
-	    event_loop(sfd, hidfd);
+	    event_loop(devs, ndevs, framed_sfd, stats_sfd, &hist);
 	}
 
-	if (hidfd >= 0) {
-	    close(hidfd);
+	for (i = 0; i < ndevs; i++) {
+	    if (devs[i].listen_fd >= 0) {
+		close(devs[i].listen_fd);
+		devs[i].listen_fd = -1;
+	    }
 	}
-	if (sfd >= 0) {
-	    close(sfd);
+	if (framed_sfd >= 0) {
+	    close(framed_sfd);
+	    framed_sfd = -1;
+	}
+	if (stats_sfd >= 0) {
+	    close(stats_sfd);
+	    stats_sfd = -1;
 	}
 	if (g_running) {
 	    sleep(10);
@@ -469,6 +1904,12 @@ main (int argc, char *argv[])
 	}
     }
 
+    history_free(&hist);
+    free(devs);
+    if (g_multicast.fd >= 0) {
+	printf("Multicast %lu frames, dropped %lu\n", g_multicast.sent, g_multicast.dropped);
+	close(g_multicast.fd);
+    }
     if (pidfd >= 0) {
 	unlink(pid_path);
     }
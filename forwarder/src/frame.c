@@ -0,0 +1,166 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include "frame.h"
+
+enum {
+    STATE_MARKER1,
+    STATE_MARKER2,
+    STATE_FLAGS,
+    STATE_TYPE,
+    STATE_DATA
+};
+
+int
+wmr_packet_length(uint8_t type)
+{
+    switch (type) {
+	case 0x42: /* temperature/humidity */
+	    return 12;
+	case 0x41: /* rain */
+	    return 17;
+	case 0x46: /* air pressure */
+	    return 8;
+	case 0x48: /* wind */
+	    return 11;
+	case 0x47: /* UV */
+	    return 6;
+	case 0x60: /* date/time */
+	    return 12;
+    }
+
+    return -1;
+}
+
+int
+wmr_checksum_valid(const uint8_t *frame, size_t len)
+{
+    uint16_t sum = 0;
+    size_t i;
+
+    if (len < 4) {
+	return 0;
+    }
+    for (i = 0; i < len - 2; i++) {
+	sum += frame[i];
+    }
+
+    return sum == (frame[len - 2] | (frame[len - 1] << 8));
+}
+
+void
+wmr_set_checksum(uint8_t *frame, size_t len)
+{
+    uint16_t sum = 0;
+    size_t i;
+
+    for (i = 0; i < len - 2; i++) {
+	sum += frame[i];
+    }
+    frame[len - 2] = sum & 0xff;
+    frame[len - 1] = sum >> 8;
+}
+
+void
+frame_parser_init(struct frame_parser *parser)
+{
+    memset(parser, 0, sizeof(*parser));
+    parser->state = STATE_MARKER1;
+}
+
+void
+frame_parser_reset(struct frame_parser *parser)
+{
+    parser->state = STATE_MARKER1;
+    parser->len = 0;
+    parser->rescan_depth = 0;
+}
+
+static void
+frame_parser_resync(struct frame_parser *parser, frame_handler handler, void *user_data)
+{
+    uint8_t discarded[WMR_MAX_FRAME_LEN + 1];
+    size_t len = parser->len + 1;
+
+    /* The second marker byte may have been the first one of the next
+     * frame's marker. Every rescan is one byte shorter than its input. */
+    discarded[0] = 0xff;
+    memcpy(discarded + 1, parser->data, parser->len);
+    parser->len = 0;
+    parser->state = STATE_MARKER1;
+    parser->resyncs++;
+
+    parser->rescan_depth++;
+    frame_parser_feed(parser, discarded, len, handler, user_data);
+    parser->rescan_depth--;
+}
+
+void
+frame_parser_feed(struct frame_parser *parser, const uint8_t *data, size_t len,
+		  frame_handler handler, void *user_data)
+{
+    size_t pos;
+
+    for (pos = 0; pos < len; pos++) {
+	uint8_t byte = data[pos];
+	int expected;
+
+	switch (parser->state) {
+	    case STATE_MARKER1:
+		if (byte == 0xff) {
+		    parser->state = STATE_MARKER2;
+		}
+		break;
+	    case STATE_MARKER2:
+		parser->state = byte == 0xff ? STATE_FLAGS : STATE_MARKER1;
+		break;
+	    case STATE_FLAGS:
+		parser->data[0] = byte;
+		parser->len = 1;
+		parser->state = STATE_TYPE;
+		break;
+	    case STATE_TYPE:
+		parser->data[parser->len++] = byte;
+		expected = wmr_packet_length(byte);
+		if (expected > 0) {
+		    parser->remaining = expected - 2;
+		    parser->state = STATE_DATA;
+		} else {
+		    parser->length_errors++;
+		    frame_parser_resync(parser, handler, user_data);
+		}
+		break;
+	    case STATE_DATA:
+		parser->data[parser->len++] = byte;
+		if (--parser->remaining == 0) {
+		    if (!wmr_checksum_valid(parser->data, parser->len)) {
+			parser->checksum_failures++;
+			frame_parser_resync(parser, handler, user_data);
+			break;
+		    }
+		    parser->frames++;
+		    handler(parser->data, parser->len, user_data);
+		    parser->len = 0;
+		    parser->state = STATE_MARKER1;
+		}
+		break;
+	}
+    }
+}
@@ -0,0 +1,57 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __FRAME_H__
+#define __FRAME_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Longest frame (flags, type, payload, checksum) the station sends */
+#define WMR_MAX_FRAME_LEN 17
+
+/* Reassembles the frames of the station's byte stream, which are preceded
+ * by 0xff 0xff start markers, and hands out those with a valid checksum.
+ * The bytes of rejected frames are scanned again for the next marker. */
+struct frame_parser {
+    int state;
+    size_t remaining;
+    uint8_t data[WMR_MAX_FRAME_LEN];
+    size_t len;
+    int rescan_depth;
+
+    unsigned long frames;
+    unsigned long checksum_failures;
+    unsigned long length_errors;
+    unsigned long resyncs;
+};
+
+typedef void (*frame_handler)(const uint8_t *frame, size_t len, void *user_data);
+
+int wmr_packet_length(uint8_t type);
+int wmr_checksum_valid(const uint8_t *frame, size_t len);
+void wmr_set_checksum(uint8_t *frame, size_t len);
+
+void frame_parser_init(struct frame_parser *parser);
+/* drops a partial frame, but keeps the counters */
+void frame_parser_reset(struct frame_parser *parser);
+void frame_parser_feed(struct frame_parser *parser, const uint8_t *data, size_t len,
+		       frame_handler handler, void *user_data);
+
+#endif /* __FRAME_H__ */
@@ -0,0 +1,297 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "history.h"
+
+/* pending records that trigger writing them out */
+#define HISTORY_FLUSH_RECORDS 64
+#define HISTORY_WRITE_SIZE    4096
+
+static struct history_entry *
+entry_at(const struct history *hist, size_t offset)
+{
+    return &hist->entries[(hist->head + offset) % hist->capacity];
+}
+
+static void
+drop_oldest(struct history *hist)
+{
+    hist->head = (hist->head + 1) % hist->capacity;
+    hist->count--;
+    if (hist->unsaved > hist->count) {
+	hist->unsaved = hist->count;
+    }
+}
+
+static void
+store_entry(struct history *hist, const char *record, size_t len)
+{
+    struct history_entry *entry;
+
+    if (hist->count == hist->capacity) {
+	drop_oldest(hist);
+    }
+
+    entry = entry_at(hist, hist->count++);
+    entry->sequence = get_be32(record + 4);
+    entry->timestamp = get_be64(record + 8);
+    entry->len = len;
+    memcpy(entry->record, record, len);
+}
+
+/* Writes count entries starting at offset, collected into page sized
+ * chunks. */
+static int
+write_entries(const struct history *hist, int fd, size_t offset, size_t count)
+{
+    char buf[HISTORY_WRITE_SIZE];
+    size_t len = 0, i;
+
+    for (i = 0; i <= count; i++) {
+	const struct history_entry *entry = i < count ? entry_at(hist, offset + i) : NULL;
+	size_t done = 0;
+
+	if (entry && len + entry->len <= sizeof(buf)) {
+	    memcpy(buf + len, entry->record, entry->len);
+	    len += entry->len;
+	    continue;
+	}
+
+	while (done < len) {
+	    ssize_t n = write(fd, buf + done, len - done);
+	    if (n < 0) {
+		if (errno == EINTR) {
+		    continue;
+		}
+		return -1;
+	    }
+	    done += n;
+	}
+
+	len = 0;
+	if (entry) {
+	    memcpy(buf, entry->record, entry->len);
+	    len = entry->len;
+	}
+    }
+
+    return 0;
+}
+
+/* Replaces the file by the records currently in memory. */
+static int
+rewrite_file(struct history *hist)
+{
+    size_t tmp_len = strlen(hist->path) + 5;
+    char *tmp_path = malloc(tmp_len);
+    int fd, ret = -1;
+
+    if (!tmp_path) {
+	return -1;
+    }
+    snprintf(tmp_path, tmp_len, "%s.tmp", hist->path);
+
+    fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+	perror("open history");
+    } else if (write_entries(hist, fd, 0, hist->count) < 0) {
+	perror("write history");
+	close(fd);
+	unlink(tmp_path);
+    } else if (close(fd) < 0 || rename(tmp_path, hist->path) < 0) {
+	perror("rename history");
+	unlink(tmp_path);
+    } else {
+	ret = 0;
+    }
+    free(tmp_path);
+
+    if (ret < 0) {
+	return -1;
+    }
+
+    if (hist->fd >= 0) {
+	close(hist->fd);
+    }
+    hist->fd = open(hist->path, O_WRONLY | O_APPEND);
+    if (hist->fd < 0) {
+	perror("open history");
+	return -1;
+    }
+    hist->file_records = hist->count;
+    hist->unsaved = 0;
+
+    return 0;
+}
+
+/* Reads back the records of an earlier run. A torn record at the end,
+ * e.g. from a power loss while writing, ends the file. */
+static void
+load_file(struct history *hist)
+{
+    FILE *file = fopen(hist->path, "r");
+    char record[RECORD_MAX_LEN];
+
+    if (!file) {
+	if (errno != ENOENT) {
+	    perror("open history");
+	}
+	return;
+    }
+
+    while (fread(record, RECORD_HEADER_LEN, 1, file) == 1) {
+	size_t len = get_be16(record);
+	uint32_t sequence = get_be32(record + 4);
+
+	if (record[2] != RECORD_FRAME || len <= RECORD_HEADER_LEN || len > RECORD_MAX_LEN) {
+	    break;
+	}
+	if (fread(record + RECORD_HEADER_LEN, len - RECORD_HEADER_LEN, 1, file) != 1) {
+	    break;
+	}
+	if (hist->count > 0 && sequence != hist->next_sequence) {
+	    /* entries must be consecutive */
+	    hist->count = 0;
+	}
+	store_entry(hist, record, len);
+	hist->next_sequence = sequence + 1;
+    }
+
+    fclose(file);
+}
+
+int
+history_init(struct history *hist, size_t capacity, unsigned int max_age_minutes,
+	     const char *path)
+{
+    memset(hist, 0, sizeof(*hist));
+    hist->fd = -1;
+    hist->max_age = (uint64_t) max_age_minutes * 60 * 1000000;
+
+    if (capacity == 0) {
+	return 0;
+    }
+
+    hist->entries = calloc(capacity, sizeof(*hist->entries));
+    if (!hist->entries) {
+	return -1;
+    }
+    hist->capacity = capacity;
+
+    if (path) {
+	hist->path = strdup(path);
+	if (!hist->path) {
+	    return -1;
+	}
+	load_file(hist);
+	/* start over with a compact file without a possibly torn end */
+	if (rewrite_file(hist) < 0) {
+	    return -1;
+	}
+	if (hist->count > 0) {
+	    printf("Restored %lu frames (sequence %u to %u) from history\n",
+		   (unsigned long) hist->count, history_oldest(hist),
+		   hist->next_sequence - 1);
+	}
+    }
+
+    return 0;
+}
+
+void
+history_free(struct history *hist)
+{
+    history_flush(hist);
+    if (hist->fd >= 0) {
+	close(hist->fd);
+    }
+    free(hist->entries);
+    free(hist->path);
+    memset(hist, 0, sizeof(*hist));
+    hist->fd = -1;
+}
+
+void
+history_add(struct history *hist, const char *record, size_t len)
+{
+    hist->next_sequence = get_be32(record + 4) + 1;
+    if (hist->capacity == 0) {
+	return;
+    }
+
+    store_entry(hist, record, len);
+    history_expire(hist, entry_at(hist, hist->count - 1)->timestamp);
+
+    if (hist->fd >= 0 && ++hist->unsaved >= HISTORY_FLUSH_RECORDS) {
+	history_flush(hist);
+    }
+}
+
+void
+history_expire(struct history *hist, uint64_t now)
+{
+    if (hist->max_age == 0) {
+	return;
+    }
+
+    while (hist->count > 0 && entry_at(hist, 0)->timestamp + hist->max_age < now) {
+	drop_oldest(hist);
+    }
+}
+
+int
+history_flush(struct history *hist)
+{
+    if (hist->fd < 0 || hist->unsaved == 0) {
+	return 0;
+    }
+
+    if (hist->file_records + hist->unsaved > 2 * hist->capacity) {
+	return rewrite_file(hist);
+    }
+
+    if (write_entries(hist, hist->fd, hist->count - hist->unsaved, hist->unsaved) < 0) {
+	perror("write history");
+	/* don't keep failing on every frame */
+	close(hist->fd);
+	hist->fd = -1;
+	return -1;
+    }
+    hist->file_records += hist->unsaved;
+    hist->unsaved = 0;
+
+    return 0;
+}
+
+const struct history_entry *
+history_get(const struct history *hist, uint32_t sequence)
+{
+    uint32_t offset = sequence - history_oldest(hist);
+
+    if (offset >= hist->count) {
+	return NULL;
+    }
+    return entry_at(hist, offset);
+}
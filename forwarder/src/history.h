@@ -0,0 +1,75 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __HISTORY_H__
+#define __HISTORY_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include "record.h"
+
+struct history_entry {
+    uint32_t sequence;
+    uint64_t timestamp;
+    uint8_t len;
+    char record[RECORD_MAX_LEN];
+};
+
+/* The most recent records of a device, kept so reconnecting clients can
+ * catch up on what they missed. Entries are consecutive in sequence, so
+ * looking one up is an index computation.
+ *
+ * If a file is given, the records are appended to it in batches, to keep
+ * the number of writes to flash low, and read back on startup. The file is
+ * rewritten from memory whenever it has grown to twice the ring size. */
+struct history {
+    struct history_entry *entries;
+    size_t capacity;
+    size_t head;              /* index of the oldest entry */
+    size_t count;
+    uint64_t max_age;         /* in us, 0 for no limit */
+    uint32_t next_sequence;
+
+    char *path;
+    int fd;
+    size_t unsaved;           /* newest entries not written yet */
+    size_t file_records;
+};
+
+int history_init(struct history *hist, size_t capacity, unsigned int max_age_minutes,
+		 const char *path);
+void history_free(struct history *hist);
+
+/* takes a complete record; its sequence must be next_sequence */
+void history_add(struct history *hist, const char *record, size_t len);
+/* drops entries older than max_age relative to now (in us) */
+void history_expire(struct history *hist, uint64_t now);
+/* writes unsaved entries to the file */
+int history_flush(struct history *hist);
+
+static inline uint32_t
+history_oldest(const struct history *hist)
+{
+    return hist->next_sequence - hist->count;
+}
+
+/* returns the entry with the given sequence, or NULL if not kept */
+const struct history_entry *history_get(const struct history *hist, uint32_t sequence);
+
+#endif /* __HISTORY_H__ */
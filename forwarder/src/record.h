@@ -0,0 +1,90 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include <stdint.h>
+#include "frame.h"
+
+/*
+ * Framed protocol: after connecting, the client sends a request line
+ * ("STREAM\n", optionally followed by "after=<sequence>" to first get the
+ * frames it missed and "types=<hex list>" to only get some message types).
+ * From then on, the server sends whole, checksum-validated frames as
+ * records of a 16 byte header followed by the frame (flags to checksum).
+ * Changes of the device state are sent as status records with a single
+ * byte payload (STATUS_*); their sequence is that of the next frame.
+ * All header fields are in network byte order:
+ *
+ *   u16 length     record length, including the header
+ *   u8  type       RECORD_FRAME or RECORD_STATUS
+ *   u8  channel    device the record belongs to
+ *   u32 sequence   incremented for every frame of any device
+ *   u64 timestamp  receive time, in microseconds since the epoch
+ */
+#define RECORD_HEADER_LEN 16
+#define RECORD_MAX_LEN    (RECORD_HEADER_LEN + WMR_MAX_FRAME_LEN)
+#define RECORD_FRAME      1
+#define RECORD_STATUS     2
+#define RECORD_STATUS_LEN (RECORD_HEADER_LEN + 1)
+
+#define STATUS_DETACHED   0
+#define STATUS_ATTACHED   1
+
+static inline void
+put_be16(char *p, uint16_t value)
+{
+    p[0] = value >> 8;
+    p[1] = value;
+}
+
+static inline void
+put_be32(char *p, uint32_t value)
+{
+    put_be16(p, value >> 16);
+    put_be16(p + 2, value);
+}
+
+static inline void
+put_be64(char *p, uint64_t value)
+{
+    put_be32(p, value >> 32);
+    put_be32(p + 4, value);
+}
+
+static inline uint16_t
+get_be16(const char *p)
+{
+    return ((uint8_t) p[0] << 8) | (uint8_t) p[1];
+}
+
+static inline uint32_t
+get_be32(const char *p)
+{
+    return ((uint32_t) get_be16(p) << 16) | get_be16(p + 2);
+}
+
+static inline uint64_t
+get_be64(const char *p)
+{
+    return ((uint64_t) get_be32(p) << 32) | get_be32(p + 4);
+}
+
+#endif /* __RECORD_H__ */
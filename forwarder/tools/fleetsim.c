@@ -0,0 +1,784 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Simulates a fleet of stations, each behind a forwarder of its own, to
+ * load test collectors without hardware. Station i serves its raw byte
+ * stream on port raw-base + i and, with -F, the framed protocol on port
+ * framed-base + i, like wmr-forwarder does for a single device. There is
+ * no history, so framed clients get live records whatever they request.
+ *
+ * Every station sends all message types at the cadences the decoder
+ * assumes: inside temperature every 15 s, outside sensors, pressure, UV
+ * and clock every 60 s, wind every 48 s and rain every 70 s. The values
+ * walk randomly within plausible bounds. Simulated time runs at a
+ * multiple of real time (-x) and is what the framed records are stamped
+ * with. With -e, that fraction of the raw frames is damaged the ways a
+ * bad USB link does, to exercise resyncing. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include "frame.h"
+#include "record.h"
+
+#define MAXEVENTS 64
+#define TICK_MS   50
+#define REPORT_INTERVAL 10
+#define CLIENT_BUFSIZE (256 * 1024)
+#define CLIENT_REQUEST_MAX 256
+
+enum {
+    MSG_TEMP_INSIDE,
+    MSG_TEMP_CH1,
+    MSG_TEMP_CH2,
+    MSG_TEMP_CH3,
+    MSG_PRESSURE,
+    MSG_WIND,
+    MSG_RAIN,
+    MSG_UV,
+    MSG_CLOCK,
+    MSG_COUNT
+};
+
+static const struct {
+    uint8_t type;
+    int interval;           /* in seconds */
+} g_messages[MSG_COUNT] = {
+    [MSG_TEMP_INSIDE] = { 0x42, 15 },
+    [MSG_TEMP_CH1]    = { 0x42, 60 },
+    [MSG_TEMP_CH2]    = { 0x42, 60 },
+    [MSG_TEMP_CH3]    = { 0x42, 60 },
+    [MSG_PRESSURE]    = { 0x46, 60 },
+    [MSG_WIND]        = { 0x48, 48 },
+    [MSG_RAIN]        = { 0x41, 70 },
+    [MSG_UV]          = { 0x47, 60 },
+    [MSG_CLOCK]       = { 0x60, 60 },
+};
+
+struct sim_client;
+
+struct station {
+    int index;
+    int raw_fd;
+    int framed_fd;
+    struct sim_client *clients;
+    uint32_t sequence;
+    unsigned int seed;
+    uint64_t next_due[MSG_COUNT]; /* simulated time, in us */
+
+    double temperature[4];  /* inside, then the outside channels */
+    double humidity[4];
+    double pressure;        /* hPa */
+    double wind_avg;        /* m/s */
+    double wind_gust;
+    double wind_dir;        /* in 16ths of a turn */
+    double rain_rate;       /* 0.01 in/h */
+    double rain_total;      /* 0.01 in */
+    double uv;
+};
+
+struct sim_client {
+    int fd;
+    struct station *station;
+    struct sim_client *next;
+    int framed;
+    int streaming;          /* framed client sent its request */
+    int want_write;
+    char request[CLIENT_REQUEST_MAX];
+    size_t request_len;
+    char *buf;
+    size_t len;
+    size_t capacity;
+};
+
+/* what a descriptor is, looked up by its number */
+struct endpoint {
+    struct station *station;  /* listeners */
+    int framed;
+    struct sim_client *client;
+};
+
+static volatile sig_atomic_t g_running = 1;
+static struct endpoint *g_endpoints;
+static int g_max_fds;
+static size_t g_client_bufsize = CLIENT_BUFSIZE;
+static double g_noise;
+
+static unsigned long g_frames;
+static unsigned long g_damaged;
+static unsigned long g_bytes_sent;
+static unsigned long g_disconnects;
+static int g_nclients;
+
+static uint64_t
+clock_us(clockid_t id)
+{
+    struct timespec now;
+
+    clock_gettime(id, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static double
+random_unit(unsigned int *seed)
+{
+    return (double) rand_r(seed) / RAND_MAX;
+}
+
+/* moves the value by up to step in either direction, within bounds */
+static void
+walk(double *value, double step, double min, double max, unsigned int *seed)
+{
+    *value += (2 * random_unit(seed) - 1) * step;
+    if (*value < min) {
+	*value = min;
+    } else if (*value > max) {
+	*value = max;
+    }
+}
+
+static void
+put_le16(uint8_t *p, unsigned int value)
+{
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+}
+
+/* temperatures are 12 bit tenths, with the sign in the upper nibble */
+static void
+put_temperature(uint8_t *p, double value)
+{
+    unsigned int tenths = lround(fabs(value) * 10);
+
+    p[0] = tenths & 0xff;
+    p[1] = ((tenths >> 8) & 0x0f) | (value < 0 ? 0x80 : 0);
+}
+
+/* Builds the next frame (flags to checksum) of a message, the way the
+ * station encodes its readings. Returns its length. */
+static size_t
+build_frame(struct station *st, int msg, uint64_t now, uint8_t *frame)
+{
+    uint8_t type = g_messages[msg].type;
+    size_t len = wmr_packet_length(type);
+    uint8_t *data = frame + 2;
+    unsigned int *seed = &st->seed;
+
+    memset(frame, 0, len);
+    frame[1] = type;
+
+    switch (msg) {
+	case MSG_TEMP_INSIDE:
+	case MSG_TEMP_CH1:
+	case MSG_TEMP_CH2:
+	case MSG_TEMP_CH3: {
+	    int sensor = msg - MSG_TEMP_INSIDE;
+	    double *t = &st->temperature[sensor], *h = &st->humidity[sensor];
+
+	    if (sensor == 0) {
+		walk(t, 0.1, 15, 28, seed);
+		walk(h, 1, 30, 70, seed);
+	    } else {
+		walk(t, 0.3, -25, 40, seed);
+		walk(h, 2, 15, 99, seed);
+	    }
+	    data[0] = sensor;
+	    put_temperature(data + 1, *t);
+	    data[3] = lround(*h);
+	    /* good enough as a dew point */
+	    put_temperature(data + 4, *t - (100 - *h) / 5);
+	    /* no heat index */
+	    data[7] = 0x20;
+	    break;
+	}
+	case MSG_PRESSURE: {
+	    unsigned int absolute, relative;
+
+	    walk(&st->pressure, 0.5, 960, 1045, seed);
+	    absolute = lround(st->pressure) - 30;
+	    relative = lround(st->pressure);
+	    /* forecast "partly cloudy" in the upper nibbles */
+	    data[0] = absolute & 0xff;
+	    data[1] = ((absolute >> 8) & 0x0f) | 0x20;
+	    data[2] = relative & 0xff;
+	    data[3] = ((relative >> 8) & 0x0f) | 0x20;
+	    break;
+	}
+	case MSG_WIND: {
+	    unsigned int avg, gust;
+
+	    walk(&st->wind_avg, 0.8, 0, 25, seed);
+	    walk(&st->wind_dir, 1, 0, 15.99, seed);
+	    st->wind_gust = st->wind_avg * (1 + random_unit(seed) * 0.8);
+	    avg = lround(st->wind_avg * 10);
+	    gust = lround(st->wind_gust * 10);
+	    data[0] = (unsigned int) st->wind_dir & 0x0f;
+	    data[2] = gust & 0xff;
+	    data[3] = ((gust >> 8) & 0x0f) | ((avg & 0x0f) << 4);
+	    data[4] = avg >> 4;
+	    /* no wind chill */
+	    data[6] = 0x20;
+	    break;
+	}
+	case MSG_RAIN:
+	    /* mostly dry, with the odd shower */
+	    if (st->rain_rate > 0 || random_unit(seed) < 0.02) {
+		walk(&st->rain_rate, 40, 0, 400, seed);
+	    }
+	    st->rain_total += st->rain_rate * g_messages[msg].interval / 3600;
+	    put_le16(data, lround(st->rain_rate));
+	    put_le16(data + 2, lround(st->rain_rate));
+	    put_le16(data + 4, lround(st->rain_rate * 2));
+	    put_le16(data + 6, lround(st->rain_total));
+	    /* total since 2012-01-01 00:00 */
+	    data[10] = 1;
+	    data[11] = 1;
+	    data[12] = 12;
+	    break;
+	case MSG_UV:
+	    walk(&st->uv, 0.5, 0, 11, seed);
+	    data[1] = lround(st->uv);
+	    break;
+	case MSG_CLOCK: {
+	    time_t seconds = now / 1000000;
+	    struct tm tm;
+
+	    gmtime_r(&seconds, &tm);
+	    data[2] = tm.tm_min;
+	    data[3] = tm.tm_hour;
+	    data[4] = tm.tm_mday;
+	    data[5] = tm.tm_mon + 1;
+	    data[6] = tm.tm_year % 100;
+	    break;
+	}
+    }
+
+    wmr_set_checksum(frame, len);
+    return len;
+}
+
+/* Damages a frame like a flaky link: a flipped byte, a lost byte, or
+ * garbage in front of it. Returns the new length of the raw bytes. */
+static size_t
+add_noise(struct station *st, uint8_t *raw, size_t len)
+{
+    unsigned int *seed = &st->seed;
+    size_t pos = rand_r(seed) % len;
+    size_t i, junk;
+
+    g_damaged++;
+    switch (rand_r(seed) % 3) {
+	case 0:
+	    raw[pos] ^= 1 << (rand_r(seed) % 8);
+	    return len;
+	case 1:
+	    memmove(raw + pos, raw + pos + 1, len - pos - 1);
+	    return len - 1;
+	default:
+	    junk = 1 + rand_r(seed) % 4;
+	    memmove(raw + junk, raw, len);
+	    for (i = 0; i < junk; i++) {
+		/* often the first marker byte, the worst case for the parser */
+		raw[i] = rand_r(seed) % 2 ? 0xff : rand_r(seed);
+	    }
+	    return len + junk;
+    }
+}
+
+static int
+client_queue(struct sim_client *cl, const void *data, size_t len)
+{
+    if (cl->len + len > cl->capacity) {
+	size_t capacity = cl->capacity ? cl->capacity : 4096;
+	char *buf;
+
+	while (capacity < cl->len + len) {
+	    capacity *= 2;
+	}
+	if (capacity > g_client_bufsize) {
+	    fprintf(stderr, "Client on descriptor %d too slow, disconnecting\n", cl->fd);
+	    return -1;
+	}
+	buf = realloc(cl->buf, capacity);
+	if (!buf) {
+	    return -1;
+	}
+	cl->buf = buf;
+	cl->capacity = capacity;
+    }
+
+    memcpy(cl->buf + cl->len, data, len);
+    cl->len += len;
+    return 0;
+}
+
+static int
+client_set_want_write(int efd, struct sim_client *cl, int want_write)
+{
+    struct epoll_event event;
+
+    if (cl->want_write == want_write) {
+	return 0;
+    }
+    event.data.fd = cl->fd;
+    event.events = EPOLLIN | EPOLLET | (want_write ? EPOLLOUT : 0);
+    if (epoll_ctl(efd, EPOLL_CTL_MOD, cl->fd, &event) < 0) {
+	perror("epoll_ctl");
+	return -1;
+    }
+    cl->want_write = want_write;
+    return 0;
+}
+
+static int
+client_flush(int efd, struct sim_client *cl)
+{
+    size_t pos = 0;
+
+    while (pos < cl->len) {
+	ssize_t n = send(cl->fd, cl->buf + pos, cl->len - pos, MSG_NOSIGNAL);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		return -1;
+	    }
+	    break;
+	}
+	pos += n;
+	g_bytes_sent += n;
+    }
+
+    memmove(cl->buf, cl->buf + pos, cl->len - pos);
+    cl->len -= pos;
+    return client_set_want_write(efd, cl, cl->len > 0);
+}
+
+static void
+remove_client(struct sim_client *cl)
+{
+    struct sim_client **p;
+
+    for (p = &cl->station->clients; *p; p = &(*p)->next) {
+	if (*p == cl) {
+	    *p = cl->next;
+	    break;
+	}
+    }
+    g_endpoints[cl->fd].client = NULL;
+    close(cl->fd);
+    free(cl->buf);
+    free(cl);
+    g_nclients--;
+}
+
+/* Generates the frames of a station due by now, and queues them for its
+ * clients. Clients that fall too far behind are closed. */
+static void
+run_station(struct station *st, uint64_t now)
+{
+    int msg;
+
+    for (msg = 0; msg < MSG_COUNT; msg++) {
+	while (st->next_due[msg] <= now) {
+	    uint8_t frame[WMR_MAX_FRAME_LEN];
+	    uint8_t raw[2 + WMR_MAX_FRAME_LEN + 4];
+	    char record[RECORD_MAX_LEN];
+	    uint64_t stamp = st->next_due[msg];
+	    size_t len = build_frame(st, msg, stamp, frame), raw_len;
+	    struct sim_client *cl, *next;
+
+	    st->next_due[msg] += g_messages[msg].interval * 1000000ULL;
+	    g_frames++;
+
+	    raw[0] = raw[1] = 0xff;
+	    memcpy(raw + 2, frame, len);
+	    raw_len = len + 2;
+	    if (g_noise > 0 && random_unit(&st->seed) < g_noise) {
+		raw_len = add_noise(st, raw, raw_len);
+	    }
+
+	    put_be16(record, RECORD_HEADER_LEN + len);
+	    record[2] = RECORD_FRAME;
+	    record[3] = 0;
+	    put_be32(record + 4, st->sequence++);
+	    put_be64(record + 8, stamp);
+	    memcpy(record + RECORD_HEADER_LEN, frame, len);
+
+	    for (cl = st->clients; cl; cl = next) {
+		int s = 0;
+
+		next = cl->next;
+		if (!cl->framed) {
+		    s = client_queue(cl, raw, raw_len);
+		} else if (cl->streaming) {
+		    s = client_queue(cl, record, RECORD_HEADER_LEN + len);
+		}
+		if (s < 0) {
+		    g_disconnects++;
+		    remove_client(cl);
+		}
+	    }
+	}
+    }
+}
+
+static int
+open_listener(int port)
+{
+    struct sockaddr_in6 addr;
+    int fd, opt = 1;
+
+    fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+	perror("socket");
+	return -1;
+    }
+    memset(&addr, 0, sizeof(addr));
+    addr.sin6_family = AF_INET6;
+    addr.sin6_addr = in6addr_any;
+    addr.sin6_port = htons(port);
+
+    if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+	bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+	listen(fd, SOMAXCONN) < 0) {
+	fprintf(stderr, "Could not listen on port %d: %s\n", port, strerror(errno));
+	close(fd);
+	return -1;
+    }
+    return fd;
+}
+
+static int
+add_fd_to_epoll(int efd, int fd)
+{
+    struct epoll_event event;
+
+    if (fd >= g_max_fds) {
+	fprintf(stderr, "Out of descriptors\n");
+	return -1;
+    }
+    event.data.fd = fd;
+    event.events = EPOLLIN | EPOLLET;
+    if (epoll_ctl(efd, EPOLL_CTL_ADD, fd, &event) < 0) {
+	perror("epoll_ctl");
+	return -1;
+    }
+    return 0;
+}
+
+static void
+accept_clients(int efd, int listenfd)
+{
+    struct endpoint *ep = &g_endpoints[listenfd];
+
+    while (1) {
+	int fd = accept4(listenfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	struct sim_client *cl;
+
+	if (fd < 0) {
+	    if (errno != EAGAIN && errno != EWOULDBLOCK) {
+		perror("accept");
+	    }
+	    return;
+	}
+	cl = calloc(1, sizeof(*cl));
+	if (!cl || add_fd_to_epoll(efd, fd) < 0) {
+	    free(cl);
+	    close(fd);
+	    continue;
+	}
+	cl->fd = fd;
+	cl->station = ep->station;
+	cl->framed = ep->framed;
+	cl->next = ep->station->clients;
+	ep->station->clients = cl;
+	g_endpoints[fd].client = cl;
+	g_nclients++;
+    }
+}
+
+/* Reads what a client sends; framed clients start streaming after their
+ * request line, anything else is ignored. */
+static int
+handle_client_input(struct sim_client *cl)
+{
+    while (1) {
+	char buf[512];
+	ssize_t n = read(cl->fd, buf, sizeof(buf));
+	ssize_t i;
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	} else if (n == 0) {
+	    return -1;
+	}
+
+	for (i = 0; i < n && cl->framed && !cl->streaming; i++) {
+	    if (buf[i] == '\n') {
+		cl->streaming = 1;
+	    } else if (cl->request_len < sizeof(cl->request) - 1) {
+		cl->request[cl->request_len++] = buf[i];
+	    }
+	}
+    }
+}
+
+static void
+init_station(struct station *st, int index, unsigned int seed, uint64_t now)
+{
+    int msg, i;
+
+    memset(st, 0, sizeof(*st));
+    st->index = index;
+    st->raw_fd = st->framed_fd = -1;
+    st->seed = seed + index;
+
+    /* spread the stations over the cadences */
+    for (msg = 0; msg < MSG_COUNT; msg++) {
+	st->next_due[msg] = now + (uint64_t) (random_unit(&st->seed) *
+					      g_messages[msg].interval * 1000000);
+    }
+    st->temperature[0] = 21;
+    st->humidity[0] = 45;
+    for (i = 1; i < 4; i++) {
+	st->temperature[i] = 5 + 10 * random_unit(&st->seed);
+	st->humidity[i] = 60 + 30 * random_unit(&st->seed);
+    }
+    st->pressure = 1000 + 25 * random_unit(&st->seed);
+    st->wind_avg = 3 * random_unit(&st->seed);
+    st->wind_dir = 16 * random_unit(&st->seed);
+    st->rain_total = 1000 * random_unit(&st->seed);
+    st->uv = 2;
+}
+
+static void
+handle_signal(int signal)
+{
+    g_running = 0;
+}
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-n stations] [-p raw-base-port] [-F framed-base-port] "
+	    "[-x speed] [-e noise-fraction] [-s seed] [-b bufsize]\n", program);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct epoll_event events[MAXEVENTS];
+    struct itimerspec tick;
+    struct rlimit limit;
+    struct station *stations;
+    int nstations = 100, raw_base = 9876, framed_base = 0;
+    unsigned int seed = 1;
+    double speed = 1;
+    uint64_t real_start, sim_start, last_report;
+    unsigned long last_frames = 0;
+    int opt, i, efd, tfd;
+
+    while ((opt = getopt(argc, argv, "n:p:F:x:e:s:b:")) != -1) {
+	switch (opt) {
+	    case 'n':
+		nstations = atoi(optarg);
+		break;
+	    case 'p':
+		raw_base = atoi(optarg);
+		break;
+	    case 'F':
+		framed_base = atoi(optarg);
+		break;
+	    case 'x':
+		speed = atof(optarg);
+		break;
+	    case 'e':
+		g_noise = atof(optarg);
+		break;
+	    case 's':
+		seed = strtoul(optarg, NULL, 0);
+		break;
+	    case 'b':
+		g_client_bufsize = strtoul(optarg, NULL, 0);
+		break;
+	    default:
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+    }
+    if (nstations < 1 || raw_base < 1 || raw_base + nstations > 65536 || framed_base < 0 ||
+	framed_base + nstations > 65536 || speed <= 0 || g_noise < 0 || g_noise > 1 ||
+	g_client_bufsize == 0 || optind != argc) {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    /* two listeners per station, and room for the clients */
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+	limit.rlim_cur = limit.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+    g_max_fds = getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < 1 << 20 ?
+		(int) limit.rlim_cur : 1 << 20;
+    g_endpoints = calloc(g_max_fds, sizeof(*g_endpoints));
+    stations = calloc(nstations, sizeof(*stations));
+    efd = epoll_create1(EPOLL_CLOEXEC);
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!g_endpoints || !stations || efd < 0 || tfd < 0) {
+	perror("setup");
+	exit(EXIT_FAILURE);
+    }
+
+    real_start = clock_us(CLOCK_MONOTONIC);
+    sim_start = clock_us(CLOCK_REALTIME);
+    for (i = 0; i < nstations; i++) {
+	struct station *st = &stations[i];
+
+	init_station(st, i, seed, sim_start);
+	st->raw_fd = open_listener(raw_base + i);
+	if (st->raw_fd < 0 || add_fd_to_epoll(efd, st->raw_fd) < 0) {
+	    exit(EXIT_FAILURE);
+	}
+	g_endpoints[st->raw_fd].station = st;
+	if (framed_base) {
+	    st->framed_fd = open_listener(framed_base + i);
+	    if (st->framed_fd < 0 || add_fd_to_epoll(efd, st->framed_fd) < 0) {
+		exit(EXIT_FAILURE);
+	    }
+	    g_endpoints[st->framed_fd].station = st;
+	    g_endpoints[st->framed_fd].framed = 1;
+	}
+    }
+
+    tick.it_value.tv_sec = tick.it_interval.tv_sec = 0;
+    tick.it_value.tv_nsec = tick.it_interval.tv_nsec = TICK_MS * 1000000;
+    if (add_fd_to_epoll(efd, tfd) < 0 || timerfd_settime(tfd, 0, &tick, NULL) < 0) {
+	exit(EXIT_FAILURE);
+    }
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    printf("Simulating %d stations on ports %d-%d", nstations, raw_base, raw_base + nstations - 1);
+    if (framed_base) {
+	printf(", framed %d-%d", framed_base, framed_base + nstations - 1);
+    }
+    printf(", at %gx\n", speed);
+    fflush(stdout);
+
+    last_report = real_start;
+    while (g_running) {
+	int n = epoll_wait(efd, events, MAXEVENTS, -1), item;
+
+	if (n < 0) {
+	    if (errno != EINTR) {
+		perror("epoll_wait");
+	    }
+	    continue;
+	}
+
+	for (item = 0; item < n; item++) {
+	    int fd = events[item].data.fd;
+	    struct endpoint *ep = &g_endpoints[fd];
+
+	    if (fd == tfd) {
+		uint64_t expirations, real_now = clock_us(CLOCK_MONOTONIC);
+		uint64_t now = sim_start + (uint64_t) ((real_now - real_start) * speed);
+		int j;
+
+		if (read(tfd, &expirations, sizeof(expirations)) < 0) {
+		    continue;
+		}
+		for (j = 0; j < nstations; j++) {
+		    struct sim_client *cl, *next;
+
+		    run_station(&stations[j], now);
+		    for (cl = stations[j].clients; cl; cl = next) {
+			next = cl->next;
+			if (cl->len > 0 && !cl->want_write && client_flush(efd, cl) < 0) {
+			    remove_client(cl);
+			}
+		    }
+		}
+
+		if (real_now - last_report >= REPORT_INTERVAL * 1000000ULL) {
+		    time_t sim_seconds = now / 1000000;
+		    char when[32];
+
+		    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", gmtime(&sim_seconds));
+		    printf("%s: %lu frames (%.0f/s), %lu damaged, %d clients, "
+			   "%lu bytes sent, %lu slow clients dropped\n",
+			   when, g_frames,
+			   (g_frames - last_frames) * 1e6 / (real_now - last_report),
+			   g_damaged, g_nclients, g_bytes_sent, g_disconnects);
+		    fflush(stdout);
+		    last_report = real_now;
+		    last_frames = g_frames;
+		}
+	    } else if (ep->station) {
+		accept_clients(efd, fd);
+	    } else if (ep->client) {
+		struct sim_client *cl = ep->client;
+
+		if ((events[item].events & (EPOLLERR | EPOLLHUP)) ||
+		    ((events[item].events & EPOLLIN) && handle_client_input(cl) < 0) ||
+		    ((events[item].events & EPOLLOUT) && client_flush(efd, cl) < 0)) {
+		    remove_client(cl);
+		}
+	    }
+	}
+    }
+
+    printf("%lu frames, %lu damaged, %lu bytes sent\n", g_frames, g_damaged, g_bytes_sent);
+    for (i = 0; i < nstations; i++) {
+	while (stations[i].clients) {
+	    remove_client(stations[i].clients);
+	}
+	close(stations[i].raw_fd);
+	if (stations[i].framed_fd >= 0) {
+	    close(stations[i].framed_fd);
+	}
+    }
+    free(stations);
+    free(g_endpoints);
+    close(tfd);
+    close(efd);
+
+    return 0;
+}
@@ -0,0 +1,454 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Stands in for the station's HID device, so the forwarder can be run and
+ * load tested without hardware. It creates a pseudo terminal; the
+ * forwarder is given its slave side (or the link made with -l) instead of
+ * /dev/hidraw*. Reports are written at a fixed rate in the hidraw format,
+ * a length byte followed by up to 7 payload bytes, and carry either
+ * generated frames or recorded traffic. What the forwarder writes is read
+ * and its heartbeats and resets are counted.
+ *
+ * Generated frames carry the monotonic send time in microseconds (modulo
+ * 2^32) as the first four payload bytes, so wmr-loadgen -l can measure
+ * the latency of the frames it receives. Recorded traffic is the byte
+ * stream of a raw client, e.g. "nc forwarder 8888 > capture", replayed
+ * in a loop.
+ *
+ * Like the real device, only a limited number of reports is queued while
+ * the reader doesn't keep up; the rest are dropped and counted as
+ * overruns. The pty is a byte stream, while a hidraw read returns one
+ * whole report, so a report is only written to it if it fits as a whole
+ * and can't be read in pieces. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include "frame.h"
+#include "record.h"
+
+#define REPORT_SIZE  8
+/* reports the device keeps while nobody reads them */
+#define QUEUE_REPORTS 64
+/* granularity of the report rate */
+#define TICK_US 1000
+/* Bytes left unread at the forwarder's end before the reports wait in
+ * the queue. Well below what the pty buffers, so a report written is
+ * never split. */
+#define PTY_ROOM 1024
+
+struct source {
+    char *recording;        /* recorded traffic, or NULL to generate frames */
+    size_t recording_len;
+    size_t pos;
+    uint8_t frame[2 + WMR_MAX_FRAME_LEN];
+    size_t frame_len;
+    unsigned int next_type;
+};
+
+struct emulator {
+    int master;
+    int slave;              /* kept open, so the pty survives the forwarder */
+    struct source source;
+    unsigned int payload;   /* bytes per report */
+    char queue[QUEUE_REPORTS * REPORT_SIZE];
+    size_t queue_len;
+    char input[REPORT_SIZE];
+    size_t input_len;
+
+    unsigned long reports;
+    unsigned long overruns;
+    unsigned long frames;
+    unsigned long heartbeats;
+    unsigned long resets;
+    unsigned long other_reports;
+};
+
+static volatile sig_atomic_t g_running = 1;
+
+static uint64_t
+monotonic_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void
+generate_frame(struct emulator *emu)
+{
+    /* the types the station sends, UV aside, which has no room for the
+     * time stamp */
+    static const uint8_t types[] = { 0x42, 0x48, 0x42, 0x41, 0x46, 0x60 };
+    struct source *src = &emu->source;
+    uint8_t type = types[src->next_type++ % sizeof(types)];
+    size_t len = wmr_packet_length(type);
+    uint8_t *frame = src->frame + 2;
+
+    src->frame[0] = src->frame[1] = 0xff;
+    memset(frame, 0, len);
+    frame[1] = type;
+    put_be32((char *) frame + 2, monotonic_us());
+    wmr_set_checksum(frame, len);
+
+    src->frame_len = len + 2;
+    src->pos = 0;
+    emu->frames++;
+}
+
+/* Returns the next len bytes of traffic. */
+static void
+source_read(struct emulator *emu, char *out, size_t len)
+{
+    struct source *src = &emu->source;
+
+    while (len > 0) {
+	const char *data;
+	size_t avail;
+
+	if (src->recording) {
+	    if (src->pos == src->recording_len) {
+		src->pos = 0;
+	    }
+	    data = src->recording + src->pos;
+	    avail = src->recording_len - src->pos;
+	} else {
+	    if (src->pos == src->frame_len) {
+		generate_frame(emu);
+	    }
+	    data = (const char *) src->frame + src->pos;
+	    avail = src->frame_len - src->pos;
+	}
+
+	if (avail > len) {
+	    avail = len;
+	}
+	memcpy(out, data, avail);
+	src->pos += avail;
+	out += avail;
+	len -= avail;
+    }
+}
+
+static void
+queue_report(struct emulator *emu)
+{
+    char report[REPORT_SIZE];
+
+    memset(report, 0, sizeof(report));
+    report[0] = emu->payload;
+    source_read(emu, report + 1, emu->payload);
+    emu->reports++;
+
+    if (emu->queue_len + REPORT_SIZE > sizeof(emu->queue)) {
+	emu->overruns++;
+	return;
+    }
+    memcpy(emu->queue + emu->queue_len, report, REPORT_SIZE);
+    emu->queue_len += REPORT_SIZE;
+}
+
+static int
+flush_queue(struct emulator *emu)
+{
+    int pending;
+
+    if (ioctl(emu->slave, FIONREAD, &pending) < 0) {
+	perror("ioctl pty");
+	return -1;
+    }
+
+    while (emu->queue_len > 0 && pending + REPORT_SIZE <= PTY_ROOM) {
+	ssize_t n = write(emu->master, emu->queue, REPORT_SIZE);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 0;
+	    }
+	    perror("write pty");
+	    return -1;
+	}
+	/* a report the pty took only in part is lost as well */
+	if (n != REPORT_SIZE) {
+	    emu->overruns++;
+	}
+	memmove(emu->queue, emu->queue + REPORT_SIZE, emu->queue_len - REPORT_SIZE);
+	emu->queue_len -= REPORT_SIZE;
+	pending += REPORT_SIZE;
+    }
+
+    return 0;
+}
+
+/* Reads the reports the forwarder sent to the station. */
+static int
+read_input(struct emulator *emu)
+{
+    while (1) {
+	ssize_t n = read(emu->master, emu->input + emu->input_len,
+			 REPORT_SIZE - emu->input_len);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+		return 0;
+	    }
+	    perror("read pty");
+	    return -1;
+	} else if (n == 0) {
+	    return 0;
+	}
+
+	emu->input_len += n;
+	if (emu->input_len == REPORT_SIZE) {
+	    if (emu->input[0] == 0x01) {
+		emu->heartbeats++;
+	    } else if (emu->input[0] == 0x20) {
+		emu->resets++;
+	    } else {
+		emu->other_reports++;
+	    }
+	    emu->input_len = 0;
+	}
+    }
+}
+
+static int
+open_pty(struct emulator *emu)
+{
+    struct termios tio;
+
+    emu->master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+    if (emu->master < 0) {
+	perror("posix_openpt");
+	return -1;
+    }
+    if (grantpt(emu->master) < 0 || unlockpt(emu->master) < 0) {
+	perror("unlockpt");
+	return -1;
+    }
+
+    emu->slave = open(ptsname(emu->master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (emu->slave < 0) {
+	perror("open pty");
+	return -1;
+    }
+    /* pass the reports through unchanged */
+    if (tcgetattr(emu->slave, &tio) < 0) {
+	perror("tcgetattr");
+	return -1;
+    }
+    cfmakeraw(&tio);
+    if (tcsetattr(emu->slave, TCSANOW, &tio) < 0) {
+	perror("tcsetattr");
+	return -1;
+    }
+
+    return 0;
+}
+
+static int
+load_recording(struct source *src, const char *path)
+{
+    FILE *f = fopen(path, "rb");
+    struct stat st;
+
+    if (!f) {
+	perror(path);
+	return -1;
+    }
+    if (fstat(fileno(f), &st) < 0 || st.st_size == 0) {
+	fprintf(stderr, "%s: empty\n", path);
+	fclose(f);
+	return -1;
+    }
+
+    src->recording = malloc(st.st_size);
+    if (!src->recording || fread(src->recording, 1, st.st_size, f) != (size_t) st.st_size) {
+	perror(path);
+	fclose(f);
+	return -1;
+    }
+    src->recording_len = st.st_size;
+    fclose(f);
+
+    return 0;
+}
+
+static void
+handle_signal(int signal)
+{
+    g_running = 0;
+}
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-r reports-per-second] [-n reports] [-p payload-bytes] "
+	    "[-f recording] [-l link]\n", program);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct emulator emu;
+    struct itimerspec tick;
+    struct pollfd fds[2];
+    unsigned long rate = 10, count = 0;
+    char *link_path = NULL, *recording = NULL;
+    uint64_t start;
+    int opt, tfd, ret = EXIT_FAILURE;
+
+    memset(&emu, 0, sizeof(emu));
+    emu.master = emu.slave = -1;
+    emu.payload = REPORT_SIZE - 1;
+
+    while ((opt = getopt(argc, argv, "r:n:p:f:l:")) != -1) {
+	switch (opt) {
+	    case 'r':
+		rate = strtoul(optarg, NULL, 0);
+		break;
+	    case 'n':
+		count = strtoul(optarg, NULL, 0);
+		break;
+	    case 'p':
+		emu.payload = strtoul(optarg, NULL, 0);
+		break;
+	    case 'f':
+		recording = optarg;
+		break;
+	    case 'l':
+		link_path = optarg;
+		break;
+	    default:
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+    }
+    if (rate == 0 || emu.payload < 1 || emu.payload >= REPORT_SIZE || optind != argc) {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    if (recording && load_recording(&emu.source, recording) < 0) {
+	exit(EXIT_FAILURE);
+    }
+    if (open_pty(&emu) < 0) {
+	exit(EXIT_FAILURE);
+    }
+    if (link_path) {
+	unlink(link_path);
+	if (symlink(ptsname(emu.master), link_path) < 0) {
+	    perror("symlink");
+	    goto out;
+	}
+    }
+    printf("%s\n", ptsname(emu.master));
+    fflush(stdout);
+
+    tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (tfd < 0) {
+	perror("timerfd_create");
+	goto out;
+    }
+    tick.it_value.tv_sec = tick.it_interval.tv_sec = 0;
+    tick.it_value.tv_nsec = tick.it_interval.tv_nsec = TICK_US * 1000;
+    timerfd_settime(tfd, 0, &tick, NULL);
+
+    signal(SIGINT, handle_signal);
+    signal(SIGTERM, handle_signal);
+
+    start = monotonic_us();
+    while (g_running) {
+	fds[0].fd = emu.master;
+	/* the queue is flushed on the ticks, as room at the forwarder's end
+	 * can't be polled for */
+	fds[0].events = POLLIN;
+	fds[1].fd = tfd;
+	fds[1].events = POLLIN;
+
+	if (poll(fds, 2, -1) < 0) {
+	    if (errno != EINTR) {
+		perror("poll");
+	    }
+	    continue;
+	}
+
+	if ((fds[0].revents & POLLIN) && read_input(&emu) < 0) {
+	    break;
+	}
+	if (fds[1].revents & POLLIN) {
+	    uint64_t expirations;
+	    /* catch up on the reports due by now, however late the tick */
+	    unsigned long due = (monotonic_us() - start) * rate / 1000000;
+
+	    if (read(tfd, &expirations, sizeof(expirations)) < 0 && errno != EAGAIN) {
+		perror("read timer");
+		break;
+	    }
+	    if (count && due > count) {
+		due = count;
+	    }
+	    while (emu.reports < due) {
+		queue_report(&emu);
+	    }
+	}
+	if (flush_queue(&emu) < 0) {
+	    break;
+	}
+	if (count && emu.reports == count && emu.queue_len == 0) {
+	    break;
+	}
+    }
+
+    fprintf(stderr, "Sent %lu reports (%lu frames), %lu overruns; "
+	    "got %lu heartbeats, %lu resets, %lu other reports\n",
+	    emu.reports - emu.overruns, emu.frames, emu.overruns,
+	    emu.heartbeats, emu.resets, emu.other_reports);
+    ret = EXIT_SUCCESS;
+    close(tfd);
+
+out:
+    if (link_path) {
+	unlink(link_path);
+    }
+    close(emu.slave);
+    close(emu.master);
+    free(emu.source.recording);
+
+    return ret;
+}
@@ -0,0 +1,532 @@
+/*
+ * Oregon WMR88/WMR88A weather station USB-to-TCP bridge
+ *
+ * Copyright (C) 2012 Danny Baumann <dannybaumann@web.de>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Load generator for the forwarder: connects many clients to a raw or the
+ * framed port, some of which read slowly on purpose, and reports per
+ * client what arrived. With -l, the frames are expected to come from
+ * wmr-hidemu, and the latency from the emulator writing a frame to a
+ * client receiving it is measured from the time stamps it puts into
+ * them; both have to run on the same machine. With -P, the CPU time the
+ * forwarder used during the run is reported as well. */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include "frame.h"
+#include "record.h"
+
+#define MAXEVENTS 64
+#define READ_SIZE 4096
+
+struct lg_client {
+    int id;
+    int fd;                 /* -1 once closed by the forwarder */
+    int framed;
+    int slow;
+    unsigned long bytes;
+    unsigned long frames;
+    struct frame_parser parser;     /* raw clients */
+    char record[RECORD_MAX_LEN];    /* partial record of framed clients */
+    size_t record_len;
+    uint32_t *latencies;    /* in us */
+    size_t count;
+    size_t capacity;
+};
+
+struct options {
+    int framed;
+    int latency;
+    size_t slow_read;       /* bytes a slow client reads per tick */
+};
+
+static struct options g_options;
+
+static uint64_t
+monotonic_us(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static void
+add_frame(const uint8_t *frame, size_t len, void *user_data)
+{
+    struct lg_client *cl = user_data;
+
+    cl->frames++;
+    if (!g_options.latency || len < 6) {
+	return;
+    }
+
+    if (cl->count == cl->capacity) {
+	size_t capacity = cl->capacity ? 2 * cl->capacity : 256;
+	uint32_t *latencies = realloc(cl->latencies, capacity * sizeof(*latencies));
+
+	if (!latencies) {
+	    return;
+	}
+	cl->latencies = latencies;
+	cl->capacity = capacity;
+    }
+    /* the stamp wraps, the difference doesn't */
+    cl->latencies[cl->count++] = (uint32_t) monotonic_us() - get_be32((const char *) frame + 2);
+}
+
+/* Splits the framed protocol's stream into records. */
+static int
+add_records(struct lg_client *cl, const char *data, size_t len)
+{
+    while (len > 0) {
+	size_t take = sizeof(cl->record) - cl->record_len;
+	size_t pos = 0;
+
+	if (take > len) {
+	    take = len;
+	}
+	memcpy(cl->record + cl->record_len, data, take);
+	cl->record_len += take;
+	data += take;
+	len -= take;
+
+	while (cl->record_len - pos >= 2) {
+	    size_t record_len = get_be16(cl->record + pos);
+
+	    if (record_len <= RECORD_HEADER_LEN || record_len > RECORD_MAX_LEN) {
+		fprintf(stderr, "Client %d: bad record length %zu\n", cl->id, record_len);
+		return -1;
+	    }
+	    if (cl->record_len - pos < record_len) {
+		break;
+	    }
+	    if (cl->record[pos + 2] == RECORD_FRAME) {
+		add_frame((const uint8_t *) cl->record + pos + RECORD_HEADER_LEN,
+			  record_len - RECORD_HEADER_LEN, cl);
+	    }
+	    pos += record_len;
+	}
+	memmove(cl->record, cl->record + pos, cl->record_len - pos);
+	cl->record_len -= pos;
+    }
+
+    return 0;
+}
+
+/* Reads up to limit bytes. Returns -1 when the connection is gone. */
+static int
+client_read(struct lg_client *cl, size_t limit)
+{
+    char buf[READ_SIZE];
+
+    while (limit > 0) {
+	ssize_t n = read(cl->fd, buf, limit < sizeof(buf) ? limit : sizeof(buf));
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+	} else if (n == 0) {
+	    return -1;
+	}
+
+	cl->bytes += n;
+	limit -= n;
+	if (cl->framed) {
+	    if (add_records(cl, buf, n) < 0) {
+		return -1;
+	    }
+	} else {
+	    frame_parser_feed(&cl->parser, (const uint8_t *) buf, n, add_frame, cl);
+	}
+    }
+
+    return 0;
+}
+
+static void
+client_close(struct lg_client *cl)
+{
+    close(cl->fd);
+    cl->fd = -1;
+}
+
+static int
+connect_client(const char *host, const char *port)
+{
+    struct addrinfo hints, *result, *rp;
+    int s, fd = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    s = getaddrinfo(host, port, &hints, &result);
+    if (s != 0) {
+	fprintf(stderr, "getaddrinfo: %s\n", gai_strerror(s));
+	return -1;
+    }
+
+    for (rp = result; rp != NULL; rp = rp->ai_next) {
+	fd = socket(rp->ai_family, rp->ai_socktype | SOCK_CLOEXEC, rp->ai_protocol);
+	if (fd < 0) {
+	    continue;
+	}
+	if (connect(fd, rp->ai_addr, rp->ai_addrlen) == 0) {
+	    break;
+	}
+	close(fd);
+	fd = -1;
+    }
+    freeaddrinfo(result);
+
+    if (fd < 0) {
+	perror("connect");
+    }
+    return fd;
+}
+
+static int
+compare_latencies(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *) a, y = *(const uint32_t *) b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void
+print_latencies(const char *label, const char *kind, unsigned long frames,
+		unsigned long bytes, uint32_t *latencies, size_t count, const char *state)
+{
+    printf("%-8s %-6s %8lu %10lu", label, kind, frames, bytes);
+    if (count > 0) {
+	qsort(latencies, count, sizeof(*latencies), compare_latencies);
+	printf(" %8u %8u %8u %8u", latencies[count / 2], latencies[count * 9 / 10],
+	       latencies[count * 99 / 100], latencies[count - 1]);
+    } else {
+	printf(" %8s %8s %8s %8s", "-", "-", "-", "-");
+    }
+    printf(*state ? " %s\n" : "\n", state);
+}
+
+static void
+print_summary(const char *label, struct lg_client *clients, int nclients, int slow)
+{
+    unsigned long frames = 0, bytes = 0;
+    uint32_t *all = NULL;
+    size_t count = 0;
+    int i, n = 0, closed = 0;
+    char state[64];
+
+    for (i = 0; i < nclients; i++) {
+	if (clients[i].slow == slow) {
+	    count += clients[i].count;
+	}
+    }
+    if (count > 0) {
+	all = malloc(count * sizeof(*all));
+    }
+
+    count = 0;
+    for (i = 0; i < nclients; i++) {
+	struct lg_client *cl = &clients[i];
+
+	if (cl->slow != slow) {
+	    continue;
+	}
+	n++;
+	closed += cl->fd < 0;
+	frames += cl->frames;
+	bytes += cl->bytes;
+	if (all) {
+	    memcpy(all + count, cl->latencies, cl->count * sizeof(*all));
+	    count += cl->count;
+	}
+    }
+    if (n == 0) {
+	return;
+    }
+
+    snprintf(state, sizeof(state), "%d clients, %d closed", n, closed);
+    print_latencies(label, slow ? "slow" : "fast", frames, bytes, all, count, state);
+    free(all);
+}
+
+/* Returns the CPU time of a process in clock ticks, or -1. */
+static long
+process_cpu(pid_t pid, long *user, long *system)
+{
+    char path[64], buf[1024], *p;
+    ssize_t n;
+    int fd, i;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int) pid);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+	perror(path);
+	return -1;
+    }
+    n = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (n <= 0) {
+	return -1;
+    }
+    buf[n] = '\0';
+
+    /* utime and stime are the 14th and 15th field; the 2nd, the
+     * command name in parentheses, may contain spaces */
+    p = strrchr(buf, ')');
+    for (i = 2; p && i < 14; i++) {
+	p = strchr(p + 1, ' ');
+    }
+    if (!p || sscanf(p, " %ld %ld", user, system) != 2) {
+	return -1;
+    }
+
+    return *user + *system;
+}
+
+static void
+raise_fd_limit(int wanted)
+{
+    struct rlimit limit;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < (rlim_t) wanted) {
+	limit.rlim_cur = limit.rlim_max < (rlim_t) wanted ? limit.rlim_max : (rlim_t) wanted;
+	setrlimit(RLIMIT_NOFILE, &limit);
+    }
+}
+
+static int
+arm_timer(int tfd, long interval_ms)
+{
+    struct itimerspec spec;
+
+    spec.it_value.tv_sec = spec.it_interval.tv_sec = interval_ms / 1000;
+    spec.it_value.tv_nsec = spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000;
+    return timerfd_settime(tfd, 0, &spec, NULL);
+}
+
+static void
+usage(const char *program)
+{
+    fprintf(stderr, "Usage: %s [-c clients] [-s slow-clients] [-d slow-interval-ms] "
+	    "[-r slow-read-bytes] [-t seconds] [-F] [-l] [-P forwarder-pid] host port\n",
+	    program);
+}
+
+int
+main(int argc, char *argv[])
+{
+    struct lg_client *clients;
+    struct epoll_event event, events[MAXEVENTS];
+    int nclients = 100, nslow = 0, duration = 10, opt, i, efd, end_fd, slow_fd;
+    long slow_interval = 100;
+    long user_start = 0, system_start = 0, user_end = 0, system_end = 0;
+    pid_t pid = 0;
+    uint64_t start, elapsed;
+    int done = 0;
+
+    g_options.slow_read = 64;
+
+    while ((opt = getopt(argc, argv, "c:s:d:r:t:FlP:")) != -1) {
+	switch (opt) {
+	    case 'c':
+		nclients = atoi(optarg);
+		break;
+	    case 's':
+		nslow = atoi(optarg);
+		break;
+	    case 'd':
+		slow_interval = atol(optarg);
+		break;
+	    case 'r':
+		g_options.slow_read = strtoul(optarg, NULL, 0);
+		break;
+	    case 't':
+		duration = atoi(optarg);
+		break;
+	    case 'F':
+		g_options.framed = 1;
+		break;
+	    case 'l':
+		g_options.latency = 1;
+		break;
+	    case 'P':
+		pid = atoi(optarg);
+		break;
+	    default:
+		usage(argv[0]);
+		exit(EXIT_FAILURE);
+	}
+    }
+    if (argc - optind != 2 || nclients < 1 || nslow < 0 || nslow > nclients ||
+	slow_interval < 1 || g_options.slow_read == 0 || duration < 1) {
+	usage(argv[0]);
+	exit(EXIT_FAILURE);
+    }
+
+    raise_fd_limit(nclients + 16);
+    clients = calloc(nclients, sizeof(*clients));
+    efd = epoll_create1(EPOLL_CLOEXEC);
+    end_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    slow_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (!clients || efd < 0 || end_fd < 0 || slow_fd < 0) {
+	perror("setup");
+	exit(EXIT_FAILURE);
+    }
+
+    /* the last clients are the slow ones */
+    for (i = 0; i < nclients; i++) {
+	struct lg_client *cl = &clients[i];
+
+	cl->id = i;
+	cl->framed = g_options.framed;
+	cl->slow = i >= nclients - nslow;
+	frame_parser_init(&cl->parser);
+	cl->fd = connect_client(argv[optind], argv[optind + 1]);
+	if (cl->fd < 0) {
+	    fprintf(stderr, "Could only connect %d clients\n", i);
+	    exit(EXIT_FAILURE);
+	}
+	if (cl->framed && write(cl->fd, "STREAM\n", 7) != 7) {
+	    perror("write");
+	    exit(EXIT_FAILURE);
+	}
+	fcntl(cl->fd, F_SETFL, fcntl(cl->fd, F_GETFL) | O_NONBLOCK);
+
+	/* slow clients are only read on the timer */
+	if (!cl->slow) {
+	    event.events = EPOLLIN;
+	    event.data.ptr = cl;
+	    if (epoll_ctl(efd, EPOLL_CTL_ADD, cl->fd, &event) < 0) {
+		perror("epoll_ctl");
+		exit(EXIT_FAILURE);
+	    }
+	}
+    }
+
+    event.events = EPOLLIN;
+    event.data.ptr = &end_fd;
+    epoll_ctl(efd, EPOLL_CTL_ADD, end_fd, &event);
+    event.data.ptr = &slow_fd;
+    epoll_ctl(efd, EPOLL_CTL_ADD, slow_fd, &event);
+    arm_timer(end_fd, duration * 1000L);
+    if (nslow > 0) {
+	arm_timer(slow_fd, slow_interval);
+    }
+
+    if (pid > 0 && process_cpu(pid, &user_start, &system_start) < 0) {
+	pid = 0;
+    }
+    start = monotonic_us();
+
+    while (!done) {
+	int n = epoll_wait(efd, events, MAXEVENTS, -1);
+
+	if (n < 0) {
+	    if (errno == EINTR) {
+		continue;
+	    }
+	    perror("epoll_wait");
+	    break;
+	}
+
+	for (i = 0; i < n; i++) {
+	    void *ptr = events[i].data.ptr;
+	    uint64_t expirations;
+
+	    if (ptr == &end_fd) {
+		done = 1;
+	    } else if (ptr == &slow_fd) {
+		int j;
+
+		if (read(slow_fd, &expirations, sizeof(expirations)) < 0) {
+		    continue;
+		}
+		for (j = nclients - nslow; j < nclients; j++) {
+		    struct lg_client *cl = &clients[j];
+
+		    if (cl->fd >= 0 && client_read(cl, g_options.slow_read) < 0) {
+			client_close(cl);
+		    }
+		}
+	    } else {
+		struct lg_client *cl = ptr;
+
+		if (client_read(cl, (size_t) -1) < 0) {
+		    client_close(cl);
+		}
+	    }
+	}
+    }
+
+    elapsed = monotonic_us() - start;
+    if (pid > 0 && process_cpu(pid, &user_end, &system_end) < 0) {
+	pid = 0;
+    }
+
+    printf("%-8s %-6s %8s %10s %8s %8s %8s %8s\n", "client", "kind", "frames", "bytes",
+	   "p50_us", "p90_us", "p99_us", "max_us");
+    for (i = 0; i < nclients; i++) {
+	struct lg_client *cl = &clients[i];
+	char label[16];
+
+	snprintf(label, sizeof(label), "%d", cl->id);
+	print_latencies(label, cl->slow ? "slow" : "fast", cl->frames, cl->bytes,
+			cl->latencies, cl->count, cl->fd < 0 ? "closed" : "");
+    }
+    print_summary("total", clients, nclients, 0);
+    print_summary("total", clients, nclients, 1);
+
+    if (pid > 0) {
+	long ticks = sysconf(_SC_CLK_TCK);
+	double user = (double) (user_end - user_start) / ticks;
+	double system = (double) (system_end - system_start) / ticks;
+
+	printf("forwarder cpu: %.2fs user, %.2fs system, %.1f%% of a core over %.1fs\n",
+	       user, system, 100.0 * (user + system) * 1000000 / elapsed, elapsed / 1e6);
+    }
+
+    for (i = 0; i < nclients; i++) {
+	if (clients[i].fd >= 0) {
+	    close(clients[i].fd);
+	}
+	free(clients[i].latencies);
+    }
+    free(clients);
+    close(slow_fd);
+    close(end_fd);
+    close(efd);
+
+    return 0;
+}